@@ -0,0 +1,216 @@
+/*
+ * buffer_pool.cpp:
+ * Recycle page and decompression buffers instead of mallocing them each time.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "buffer_pool.h"
+#include "dfxml/src/dfxml_writer.h"
+
+uint32_t buffer_pool::opt_pool_mb = 256;
+bool     buffer_pool::opt_hugepages = false;
+
+buffer_pool &buffer_pool::get()
+{
+    static buffer_pool singleton;
+    return singleton;
+}
+
+/* The buffers a thread freed last, as (class,buffer) pairs; only that thread uses it */
+class buffer_pool::thread_cache {
+public:
+    thread_cache():n(0),bytes(0){}
+    size_t n;
+    size_t bytes;
+    size_t cls[cache_buffers];
+    void   *buf[cache_buffers];
+};
+
+buffer_pool::buffer_pool():M(),free_lists(),page_bytes(0),free_bytes(0),cache_key(),
+                           hits(0),thread_hits(0),misses(0),unpooled(0),released(0)
+{
+    pthread_mutex_init(&M,NULL);
+    if(pthread_key_create(&cache_key,release_cache)) errx(1,"pthread_key_create failed");
+}
+
+/* A thread is exiting; its buffers go back to the shared lists */
+void buffer_pool::release_cache(void *arg)
+{
+    thread_cache *tc = (thread_cache *)arg;
+    for(size_t i=0;i<tc->n;i++){
+        get().free_shared(tc->buf[i],tc->cls[i]);
+    }
+    delete tc;
+}
+
+size_t buffer_pool::size_class(size_t size) const
+{
+    if(page_bytes && size<=page_bytes && size>page_bytes/2) return page_bytes;
+    if(size < min_pooled) return 0;
+    size_t p = min_pooled;
+    while(p <= size/2) p <<= 1;         // p <= size < 2p
+    size_t step = p/4;
+    return (size + step - 1) / step * step;
+}
+
+/**
+ * Get a new buffer from the system. Anonymous mappings are used so that
+ * huge pages can be requested for them; prefault touches every page now
+ * rather than on first use.
+ */
+void *buffer_pool::map_buffer(size_t size,bool prefault)
+{
+#if defined(HAVE_MMAP) && !defined(WIN32) && defined(MAP_ANONYMOUS)
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+    void *buf = mmap(0,size,PROT_READ|PROT_WRITE,flags,-1,0);
+    if(buf==MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+    if(opt_hugepages) madvise(buf,size,MADV_HUGEPAGE);
+#endif
+#else
+    void *buf = malloc(size);
+    if(buf==0) return 0;
+#endif
+    if(prefault){
+        for(size_t i=0;i<size;i+=4096){
+            ((volatile uint8_t *)buf)[i] = 0;
+        }
+    }
+    return buf;
+}
+
+void buffer_pool::unmap_buffer(void *buf,size_t size)
+{
+#if defined(HAVE_MMAP) && !defined(WIN32) && defined(MAP_ANONYMOUS)
+    munmap(buf,size);
+#else
+    ::free(buf);
+#endif
+}
+
+/**
+ * Set the page buffer size and put count faulted-in page buffers in the pool.
+ * Must be called before anything is allocated, or the size classes would change.
+ */
+void buffer_pool::prefill(size_t page_bytes_,uint32_t count)
+{
+    if(opt_pool_mb==0) return;
+    pthread_mutex_lock(&M);
+    if(page_bytes==0 && misses==0 && unpooled==0) page_bytes = page_bytes_;
+    pthread_mutex_unlock(&M);
+    if(page_bytes!=page_bytes_) return;
+    for(uint32_t i=0;i<count;i++){
+        void *buf = map_buffer(page_bytes,true);
+        if(buf==0) break;
+        bool kept = false;
+        pthread_mutex_lock(&M);
+        if(free_bytes + page_bytes <= (uint64_t)opt_pool_mb*1024*1024){
+            free_lists[page_bytes].push_back(buf);
+            free_bytes += page_bytes;
+            kept = true;
+        }
+        pthread_mutex_unlock(&M);
+        if(!kept){
+            unmap_buffer(buf,page_bytes);
+            break;
+        }
+    }
+}
+
+void *buffer_pool::alloc(size_t size)
+{
+    size_t cls = opt_pool_mb ? size_class(size) : 0;
+    if(cls==0){
+        void *buf = malloc(size);
+        if(buf==0) throw std::bad_alloc();
+        __sync_fetch_and_add(&unpooled,1);
+        return buf;
+    }
+    void *buf = 0;
+    thread_cache *tc = (thread_cache *)pthread_getspecific(cache_key);
+    if(tc){
+        for(size_t i=0;i<tc->n;i++){
+            if(tc->cls[i]!=cls) continue;
+            buf = tc->buf[i];
+            tc->n--;
+            tc->cls[i] = tc->cls[tc->n];
+            tc->buf[i] = tc->buf[tc->n];
+            tc->bytes -= cls;
+            __sync_fetch_and_add(&hits,1);
+            __sync_fetch_and_add(&thread_hits,1);
+            return buf;
+        }
+    }
+    pthread_mutex_lock(&M);
+    free_map_t::iterator it = free_lists.find(cls);
+    if(it!=free_lists.end() && it->second.size()>0){
+        buf = it->second.back();
+        it->second.pop_back();
+        free_bytes -= cls;
+        hits++;
+    } else {
+        misses++;
+    }
+    pthread_mutex_unlock(&M);
+    if(buf==0) buf = map_buffer(cls,false);
+    if(buf==0) throw std::bad_alloc();
+    return buf;
+}
+
+void buffer_pool::free(void *buf,size_t size)
+{
+    if(buf==0) return;
+    size_t cls = opt_pool_mb ? size_class(size) : 0;
+    if(cls==0){
+        ::free(buf);
+        return;
+    }
+    if(cls!=page_bytes && cls<=cache_bytes){
+        thread_cache *tc = (thread_cache *)pthread_getspecific(cache_key);
+        if(tc==0){
+            tc = new thread_cache();
+            pthread_setspecific(cache_key,tc);
+        }
+        if(tc->n<cache_buffers && tc->bytes+cls<=cache_bytes){
+            tc->cls[tc->n] = cls;
+            tc->buf[tc->n] = buf;
+            tc->n++;
+            tc->bytes += cls;
+            return;
+        }
+    }
+    free_shared(buf,cls);
+}
+
+void buffer_pool::free_shared(void *buf,size_t cls)
+{
+    pthread_mutex_lock(&M);
+    if(free_bytes + cls <= (uint64_t)opt_pool_mb*1024*1024){
+        free_lists[cls].push_back(buf);
+        free_bytes += cls;
+        buf = 0;
+    } else {
+        released++;
+    }
+    pthread_mutex_unlock(&M);
+    if(buf) unmap_buffer(buf,cls);
+}
+
+void buffer_pool::dump_stats(dfxml_writer &xreport)
+{
+    if(opt_pool_mb==0) return;
+    pthread_mutex_lock(&M);
+    std::stringstream ss;
+    ss << "max_mb='" << opt_pool_mb << "' page_bytes='" << page_bytes << "'"
+       << " hugepages='" << (opt_hugepages ? 1 : 0) << "'";
+    xreport.push("buffer_pool",ss.str());
+    xreport.xmlout("hits",hits);
+    xreport.xmlout("thread_hits",thread_hits);
+    xreport.xmlout("misses",misses);
+    xreport.xmlout("unpooled",unpooled);
+    xreport.xmlout("released",released);
+    xreport.xmlout("free_bytes",free_bytes);
+    xreport.pop();
+    pthread_mutex_unlock(&M);
+}
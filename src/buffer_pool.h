@@ -0,0 +1,111 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+/**
+ * \file
+ * buffer_pool recycles the large buffers that pages and decompressed
+ * children are read into, so that they are not malloc'ed, page-faulted
+ * and freed for every page.
+ *
+ * Buffers are grouped in size classes: the page buffer size
+ * (pagesize+margin) is a class of its own, and everything else is rounded
+ * up to the next quarter of a power of two, so that no more than a quarter
+ * of a buffer is wasted. Buffers smaller than min_pooled come from malloc(),
+ * which does as well with them as the pool would.
+ *
+ * Each thread keeps the last few buffers it freed (but not page buffers,
+ * which are read into by one thread and freed by another) and takes them
+ * back without a lock; the scanners that decompress into scratch buffers
+ * free and allocate them on the same thread. What does not fit there goes
+ * back on the shared free list of its class as long as the shared lists
+ * hold less than opt_pool_mb in total; otherwise it is released. Page
+ * buffers are allocated and faulted in up front by prefill(), and may be
+ * backed by huge pages.
+ *
+ * With opt_pool_mb set to 0 the pool just calls malloc() and free().
+ */
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+class buffer_pool {
+    /*** neither copying nor assignment is implemented ***/
+    buffer_pool(const buffer_pool &);
+    buffer_pool &operator=(const buffer_pool &);
+    buffer_pool();
+
+    class thread_cache;
+    typedef std::map<size_t,std::vector<void *> > free_map_t;
+    pthread_mutex_t M;
+    free_map_t  free_lists;             // by size class
+    size_t      page_bytes;             // size class for page buffers
+    uint64_t    free_bytes;             // bytes sitting in free_lists
+    pthread_key_t cache_key;
+    size_t      size_class(size_t size) const; // 0 if size is not pooled
+    void        *map_buffer(size_t size,bool prefault);
+    void        unmap_buffer(void *buf,size_t size);
+    void        free_shared(void *buf,size_t cls);
+    static void release_cache(void *arg);
+public:
+    static uint32_t opt_pool_mb;        // most memory to keep for reuse; 0 disables the pool
+    static bool     opt_hugepages;      // ask for transparent huge pages
+    static const size_t min_pooled = 256*1024;         // smaller buffers are malloc'ed
+    static const size_t cache_buffers = 8;             // buffers each thread keeps
+    static const size_t cache_bytes = 16*1024*1024;    // and the bytes they may take
+    static buffer_pool &get();
+
+    uint64_t    hits;                   // allocations served from a free list
+    uint64_t    thread_hits;            // of which from the thread's own
+    uint64_t    misses;                 // allocations that had to map a new buffer
+    uint64_t    unpooled;               // allocations too small to pool, malloc'ed
+    uint64_t    released;               // buffers freed because the pool was full
+
+    void        prefill(size_t page_bytes,uint32_t count); // allocate and fault in page buffers
+    void        *alloc(size_t size);    // throws std::bad_alloc
+    void        free(void *buf,size_t size);
+    void        dump_stats(class dfxml_writer &xreport);
+};
+
+/**
+ * An sbuf whose buffer came from the pool and goes back to it.
+ */
+class pooled_sbuf : public sbuf_t {
+    /*** neither copying nor assignment is implemented ***/
+    pooled_sbuf(const pooled_sbuf &);
+    pooled_sbuf &operator=(const pooled_sbuf &);
+    const size_t allocated;
+public:
+    pooled_sbuf(const pos0_t &pos0_,const uint8_t *buf_,size_t bufsize_,size_t pagesize_,size_t allocated_):
+        sbuf_t(pos0_,buf_,bufsize_,pagesize_,false),allocated(allocated_){}
+    virtual ~pooled_sbuf(){
+        buffer_pool::get().free((void *)buf,allocated);
+    }
+};
+
+/**
+ * A drop-in replacement for managed_malloc<TYPE> that uses the pool,
+ * for scanners that decompress into large scratch buffers.
+ */
+template < class TYPE > class pooled_malloc {
+    /*** neither copying nor assignment is implemented ***/
+    pooled_malloc(const pooled_malloc &);
+    pooled_malloc &operator=(const pooled_malloc &);
+    const size_t bytes;
+public:
+    TYPE *buf;
+    pooled_malloc(size_t count):bytes(count*sizeof(TYPE)),
+                                buf((TYPE *)buffer_pool::get().alloc(count*sizeof(TYPE))){}
+    ~pooled_malloc(){
+        buffer_pool::get().free((void *)buf,bytes);
+    }
+    /* Give the buffer away; whoever takes it frees it with buffer_pool::free(buf,size()) */
+    TYPE *release(){
+        TYPE *b = buf;
+        buf = 0;
+        return b;
+    }
+    size_t size() const { return bytes; }
+};
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * checkpoint.cpp:
+ * The restart bitmap; see checkpoint.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "image_process.h"
+#include "checkpoint.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#include <sys/time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+uint32_t    page_checkpoint::opt_seconds = 0;
+const char *page_checkpoint::file_name = "checkpoint.bin";
+
+static const char checkpoint_magic[8] = {'B','E','C','K','P','T','\r','\n'};
+static const uint32_t checkpoint_version = 1;
+
+static uint64_t popcount64(uint64_t w)
+{
+    uint64_t n = 0;
+    for(;w;w &= w-1) n++;
+    return n;
+}
+
+bool page_checkpoint::matches(const std::string &fname,const std::string &image_fname,uint64_t pagesize)
+{
+    header h;
+    int fd = ::open(fname.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) return false;
+    ssize_t got = ::read(fd,&h,sizeof(h));
+    ::close(fd);
+    return got==(ssize_t)sizeof(h)
+        && memcmp(h.magic,checkpoint_magic,sizeof(h.magic))==0
+        && h.version==checkpoint_version
+        && h.pagesize==pagesize
+        && h.name_len==image_fname.size() && h.name_len<=sizeof(h.name)
+        && memcmp(h.name,image_fname.data(),h.name_len)==0;
+}
+
+page_checkpoint::page_checkpoint(int fd_,uint8_t *map_,size_t map_size_,uint64_t pagesize_,uint64_t pages_,bool resumed):
+    fd(fd_),map(map_),map_size(map_size_),hdr((header *)map_),
+    in_flight((uint64_t *)(map_+header_bytes)),bits((uint64_t *)(map_+bitmap_offset)),
+    pagesize(pagesize_),pages(pages_),words((pages_+63)/64),
+    live(new uint64_t[(pages_+63)/64]),units(new int[pages_]),resumed_(resumed),fs(0),
+    M(),STOP(),stopping(false),thread(),
+    pages_done_before(0),in_flight_before(0),pages_done(0),lines_dropped(0),syncs(0)
+{
+    if(pthread_mutex_init(&M,NULL))   errx(1,"pthread_mutex_init failed");
+    if(pthread_cond_init(&STOP,NULL)) errx(1,"pthread_cond_init failed");
+    memcpy(live,bits,words*8);
+    memset((void *)units,0,pages*sizeof(int));
+    for(uint64_t i=0;i<words;i++) pages_done_before += popcount64(bits[i]);
+    in_flight_before = hdr->in_flight;
+    if(opt_seconds>0 && pthread_create(&thread,NULL,run,(void *)this)) errx(1,"cannot create checkpoint thread");
+}
+
+page_checkpoint *page_checkpoint::open(const std::string &fname,const image_process &p,
+                                       const std::string &image_fname)
+{
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    if(opt_seconds==0 || !p.can_seek() || p.pagesize==0 || p.image_size()<=0) return 0;
+    if(dynamic_cast<const process_dir *>(&p)) return 0; // its "offsets" are files
+    const uint64_t pages = (p.image_size()+p.pagesize-1) / p.pagesize;
+    const size_t map_size = bitmap_offset + ((pages+63)/64)*8;
+    if(image_fname.size() > sizeof(((header *)0)->name)) return 0;
+
+    bool exists = access(fname.c_str(),F_OK)==0;
+    if(exists && !matches(fname,image_fname,p.pagesize)){
+        std::cerr << fname << " is not a checkpoint of this image with this page size; starting it over\n";
+        exists = false;
+    }
+    int fd = ::open(fname.c_str(),O_RDWR|O_CREAT|(exists ? 0 : O_TRUNC)|O_BINARY,0666);
+    if(fd<0){
+        std::cerr << "Cannot open " << fname << ": " << strerror(errno) << "\n";
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd,&st) || (exists && (uint64_t)st.st_size != map_size)){
+        errx(1,"%s does not match the size of %s; the image has changed",fname.c_str(),image_fname.c_str());
+    }
+    if(!exists && ftruncate(fd,map_size)){
+        std::cerr << "Cannot size " << fname << ": " << strerror(errno) << "\n";
+        ::close(fd);
+        return 0;
+    }
+    void *buf = mmap(0,map_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if(buf==MAP_FAILED){
+        std::cerr << "Cannot map " << fname << ": " << strerror(errno) << "\n";
+        ::close(fd);
+        return 0;
+    }
+    header *h = (header *)buf;
+    if(!exists){
+        memcpy(h->magic,checkpoint_magic,sizeof(h->magic));
+        h->version    = checkpoint_version;
+        h->name_len   = image_fname.size();
+        h->pagesize   = p.pagesize;
+        h->image_size = p.image_size();
+        h->pages      = pages;
+        h->in_flight  = 0;
+        memcpy(h->name,image_fname.data(),image_fname.size());
+    } else if(h->image_size != (uint64_t)p.image_size()){
+        errx(1,"%s is for an image of %llu bytes; %s has changed",
+             fname.c_str(),(unsigned long long)h->image_size,image_fname.c_str());
+    }
+    page_checkpoint *cp = new page_checkpoint(fd,(uint8_t *)buf,map_size,p.pagesize,pages,exists);
+    if(!exists) cp->sync();
+    return cp;
+#else
+    return 0;
+#endif
+}
+
+page_checkpoint::~page_checkpoint()
+{
+    pthread_mutex_lock(&M);
+    stopping = true;
+    pthread_cond_broadcast(&STOP);
+    pthread_mutex_unlock(&M);
+    if(opt_seconds>0) pthread_join(thread,NULL);
+    sync();
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    munmap(map,map_size);
+#endif
+    ::close(fd);
+    delete [] live;
+    delete [] units;
+    pthread_mutex_destroy(&M);
+    pthread_cond_destroy(&STOP);
+}
+
+void *page_checkpoint::run(void *arg)
+{
+    page_checkpoint &self = *(page_checkpoint *)arg;
+    pthread_mutex_lock(&self.M);
+    while(!self.stopping){
+        struct timeval now;
+        gettimeofday(&now,0);
+        struct timespec until;
+        until.tv_sec  = now.tv_sec + opt_seconds;
+        until.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&self.STOP,&self.M,&until);
+        if(self.stopping) break;
+        pthread_mutex_unlock(&self.M);
+        self.sync();
+        pthread_mutex_lock(&self.M);
+    }
+    pthread_mutex_unlock(&self.M);
+    return 0;
+}
+
+bool page_checkpoint::done(int64_t offset)
+{
+    if(offset<0 || offset % pagesize) return false;
+    uint64_t page = offset / pagesize;
+    if(page>=pages) return false;
+    uint64_t w = __sync_fetch_and_add(&live[page/64],0);
+    return (w >> (page%64)) & 1;
+}
+
+void page_checkpoint::unit_queued(uint64_t offset)
+{
+    if(offset % pagesize || offset/pagesize >= pages) return;
+    __sync_fetch_and_add(&units[offset/pagesize],1);
+}
+
+void page_checkpoint::unit_done(uint64_t offset)
+{
+    if(offset % pagesize || offset/pagesize >= pages) return;
+    const uint64_t page = offset / pagesize;
+    if(__sync_sub_and_fetch(&units[page],1)>0) return;
+    __sync_fetch_and_or(&live[page/64],(uint64_t)1 << (page%64));
+    __sync_fetch_and_add(&pages_done,1);
+}
+
+/**
+ * Take the bits of the pages done so far, make their features durable,
+ * and only then write the bits and the pages in flight to the file.
+ */
+void page_checkpoint::sync()
+{
+    pthread_mutex_lock(&M);
+    std::vector<uint64_t> snapshot(words);
+    for(size_t i=0;i<words;i++) snapshot[i] = __sync_fetch_and_add(&live[i],0);
+    uint64_t n = 0;
+    for(uint64_t page=0;page<pages && n<max_in_flight;page++){
+        if(__sync_fetch_and_add(&units[page],0)>0) in_flight[n++] = page*pagesize;
+    }
+
+    if(fs){
+        fs->flush_all();
+        std::vector<std::string> names;
+        fs->get_feature_file_list(names);
+        for(std::vector<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+            feature_recorder *fr = fs->get_name(*it);
+            if(fr==0) continue;
+            int ffd = ::open(fr->fname_counter("").c_str(),O_RDONLY|O_BINARY);
+            if(ffd<0) continue;
+            fsync(ffd);
+            ::close(ffd);
+        }
+    }
+
+    if(words>0) memcpy(bits,&snapshot[0],words*8);
+    hdr->in_flight = n;
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    msync(map,map_size,MS_SYNC);
+#endif
+    fsync(fd);
+    __sync_fetch_and_add(&syncs,1);
+    pthread_mutex_unlock(&M);
+}
+
+/**
+ * A page without a bit is scanned again, so whatever the last run wrote
+ * for it is removed first. The page of a line is the offset it starts
+ * with; lines that do not start with an offset are kept.
+ */
+void page_checkpoint::drop_unfinished(const std::string &fname)
+{
+    std::ifstream in(fname.c_str(),std::ios::binary);
+    if(!in.is_open()) return;
+    const std::string tmpname = fname + ".tmp";
+    std::ofstream out(tmpname.c_str(),std::ios::binary|std::ios::trunc);
+    if(!out.is_open()) err(1,"Cannot create %s",tmpname.c_str());
+    uint64_t dropped = 0;
+    std::string line;
+    while(getline(in,line)){
+        if(line.size()>0 && isdigit((unsigned char)line[0])){
+            uint64_t page = strtoull(line.c_str(),0,10) / pagesize;
+            if(page<pages && ((live[page/64] >> (page%64)) & 1)==0){
+                dropped++;
+                continue;
+            }
+        }
+        out << line;
+        if(!in.eof()) out << "\n";
+    }
+    in.close();
+    out.close();
+    if(out.fail()) errx(1,"Cannot write %s",tmpname.c_str());
+    if(rename(tmpname.c_str(),fname.c_str())) err(1,"Cannot rename %s to %s",tmpname.c_str(),fname.c_str());
+    lines_dropped += dropped;
+}
+
+void page_checkpoint::dump_stats(dfxml_writer &xreport) const
+{
+    std::stringstream ss;
+    ss << "pages='" << pages << "' pagesize='" << pagesize << "'";
+    xreport.push("checkpoint",ss.str());
+    xreport.xmlout("pages_done_before",pages_done_before);
+    xreport.xmlout("pages_in_flight_before",in_flight_before);
+    xreport.xmlout("pages_done",pages_done);
+    if(lines_dropped) xreport.xmlout("lines_dropped",lines_dropped);
+    xreport.xmlout("syncs",syncs);
+    xreport.pop();
+}
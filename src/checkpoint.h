@@ -0,0 +1,107 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+/**
+ * \file
+ * page_checkpoint keeps a bitmap of the pages of an image that have been
+ * completely scanned, in a file in the output directory that is mapped
+ * into memory and synced to disk every opt_seconds. A restart maps the
+ * same file and skips the pages whose bits are set, instead of parsing
+ * every work_start of report.xml into a set of strings.
+ *
+ * A page is complete when the last unit that came from it finishes: the
+ * page itself, the per-scanner units of a split page, and the sub-tasks
+ * of asynchronous recursion. Each page has an atomic count of its units
+ * in the pool. Pages that still have units in the pool have no bit; their
+ * offsets are written into the file at each sync, so that a restart can
+ * say how many pages were cut off mid-scan.
+ *
+ * The bits are set in memory and copied into the file at each sync, after
+ * the feature files have been flushed and fsync'ed, so a bit on disk never
+ * stands for features that are not. A restart removes the lines of every
+ * page without a bit from the feature files before it scans them again.
+ *
+ * File layout, all in host byte order:
+ *   0                 header (magic, sizes, image name)
+ *   header_bytes      offsets of the pages in flight at the last sync
+ *   bitmap_offset     one bit per page, in 64-bit words
+ *
+ * Only images whose pages are at multiples of the page size are
+ * checkpointed; -R directories and streams restart from report.xml.
+ * Only feature files can be cut back to the finished pages, so a run
+ * with SQLite feature output, or whose last run carved files, does not
+ * resume from a checkpoint. The checkpoint is off unless
+ * checkpoint_seconds is set.
+ */
+
+#include <string>
+#include <pthread.h>
+
+class page_checkpoint {
+    /*** neither copying nor assignment is implemented ***/
+    page_checkpoint(const page_checkpoint &);
+    page_checkpoint &operator=(const page_checkpoint &);
+
+    class header {
+    public:
+        char     magic[8];
+        uint32_t version;
+        uint32_t name_len;
+        uint64_t pagesize;
+        uint64_t image_size;
+        uint64_t pages;
+        uint64_t in_flight;             // entries in the in-flight list
+        char     name[4096-48];         // the image filename, not terminated
+    };
+    static const size_t header_bytes    = 4096;
+    static const size_t max_in_flight   = 4096;
+    static const size_t bitmap_offset   = header_bytes + max_in_flight*8;
+
+    int             fd;
+    uint8_t         *map;
+    size_t          map_size;
+    header          *hdr;
+    uint64_t        *in_flight;         // in the file
+    uint64_t        *bits;              // in the file, as of the last sync
+    const uint64_t  pagesize;
+    const uint64_t  pages;
+    const size_t    words;              // of the bitmap
+    uint64_t        *live;              // the bitmap as the pages finish
+    volatile int    *units;             // units in the pool, by page (atomic)
+    const bool      resumed_;
+    class feature_recorder_set *fs;
+    pthread_mutex_t M;                  // one sync at a time
+    pthread_cond_t  STOP;
+    bool            stopping;
+    pthread_t       thread;
+    static void *run(void *arg);
+    page_checkpoint(int fd_,uint8_t *map_,size_t map_size_,uint64_t pagesize_,uint64_t pages_,bool resumed);
+public:
+    static uint32_t opt_seconds;        // how often to sync; 0 (the default) for no checkpoint
+    static const char *file_name;       // in the output directory
+
+    /* true if fname is a checkpoint of image_fname with this page size */
+    static bool matches(const std::string &fname,const std::string &image_fname,uint64_t pagesize);
+    /* map fname, creating it if it does not exist; 0 if the image cannot be checkpointed */
+    static page_checkpoint *open(const std::string &fname,const class image_process &p,
+                                 const std::string &image_fname);
+    ~page_checkpoint();
+    bool resumed() const { return resumed_; } // the file is from an earlier run
+    void set_recorders(class feature_recorder_set *fs_){fs=fs_;} // flushed at each sync
+    void drop_unfinished(const std::string &fname); // remove the lines of pages without a bit
+
+    /* statistics */
+    uint64_t        pages_done_before;  // bits set when the file was opened
+    uint64_t        in_flight_before;   // pages cut off by the last run
+    uint64_t        pages_done;         // bits set by this run
+    uint64_t        lines_dropped;      // by drop_unfinished()
+    uint64_t        syncs;
+
+    bool done(int64_t offset);          // was the page at this offset completed?
+    void unit_queued(uint64_t offset);  // a unit from the page at this image offset went into the pool
+    void unit_done(uint64_t offset);    // and came out
+    void sync();
+    void dump_stats(class dfxml_writer &xreport) const;
+};
+
+#endif
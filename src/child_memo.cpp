@@ -0,0 +1,298 @@
+/*
+ * child_memo.cpp:
+ * Decompress and scan the same compressed bytes once; see child_memo.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "child_memo.h"
+#include "page_dedup.h"
+#include "dfxml/src/dfxml_writer.h"
+#include "dfxml/src/hash_t.h"
+
+#include <algorithm>
+#include <iomanip>
+
+uint32_t child_memo::opt_max_entries = 4096;
+child_memo::shard child_memo::shards[child_memo::shard_count];
+
+static const size_t prefix_bytes = 64;  // hashed to find the entries to check
+
+static pthread_key_t  capture_key;
+static pthread_once_t capture_key_once = PTHREAD_ONCE_INIT;
+static void make_capture_key()
+{
+    if(pthread_key_create(&capture_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+/* process_sbuf() runs these on a child it has seen before, so a hit cannot stand for them */
+static bool ngram_scanners = false;
+static pthread_once_t ngram_scanners_once = PTHREAD_ONCE_INIT;
+static void find_ngram_scanners()
+{
+    for(be13::plugin::scanner_vector::const_iterator it = be13::plugin::current_scanners.begin();
+        it!=be13::plugin::current_scanners.end();it++){
+        if((*it)->enabled && ((*it)->info.flags & scanner_info::SCANNER_WANTS_NGRAMS)) ngram_scanners = true;
+    }
+}
+
+static bool usable(const scanner_params &sp)
+{
+    pthread_once(&ngram_scanners_once,find_ngram_scanners);
+    return !ngram_scanners && sp.depth+1 < scanner_def::max_depth
+        && dynamic_cast<dedup_feature_recorder_set *>(&sp.fs)!=0;
+}
+
+child_memo::child_memo(const scanner_params &sp_,const char *scanner_,const uint8_t *in_,size_t avail_,uint64_t salt_):
+    consumed(0),child_bytes(0),sp(sp_),scanner(scanner_),in(in_),avail(avail_),salt(salt_),
+    enabled(opt_max_entries>0 && avail_>0 && usable(sp_)),
+    probe(0)
+{
+    if(!enabled) return;
+    uint64_t h1=0,h2=0;
+    page_dedup::hash(in,std::min(avail,prefix_bytes),&h1,&h2);
+    uint64_t n = 0xcbf29ce484222325ULL;  // FNV-1a of the scanner name
+    for(const char *cc=scanner;*cc;cc++) n = (n ^ (uint8_t)*cc) * 0x100000001b3ULL;
+    probe = h1 ^ n ^ (salt * 0x9E3779B185EBCA87ULL) ^ ((uint64_t)sp.depth << 56);
+}
+
+/* The entry was made by this scanner, with these settings, from input that this input can stand for */
+bool child_memo::matches(const entry &e) const
+{
+    if(e.probe!=probe || e.fs!=&sp.fs || e.depth!=sp.depth || e.salt!=salt || strcmp(e.scanner,scanner)!=0) return false;
+    return e.exact ? e.len==avail : e.len<=avail;
+}
+
+bool child_memo::replay(const pos0_t &child_pos0)
+{
+    if(!enabled) return false;
+    shard &s = my_shard();
+
+    /* Hash the input outside the lock, once for each length that might match */
+    std::vector<size_t> lens;
+    pthread_mutex_lock(&s.M);
+    s.counts_map[scanner].lookups++;
+    std::pair<index_t::iterator,index_t::iterator> r = s.index.equal_range(probe);
+    for(index_t::iterator it=r.first;it!=r.second;it++){
+        if(matches(*it->second) && std::find(lens.begin(),lens.end(),it->second->len)==lens.end()){
+            lens.push_back(it->second->len);
+        }
+    }
+    pthread_mutex_unlock(&s.M);
+
+    for(std::vector<size_t>::const_iterator len=lens.begin();len!=lens.end();len++){
+        const md5_t md5 = md5_generator::hash_buf(in,*len);
+        std::vector<child> children;
+        bool found = false;
+        pthread_mutex_lock(&s.M);
+        r = s.index.equal_range(probe);
+        for(index_t::iterator it=r.first;it!=r.second;it++){
+            const entry &e = *it->second;
+            if(matches(e) && e.len==*len && memcmp(e.md5,md5.digest,sizeof(e.md5))==0){
+                s.entries.splice(s.entries.begin(),s.entries,it->second);
+                children = e.children;
+                consumed = e.len;
+                child_bytes = e.child_bytes;
+                counts &c = s.counts_map[scanner];
+                c.hits++;
+                c.input_bytes += e.len;
+                c.child_bytes += e.child_bytes;
+                found = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&s.M);
+        if(!found) continue;
+
+        /* Each child was seen earlier in this image; see process_sbuf() */
+        feature_recorder *alert_recorder = be13::plugin::dup_data_alerts ? sp.fs.get_alert_recorder() : 0;
+        for(std::vector<child>::const_iterator c=children.begin();c!=children.end();c++){
+            if(alert_recorder){
+                std::stringstream ss;
+                ss << "<buflen>" << c->bufsize << "</buflen>";
+                alert_recorder->write(pos0_t(child_pos0.path,child_pos0.offset + c->delta),"DUP SBUF "+c->md5,ss.str());
+            }
+            __sync_fetch_and_add(&be13::plugin::dup_data_encountered,c->bufsize);
+        }
+        return true;
+    }
+    return false;
+}
+
+void child_memo::insert(const std::vector<child> &children,size_t bytes,
+                        size_t consumed_,bool exact,uint64_t child_bytes_)
+{
+    const md5_t md5 = md5_generator::hash_buf(in,consumed_);
+    const size_t shard_entries = std::max((size_t)opt_max_entries/shard_count,(size_t)1);
+    shard &s = my_shard();
+    pthread_mutex_lock(&s.M);
+    std::pair<index_t::iterator,index_t::iterator> r = s.index.equal_range(probe);
+    for(index_t::iterator it=r.first;it!=r.second;it++){
+        const entry &e = *it->second;
+        if(matches(e) && e.len==consumed_ && memcmp(e.md5,md5.digest,sizeof(e.md5))==0){ // another thread got here first
+            pthread_mutex_unlock(&s.M);
+            return;
+        }
+    }
+    while(s.entries.size()>=shard_entries){
+        entries_t::iterator victim = s.entries.end();
+        --victim;
+        r = s.index.equal_range(victim->probe);
+        for(index_t::iterator it=r.first;it!=r.second;it++){
+            if(it->second==victim){
+                s.index.erase(it);
+                break;
+            }
+        }
+        s.entries.pop_back();
+        s.evictions++;
+    }
+    s.entries.push_front(entry());
+    entry &e = s.entries.front();
+    e.probe = probe;
+    e.fs = &sp.fs;
+    e.scanner = scanner;
+    e.depth = sp.depth;
+    e.salt = salt;
+    e.len = consumed_;
+    memcpy(e.md5,md5.digest,sizeof(e.md5));
+    e.exact = exact;
+    e.child_bytes = child_bytes_;
+    e.children = children;
+    e.bytes = bytes + sizeof(entry);
+    s.index.insert(index_t::value_type(probe,s.entries.begin()));
+    s.counts_map[scanner].inserts++;
+    pthread_mutex_unlock(&s.M);
+}
+
+void child_memo::not_kept()
+{
+    shard &s = my_shard();
+    pthread_mutex_lock(&s.M);
+    s.counts_map[scanner].not_kept++;
+    pthread_mutex_unlock(&s.M);
+}
+
+/****************************************************************
+ * Capture
+ */
+
+child_memo::capture::capture(child_memo &memo_,const pos0_t &child_pos0_):
+    memo(memo_),child_pos0(child_pos0_),saved(0),children(),bytes(0),overflow(false)
+{
+    if(!memo.enabled) return;
+    pthread_once(&capture_key_once,make_capture_key);
+    saved = (capture *)pthread_getspecific(capture_key);
+    pthread_setspecific(capture_key,this);
+}
+
+child_memo::capture::~capture()
+{
+    if(memo.enabled) pthread_setspecific(capture_key,saved);
+}
+
+/* Only the children of the scanner that opened the capture count; theirs are scanned inside them */
+void child_memo::recursed(const scanner_params &sp,const recursion_control_block &rcb,const sbuf_t &sbuf)
+{
+    if(opt_max_entries==0) return;
+    pthread_once(&capture_key_once,make_capture_key);
+    capture *c = (capture *)pthread_getspecific(capture_key);
+    if(c==0 || &c->memo.sp!=&sp || c->overflow) return;
+    if(rcb.callback!=be13::plugin::process_sbuf || sbuf.pos0.path!=c->child_pos0.path){
+        c->overflow = true;
+        c->children.clear();
+        return;
+    }
+    std::string md5;
+    if(be13::plugin::dup_data_alerts) md5 = md5_generator::hash_buf(sbuf.buf,sbuf.bufsize).hexdigest();
+    c->children.push_back(child((int64_t)sbuf.pos0.offset - (int64_t)c->child_pos0.offset,sbuf.bufsize,md5));
+    c->bytes += c->children.back().bytes();
+    if(c->bytes > max_entry_bytes){
+        c->overflow = true;
+        c->children.clear();
+    }
+}
+
+void child_memo::capture::commit(size_t consumed,bool exact,uint64_t child_bytes)
+{
+    if(!memo.enabled || consumed==0 || consumed>memo.avail) return;
+    if(overflow){
+        memo.not_kept();
+        return;
+    }
+    memo.insert(children,bytes,consumed,exact,child_bytes);
+}
+
+void child_memo::dump_stats(dfxml_writer &xreport)
+{
+    if(opt_max_entries==0) return;
+    std::map<std::string,counts> totals;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+    uint64_t evictions = 0;
+    for(size_t i=0;i<shard_count;i++){
+        shard &s = shards[i];
+        pthread_mutex_lock(&s.M);
+        for(std::map<std::string,counts>::const_iterator it=s.counts_map.begin();it!=s.counts_map.end();it++){
+            counts &t = totals[it->first];
+            t.lookups     += it->second.lookups;
+            t.hits        += it->second.hits;
+            t.input_bytes += it->second.input_bytes;
+            t.child_bytes += it->second.child_bytes;
+            t.inserts     += it->second.inserts;
+            t.not_kept    += it->second.not_kept;
+        }
+        for(entries_t::const_iterator e=s.entries.begin();e!=s.entries.end();e++){
+            bytes += e->bytes;
+        }
+        entries   += s.entries.size();
+        evictions += s.evictions;
+        pthread_mutex_unlock(&s.M);
+    }
+    std::stringstream ss;
+    ss << "max_entries='" << opt_max_entries << "'";
+    xreport.push("child_memo",ss.str());
+    xreport.xmlout("entries",entries);
+    xreport.xmlout("entry_bytes",bytes);
+    xreport.xmlout("evictions",evictions);
+    for(std::map<std::string,counts>::const_iterator it=totals.begin();it!=totals.end();it++){
+        const counts &t = it->second;
+        std::stringstream cs;
+        cs << "name='" << it->first << "' lookups='" << t.lookups << "' hits='" << t.hits << "'"
+           << " hit_rate='" << std::fixed << std::setprecision(3)
+           << (t.lookups ? (double)t.hits/t.lookups : 0.0) << "'"
+           << " input_bytes_skipped='" << t.input_bytes << "'"
+           << " child_bytes_skipped='" << t.child_bytes << "'"
+           << " inserts='" << t.inserts << "' not_kept='" << t.not_kept << "'";
+        xreport.xmlout("scanner","",cs.str(),false);
+    }
+    xreport.pop();
+}
+
+void child_memo::forget(const feature_recorder_set &fs)
+{
+    for(size_t i=0;i<shard_count;i++){
+        shard &s = shards[i];
+        pthread_mutex_lock(&s.M);
+        for(index_t::iterator it=s.index.begin();it!=s.index.end();){
+            if(it->second->fs==&fs){
+                s.entries.erase(it->second);
+                s.index.erase(it++);
+            } else {
+                it++;
+            }
+        }
+        pthread_mutex_unlock(&s.M);
+    }
+}
+
+void child_memo::reset_stats()
+{
+    for(size_t i=0;i<shard_count;i++){
+        shard &s = shards[i];
+        pthread_mutex_lock(&s.M);
+        s.counts_map.clear();
+        s.evictions = 0;
+        pthread_mutex_unlock(&s.M);
+    }
+}
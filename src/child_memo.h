@@ -0,0 +1,164 @@
+#ifndef _CHILD_MEMO_H_
+#define _CHILD_MEMO_H_
+
+/**
+ * \file
+ * child_memo remembers which compressed bytes the decompressing scanners
+ * have already expanded, so that the same bytes are not inflated again.
+ * The same gzip'ed log, PDF stream or ZIP member turns up in page after
+ * page of a disk image (and at different offsets in each), which
+ * page_dedup cannot see because the pages around it differ.
+ *
+ * Scanning a repeat costs little: process_sbuf() finds that the child was
+ * seen before, writes the DUP SBUF alert (with dup_data_alerts), counts
+ * it in dup_data_encountered and runs only the scanners that want
+ * ngrams. The cost is in decompressing it. So a hit does for each child
+ * that the scanner recursed into what process_sbuf() would have done,
+ * under the new path, and the output is that of a cold scan.
+ *
+ * A scanner that is about to decompress in[0..avail) makes a child_memo
+ * and calls replay() with the forensic path the child buffer would have.
+ * If the same scanner, at the same depth and with the same salt (the
+ * settings that change its output), has decompressed the same bytes
+ * earlier in this image, replay() does that for those children and
+ * returns true. Otherwise the scanner opens a child_memo::capture around
+ * its recursion, which threadpool::recurse() tells of each child, and
+ * commits it with the number of input bytes the decompressor read. An
+ * entry matches any later input that starts with those bytes, unless it
+ * is exact: the result depended on where the input ended (a truncated
+ * stream), so the input must be the same length as well.
+ *
+ * The seen-before set belongs to the image's feature recorders, so an
+ * entry only matches in the feature_recorder_set it was made for, and
+ * forget() drops an image's entries once it is done (in a batch the next
+ * image may be running by then). The memo is not used
+ * where a hit could not stand for a cold scan: when the child would be
+ * at max_depth, when a scanner that wants ngrams is enabled, or when the
+ * scanner would carve what it decompresses (zip and rar do not call
+ * replay() when carve() would write the child: with the default carve
+ * mode, a member of an archive that is itself in a decoded buffer).
+ *
+ * Entries are found by a hash of the first bytes of the input and checked
+ * with the MD5 of all of it. The memo is split into shards, each with its
+ * own lock and least-recently-used list, and holds at most
+ * child_memo_entries entries. A capture whose children take more than
+ * max_entry_bytes to describe is not kept.
+ */
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class child_memo {
+    /*** neither copying nor assignment is implemented ***/
+    child_memo(const child_memo &);
+    child_memo &operator=(const child_memo &);
+public:
+    static uint32_t opt_max_entries;    // 0 disables the memo
+    static const size_t max_entry_bytes = 64*1024;
+
+    /* scanner must be a string constant; salt covers the scanner's settings */
+    child_memo(const scanner_params &sp,const char *scanner,const uint8_t *in,size_t avail,uint64_t salt);
+
+    /* Do what process_sbuf() would for the children of a matching entry, under child_pos0; false if there is none */
+    bool replay(const pos0_t &child_pos0);
+    size_t   consumed;                  // after a hit, the input bytes of the match
+    uint64_t child_bytes;               // after a hit, the bytes that were decompressed for it
+
+    class child {
+    public:
+        child(int64_t delta_,uint64_t bufsize_,const std::string &md5_):delta(delta_),bufsize(bufsize_),md5(md5_){}
+        int64_t     delta;              // from the offset of the child path
+        uint64_t    bufsize;
+        std::string md5;                // hex, only with dup_data_alerts
+        size_t bytes() const { return sizeof(*this) + md5.size(); }
+    };
+
+    /* The children recursed into while it is in scope; commit() keeps them */
+    class capture {
+        /*** neither copying nor assignment is implemented ***/
+        capture(const capture &);
+        capture &operator=(const capture &);
+        friend class child_memo;
+        child_memo &memo;
+        const pos0_t child_pos0;
+        capture *saved;                 // the capture this one is in, on this thread
+        std::vector<child> children;
+        size_t bytes;
+        bool   overflow;                // too many children, or one that cannot be moved
+    public:
+        capture(child_memo &memo,const pos0_t &child_pos0);
+        ~capture();
+        void commit(size_t consumed,bool exact,uint64_t child_bytes);
+    };
+
+    /* threadpool::recurse() calls this with each child before it is scanned */
+    static void recursed(const scanner_params &sp,const recursion_control_block &rcb,const sbuf_t &child);
+
+    static void dump_stats(class dfxml_writer &xreport);
+    static void forget(const feature_recorder_set &fs); // fs's image is done; before fs is deleted
+    static void reset_stats();          // after a report
+
+private:
+    const scanner_params &sp;
+    const char *scanner;
+    const uint8_t *in;
+    const size_t avail;
+    const uint64_t salt;
+    const bool enabled;
+    uint64_t probe;                     // hash of the first bytes, the scanner, depth and salt
+
+    class entry {
+    public:
+        entry():probe(0),fs(0),scanner(0),depth(0),salt(0),len(0),exact(false),child_bytes(0),children(),bytes(0){
+            memset(md5,0,sizeof(md5));
+        }
+        uint64_t probe;
+        const feature_recorder_set *fs; // of the image it was made in
+        const char *scanner;
+        uint32_t depth;
+        uint64_t salt;
+        size_t   len;
+        uint8_t  md5[16];               // of in[0..len)
+        bool     exact;
+        uint64_t child_bytes;
+        std::vector<child> children;
+        size_t   bytes;
+    };
+    typedef std::list<entry> entries_t;
+    typedef std::multimap<uint64_t,entries_t::iterator> index_t;
+
+    class counts {
+    public:
+        counts():lookups(0),hits(0),input_bytes(0),child_bytes(0),inserts(0),not_kept(0){}
+        uint64_t lookups;
+        uint64_t hits;
+        uint64_t input_bytes;           // not decompressed, on hits
+        uint64_t child_bytes;           // not decompressed or hashed, on hits
+        uint64_t inserts;
+        uint64_t not_kept;              // captures with too many children or ones that cannot be moved
+    };
+
+    class shard {
+    public:
+        shard():M(),entries(),index(),counts_map(),evictions(0){
+            pthread_mutex_init(&M,NULL);
+        }
+        pthread_mutex_t M;
+        entries_t entries;              // most recently used first
+        index_t   index;                // probe -> entry
+        std::map<std::string,counts> counts_map;
+        uint64_t evictions;
+    };
+    static const size_t shard_count = 16;
+    static shard shards[shard_count];
+    shard &my_shard() const { return shards[(probe>>32) % shard_count]; }
+    bool matches(const entry &e) const;
+    void insert(const std::vector<child> &children,size_t bytes,
+                size_t consumed,bool exact,uint64_t child_bytes);
+    void not_kept();
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include "dig.h"
 #include "utf8.h"
 #include <iostream>
+#include <algorithm>
 
 #ifndef _TEXT
 #define _TEXT(x) x
@@ -230,6 +231,108 @@ dig::dig(const std::string &start_):start(utf8to16(start_))
 }
 #endif
 
+#ifndef WIN32
+/****************************************************************
+ *** parallel_dig
+ ****************************************************************/
+
+parallel_dig::parallel_dig(const std::string &start,uint32_t nthreads):
+    files(),M(),CV(),dirs(),busy(0),seen()
+{
+    pthread_mutex_init(&M,NULL);
+    pthread_cond_init(&CV,NULL);
+
+    struct stat st;
+    if(stat(start.c_str(),&st)) return;
+    if(!S_ISDIR(st.st_mode)){
+        files.push_back(entry(start,st.st_size));
+        return;
+    }
+    seen.insert(dig::const_iterator::devinode(st.st_dev,st.st_ino));
+    dirs.push_back(start);
+
+    if(nthreads<1) nthreads = 1;
+    std::vector<pthread_t> threads;
+    for(uint32_t i=0;i<nthreads;i++){
+        pthread_t t;
+        if(pthread_create(&t,NULL,run,(void *)this)) break;
+        threads.push_back(t);
+    }
+    if(threads.size()==0) run((void *)this); // walk on this thread
+    for(std::vector<pthread_t>::const_iterator it=threads.begin();it!=threads.end();it++){
+        pthread_join(*it,NULL);
+    }
+    std::sort(files.begin(),files.end());
+}
+
+parallel_dig::~parallel_dig()
+{
+    pthread_mutex_destroy(&M);
+    pthread_cond_destroy(&CV);
+}
+
+void *parallel_dig::run(void *arg)
+{
+    parallel_dig &self = *(parallel_dig *)arg;
+    pthread_mutex_lock(&self.M);
+    while(true){
+        while(self.dirs.empty() && self.busy>0){
+            pthread_cond_wait(&self.CV,&self.M);
+        }
+        if(self.dirs.empty()) break;    // nothing queued and nobody reading: done
+        std::string dir = self.dirs.front();
+        self.dirs.pop_front();
+        self.busy++;
+        pthread_mutex_unlock(&self.M);
+        self.read_dir(dir);             // takes M to hand over what it found
+        pthread_mutex_lock(&self.M);
+        self.busy--;
+        pthread_cond_broadcast(&self.CV);
+    }
+    pthread_mutex_unlock(&self.M);
+    return 0;
+}
+
+/* Read one directory without the lock, then queue its subdirectories
+ * and keep its files under it. What is skipped is what dig skips.
+ */
+void parallel_dig::read_dir(const std::string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+    if(d==0) return;
+    std::vector<std::pair<dig::const_iterator::devinode,std::string> > found_dirs;
+    std::vector<std::pair<dig::const_iterator::devinode,entry> > found_files;
+    struct dirent *de;
+    while((de = readdir(d)) != NULL){
+        std::string filename = de->d_name;
+        if(dig::ignore_file_name(filename)) continue;
+        std::string pathname = dir + "/" + filename;
+        struct stat st;
+        if(stat(pathname.c_str(),&st)) continue; // can't stat it
+        if(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)){
+            continue;                   // not something to process
+        }
+        dig::const_iterator::devinode di(st.st_dev,st.st_ino);
+        if(S_ISDIR(st.st_mode)){
+            found_dirs.push_back(std::make_pair(di,pathname));
+        } else {
+            found_files.push_back(std::make_pair(di,entry(pathname,st.st_size)));
+        }
+    }
+    closedir(d);
+
+    pthread_mutex_lock(&M);
+    for(size_t i=0;i<found_dirs.size();i++){
+        if(seen.insert(found_dirs[i].first).second) dirs.push_back(found_dirs[i].second);
+    }
+    for(size_t i=0;i<found_files.size();i++){
+        if(seen.insert(found_files[i].first).second) files.push_back(found_files[i].second);
+    }
+    if(found_dirs.size()>0) pthread_cond_broadcast(&CV);
+    pthread_mutex_unlock(&M);
+}
+#endif
+
 #ifdef STANDALONE
 
 int main(int argc,char **argv)
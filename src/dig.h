@@ -11,8 +11,13 @@
 #include <dirent.h>
 #include <iostream>
 #include <set>
+#include <deque>
+#include <vector>
 #include <sys/stat.h>
 #include <stdint.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #if defined(WIN32) || defined(MINGW) || defined(__MINGW32__) || defined(__MINGW64__)
 #include <winsock2.h>
@@ -91,4 +96,37 @@ public:
 
 };
 dig::const_iterator & operator++(dig::const_iterator &it);
+
+#ifndef WIN32
+/*
+ * parallel_dig - the same walk as dig, with several threads reading
+ * directories at once, for trees with millions of files. Each file is
+ * stat()ed once, and its size kept. The files are sorted by name, so
+ * the order does not depend on how the threads raced.
+ */
+class parallel_dig {
+    /*** neither copying nor assignment is implemented ***/
+    parallel_dig(const parallel_dig &);
+    parallel_dig &operator=(const parallel_dig &);
+public:
+    class entry {
+    public:
+        entry(const std::string &name_,int64_t size_):name(name_),size(size_){}
+        std::string name;
+        int64_t     size;
+        bool operator<(const entry &e2) const { return name < e2.name; }
+    };
+    parallel_dig(const std::string &start,uint32_t nthreads);
+    ~parallel_dig();
+    std::vector<entry> files;
+private:
+    pthread_mutex_t M;
+    pthread_cond_t  CV;                 // a directory was queued, or the walk is done
+    std::deque<std::string> dirs;       // directories not yet read
+    uint32_t        busy;               // threads reading a directory
+    std::set<dig::const_iterator::devinode> seen;
+    void            read_dir(const std::string &dir);
+    static void     *run(void *arg);
+};
+#endif
 #endif
@@ -0,0 +1,192 @@
+/*
+ * image_hasher.cpp:
+ * Hash the image on a thread of its own; see image_hasher.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "image_process.h"
+#include "image_hasher.h"
+#include "buffer_pool.h"
+#include "dfxml/src/dfxml_writer.h"
+
+std::string image_hasher::opt_algorithms = "md5";
+uint32_t    image_hasher::opt_queue_mb = 128;
+
+static const size_t fill_bytes = 4*1024*1024; // read size for the ranges the hasher reads itself
+
+static bool has_algorithm(const std::vector<std::string> &algs,const char *name,const char *dashed)
+{
+    for(std::vector<std::string>::const_iterator it=algs.begin();it!=algs.end();it++){
+        std::string a = *it;
+        for(size_t i=0;i<a.size();i++) a[i] = tolower(a[i]);
+        if(a==name || a==dashed) return true;
+    }
+    return false;
+}
+
+bool image_hasher::valid_algorithms(const std::string &algs)
+{
+    std::vector<std::string> names = split(algs,',');
+    for(std::vector<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+        std::vector<std::string> one(1,*it);
+        if(!has_algorithm(one,"md5","md5") && !has_algorithm(one,"sha1","sha-1")
+           && !has_algorithm(one,"sha256","sha-256")) return false;
+    }
+    return true;
+}
+
+image_hasher::image_hasher(const image_process &img_,const std::string &algs):
+    img(img_),md5(0),sha1(0),sha256(0),M(),NOT_FULL(),NOT_EMPTY(),q(),bytes(0),
+    max_bytes((size_t)opt_queue_mb*1024*1024),closed(false),failed(false),next(0),thread(),
+    bytes_hashed(0),bytes_filled(0),hashing(),producer_blocked()
+{
+    std::vector<std::string> names = split(algs,',');
+    if(has_algorithm(names,"md5","md5"))        md5    = new md5_generator();
+    if(has_algorithm(names,"sha1","sha-1"))     sha1   = new sha1_generator();
+    if(has_algorithm(names,"sha256","sha-256")) sha256 = new sha256_generator();
+    if(pthread_mutex_init(&M,NULL))        errx(1,"pthread_mutex_init failed");
+    if(pthread_cond_init(&NOT_FULL,NULL))  errx(1,"pthread_cond_init #1 failed");
+    if(pthread_cond_init(&NOT_EMPTY,NULL)) errx(1,"pthread_cond_init #2 failed");
+    if(pthread_create(&thread,NULL,run,(void *)this)) errx(1,"cannot create image hashing thread");
+}
+
+image_hasher::~image_hasher()
+{
+    finish();
+    delete md5;
+    delete sha1;
+    delete sha256;
+    pthread_mutex_destroy(&M);
+    pthread_cond_destroy(&NOT_FULL);
+    pthread_cond_destroy(&NOT_EMPTY);
+}
+
+/**
+ * Queue a copy of the page, without the margin. A page is always accepted
+ * into an empty queue, so a page larger than the cap cannot deadlock.
+ */
+void image_hasher::add(const sbuf_t &sbuf)
+{
+    size_t len = sbuf.pagesize < sbuf.bufsize ? sbuf.pagesize : sbuf.bufsize;
+    if(len==0) return;
+    uint8_t *buf = (uint8_t *)buffer_pool::get().alloc(len);
+    memcpy(buf,sbuf.buf,len);
+    pthread_mutex_lock(&M);
+    if(q.size()>0 && bytes+len > max_bytes){
+        producer_blocked.start();
+        while(q.size()>0 && bytes+len > max_bytes){
+            pthread_cond_wait(&NOT_FULL,&M);
+        }
+        producer_blocked.stop();
+    }
+    q.push_back(piece(sbuf.pos0.offset,buf,len));
+    bytes += len;
+    pthread_cond_signal(&NOT_EMPTY);
+    pthread_mutex_unlock(&M);
+}
+
+void image_hasher::update(const uint8_t *buf,size_t len)
+{
+    if(md5)    md5->update(buf,len);
+    if(sha1)   sha1->update(buf,len);
+    if(sha256) sha256->update(buf,len);
+    next += len;
+    bytes_hashed += len;
+}
+
+/* Read and hash the bytes between the last page and the next one */
+bool image_hasher::fill(int64_t end)
+{
+    if(next>=end) return true;
+    if(!img.can_seek()) return false;
+    pooled_malloc<uint8_t> buf(fill_bytes);
+    while(next<end){
+        size_t want = fill_bytes;
+        if((int64_t)want > end-next) want = end-next;
+        int got = img.pread(buf.buf,want,next);
+        if(got<=0) return false;
+        bytes_filled += got;
+        update(buf.buf,got);
+    }
+    return true;
+}
+
+void *image_hasher::run(void *arg)
+{
+    image_hasher &self = *(image_hasher *)arg;
+    pthread_mutex_lock(&self.M);
+    while(true){
+        while(self.q.empty() && !self.closed){
+            pthread_cond_wait(&self.NOT_EMPTY,&self.M);
+        }
+        if(self.q.empty()) break;       // closed and drained
+        piece p = self.q.front();
+        self.q.pop_front();
+        pthread_mutex_unlock(&self.M);
+
+        if(!self.failed){
+            self.hashing.start();
+            if(!self.fill(p.offset)){
+                self.failed = true;
+            } else if(p.offset+(int64_t)p.len > self.next){ // skip any part already hashed
+                size_t skip = self.next - p.offset;
+                self.update(p.buf+skip,p.len-skip);
+            }
+            self.hashing.stop();
+        }
+        buffer_pool::get().free(p.buf,p.len);
+
+        pthread_mutex_lock(&self.M);
+        self.bytes -= p.len;
+        pthread_cond_signal(&self.NOT_FULL);
+    }
+    pthread_mutex_unlock(&self.M);
+
+    /* Whatever follows the last page */
+    if(!self.failed && self.img.can_seek()){
+        self.hashing.start();
+        if(!self.fill(self.img.image_size())) self.failed = true;
+        self.hashing.stop();
+    }
+    return 0;
+}
+
+void image_hasher::finish()
+{
+    pthread_mutex_lock(&M);
+    bool was_closed = closed;
+    closed = true;
+    pthread_cond_broadcast(&NOT_EMPTY);
+    pthread_mutex_unlock(&M);
+    if(!was_closed) pthread_join(thread,NULL);
+}
+
+void image_hasher::dump_digests(dfxml_writer &xreport,std::string *md5_string)
+{
+    finish();
+    if(failed) return;
+    /* Zeroed sectors were hashed as zeros; the digests are not those of the image */
+    const bool incomplete = img.bad_sectors>0;
+    const std::string attrs = incomplete ? "' incomplete='1'" : "'";
+    if(md5){
+        std::string hex = md5->final().hexdigest();
+        if(md5_string && !incomplete) *md5_string = hex;
+        xreport.xmlout("hashdigest",hex,"type='MD5"+attrs,false);
+    }
+    if(sha1)   xreport.xmlout("hashdigest",sha1->final().hexdigest(),"type='SHA1"+attrs,false);
+    if(sha256) xreport.xmlout("hashdigest",sha256->final().hexdigest(),"type='SHA256"+attrs,false);
+}
+
+void image_hasher::dump_stats(dfxml_writer &xreport) const
+{
+    std::stringstream ss;
+    ss << "algorithms='" << dfxml_writer::xmlescape(opt_algorithms) << "'";
+    xreport.push("image_hash",ss.str());
+    xreport.xmlout("bytes_hashed",bytes_hashed);
+    xreport.xmlout("bytes_read_by_hasher",bytes_filled);
+    xreport.xmlout("hashing_seconds",hashing.elapsed_seconds());
+    xreport.xmlout("producer_blocked_seconds",producer_blocked.elapsed_seconds());
+    if(failed || img.bad_sectors) xreport.xmlout("incomplete","1");
+    xreport.pop();
+}
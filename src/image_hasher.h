@@ -0,0 +1,72 @@
+#ifndef _IMAGE_HASHER_H_
+#define _IMAGE_HASHER_H_
+
+/**
+ * \file
+ * image_hasher computes the MD5, SHA-1 and/or SHA-256 of the whole image
+ * on a thread of its own, so that the dispatcher only copies each page
+ * into a queue and never waits for a hash.
+ *
+ * Pages are added in image order. When a page does not start where the
+ * last one ended (pages already done before a restart, or pages that
+ * could not be read) the hasher reads the missing range from the image
+ * with pread() before it hashes the page, and at the end it reads
+ * whatever follows the last page. An image that cannot be read out of
+ * order, or a range that cannot be read at all, leaves no hash.
+ */
+
+#include <deque>
+#include <string>
+#include <pthread.h>
+#include "be13_api/aftimer.h"
+#include "dfxml/src/hash_t.h"
+
+class image_hasher {
+    /*** neither copying nor assignment is implemented ***/
+    image_hasher(const image_hasher &);
+    image_hasher &operator=(const image_hasher &);
+
+    class piece {
+    public:
+        piece(int64_t offset_,uint8_t *buf_,size_t len_):offset(offset_),buf(buf_),len(len_){}
+        int64_t offset;                 // where in the image
+        uint8_t *buf;                   // from the buffer_pool
+        size_t  len;
+    };
+    const class image_process &img;
+    md5_generator    *md5;              // 0 if not asked for
+    sha1_generator   *sha1;
+    sha256_generator *sha256;
+    pthread_mutex_t M;
+    pthread_cond_t  NOT_FULL;
+    pthread_cond_t  NOT_EMPTY;
+    std::deque<piece> q;
+    size_t          bytes;              // bytes queued
+    const size_t    max_bytes;
+    bool            closed;
+    bool            failed;             // a gap could not be read
+    int64_t         next;               // next byte to hash
+    pthread_t       thread;
+    static void *run(void *arg);
+    void update(const uint8_t *buf,size_t len);
+    bool fill(int64_t end);             // hash [next,end) read from the image
+public:
+    static std::string opt_algorithms;  // comma-separated; empty for none
+    static uint32_t opt_queue_mb;
+    static bool valid_algorithms(const std::string &algs);
+
+    /* statistics */
+    uint64_t        bytes_hashed;
+    uint64_t        bytes_filled;       // read from the image by the hasher
+    aftimer         hashing;
+    aftimer         producer_blocked;   // add() waiting for room
+
+    image_hasher(const class image_process &img_,const std::string &algs);
+    ~image_hasher();
+    void add(const class sbuf_t &sbuf); // copies the page; blocks while the queue is full
+    void finish();                      // hash the rest of the image and stop the thread
+    void dump_digests(class dfxml_writer &xreport,std::string *md5_string); // into <source>
+    void dump_stats(class dfxml_writer &xreport) const;
+};
+
+#endif
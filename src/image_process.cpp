@@ -19,6 +19,10 @@
 #endif
 
 #include "image_process.h"
+#include "raw_reader.h"
+#include "buffer_pool.h"
+#include "dfxml/src/dfxml_writer.h"
+#include "be13_api/aftimer.h"
 #ifdef HAVE_LIBAFFLIB
 #ifndef HAVE_STL
 #define HAVE_STL			/* needed */
@@ -157,6 +161,265 @@ static int64_t getSizeOfFile(const std::string &fname)
 
 
 
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Read count bytes at offset for a page.
+ * In sequential mode, the page at offset started in the margin of the
+ * page before it; those bytes are copied from the last read rather than
+ * read (and, for E01, decompressed) again, and this page's margin is kept
+ * for the next one. A read at any other offset just reads.
+ */
+int image_process::read_page(uint8_t *buf,size_t count,int64_t offset) const
+{
+    size_t reused = 0;
+    if(sequential && carry_offset==offset && carry.size()>0){
+        reused = carry.size() < count ? carry.size() : count;
+        memcpy(buf,&carry[0],reused);
+        margin_bytes_reused += reused;
+    }
+    carry.clear();
+    int r = 0;
+    if(reused < count){
+        r = this->pread(buf+reused,count-reused,offset+reused);
+        if(r<0) return r;
+    }
+    int total = reused + r;
+    if(sequential && (size_t)total > pagesize){
+        carry.assign(buf+pagesize,buf+total);
+        carry_offset = offset+pagesize;
+    }
+    return total;
+}
+
+/**
+ * Read error salvage.
+ * When a page cannot be read, the range is read again in halves, split
+ * at a sector boundary, and each half that fails is split again, down to
+ * opt_sector_bytes. A sector that still fails after opt_sector_retries
+ * more reads is zero-filled and recorded as a bad range, so that one bad
+ * sector costs one sector of coverage rather than the whole page. The
+ * image hash, if any, is the hash of the image with those sectors zeroed.
+ */
+uint32_t image_process::opt_sector_bytes = 512;
+uint32_t image_process::opt_sector_retries = 1;
+
+int image_process::salvage_read(uint8_t *buf,size_t count,int64_t offset) const
+{
+    if(opt_sector_bytes==0) return -1;
+    if(report_read_errors){
+        std::cerr << "Read error in " << count << " bytes at " << offset << "; reading them again by sectors\n";
+    }
+    salvaged_reads++;
+    carry.clear();
+    return salvage(buf,count,offset);
+}
+
+int image_process::salvage(uint8_t *buf,size_t count,int64_t offset) const
+{
+    const int64_t sector = opt_sector_bytes;
+    int got = this->pread(buf,count,offset);
+    if(got>=0) return got;
+    if((int64_t)count<=sector){
+        for(uint32_t i=0;i<opt_sector_retries;i++){
+            got = this->pread(buf,count,offset);
+            if(got>=0) return got;
+        }
+        memset(buf,0,count);
+        add_bad_range(offset,count);
+        bad_sectors++;
+        return count;
+    }
+    int64_t mid = ((offset + (int64_t)count/2) / sector) * sector;
+    if(mid<=offset) mid = offset + sector;
+    const size_t left = mid - offset;
+    int got_left = salvage(buf,left,offset);
+    if(got_left<(int)left) return got_left; // the end of the image
+    int got_right = salvage(buf+left,count-left,mid);
+    return got_left + got_right;
+}
+
+/* Add [offset,offset+len), joining it with the ranges it touches; the margin of a page is read twice */
+void image_process::add_bad_range(int64_t offset,int64_t len) const
+{
+    int64_t end = offset + len;
+    bad_range_map_t::iterator it = bad_ranges.upper_bound(offset);
+    if(it!=bad_ranges.begin()){
+        bad_range_map_t::iterator prev = it;
+        --prev;
+        if(prev->first + prev->second >= offset){
+            offset = prev->first;
+            if(prev->first + prev->second > end) end = prev->first + prev->second;
+            bad_ranges.erase(prev);
+        }
+    }
+    while(it!=bad_ranges.end() && it->first <= end){
+        if(it->first + it->second > end) end = it->first + it->second;
+        bad_ranges.erase(it++);
+    }
+    bad_ranges[offset] = end - offset;
+}
+
+void image_process::dump_read_errors(dfxml_writer &xreport) const
+{
+    if(salvaged_reads==0) return;
+    uint64_t bytes = 0;
+    for(bad_range_map_t::const_iterator it=bad_ranges.begin();it!=bad_ranges.end();it++) bytes += it->second;
+    std::stringstream ss;
+    ss << "sector_bytes='" << opt_sector_bytes << "'";
+    xreport.push("read_errors",ss.str());
+    xreport.xmlout("salvaged_reads",salvaged_reads);
+    xreport.xmlout("bad_sectors",bad_sectors);
+    xreport.xmlout("bad_bytes",bytes);
+    for(bad_range_map_t::const_iterator it=bad_ranges.begin();it!=bad_ranges.end();it++){
+        std::stringstream r;
+        r << "offset='" << it->first << "' length='" << it->second << "'";
+        xreport.xmlout("bad_range","",r.str(),false);
+    }
+    xreport.pop();
+}
+
+/**
+ * Asynchronous reading.
+ * In sequential mode, sbuf_alloc() keeps the next read_depth pages
+ * on order from a raw_reader. Each is read as a chunk of pagesize bytes
+ * into a buffer big enough for the page and its margin; the margin is
+ * copied from the start of the next chunk, so that every byte of the
+ * image is read once. If a read fails, the page is read again the
+ * blocking way, so read errors are reported as they always were.
+ */
+void image_process::start_reader(uint32_t depth)
+{
+    if(margin > pagesize) return;       // the margin would need more than one chunk
+    if(depth<2) depth = 2;              // a page and the chunk for its margin
+    read_depth = depth;
+    reader = raw_reader::create(*this,read_depth);
+}
+
+void image_process::stop_reader()
+{
+    if(reader==0) return;
+    pthread_mutex_lock(&reader_M);
+    cancel_requests(image_size());      // everything; the pages were never asked for
+    pthread_mutex_unlock(&reader_M);
+    delete reader;
+    reader = 0;
+}
+
+/* Return the request for the chunk at offset, starting it if need be. Call with reader_M held. */
+raw_request *image_process::request_chunk(int64_t offset) const
+{
+    request_map_t::const_iterator it = requests.find(offset);
+    if(it!=requests.end()) return it->second;
+
+    const int64_t image_bytes = image_size();
+    size_t want = pagesize;
+    size_t size = pagesize + margin;
+    if(image_bytes < offset + (int64_t)want) want = image_bytes - offset;
+    if(image_bytes < offset + (int64_t)size) size = image_bytes - offset;
+    uint8_t *buf = (uint8_t *)buffer_pool::get().alloc(size);
+    raw_request *r = new raw_request(offset,buf,size,want);
+    requests[offset] = r;
+    reader->submit(r);
+    return r;
+}
+
+/* Drop the chunks that sequential reading from offset will not use. Call with reader_M held. */
+void image_process::cancel_requests(int64_t offset) const
+{
+    const int64_t ahead = offset + (int64_t)read_depth * pagesize;
+    for(request_map_t::iterator it = requests.begin();it!=requests.end();){
+        if(it->first >= offset && it->first < ahead){
+            ++it;
+            continue;
+        }
+        reader->wait(it->second);       // the reader is still writing into the buffer
+        buffer_pool::get().free(it->second->buf,it->second->size);
+        delete it->second;
+        requests.erase(it++);
+    }
+}
+
+sbuf_t *image_process::sbuf_alloc_async(image_process::iterator &it) const
+{
+    const int64_t size = image_size();
+    if(it.raw_offset >= size){
+        it.eof = true;
+        return 0;
+    }
+    pthread_mutex_lock(&reader_M);
+    uint8_t *buf = 0;
+    size_t allocated = 0;
+    size_t count = 0;
+    bool error = false;
+    try {
+        cancel_requests(it.raw_offset);  // in case we were moved
+        for(uint32_t i=0;i<read_depth;i++){
+            int64_t offset = it.raw_offset + (int64_t)i*pagesize;
+            if(offset >= size) break;
+            request_chunk(offset);
+        }
+        raw_request *r = request_chunk(it.raw_offset);
+        reader->wait(r);
+        count = r->got;
+        error = r->error || r->got < r->want;
+        if(!error && margin>0 && it.raw_offset + (int64_t)pagesize < size){
+            raw_request *next = request_chunk(it.raw_offset + pagesize);
+            reader->wait(next);
+            size_t m = margin;
+            if(size < it.raw_offset + (int64_t)(pagesize + m)) m = size - it.raw_offset - pagesize;
+            if(!next->error && next->got >= m){
+                memcpy(r->buf+pagesize,next->buf,m);
+                count += m;
+            } else {
+                /* Read the margin the blocking way; the next page reports its own error */
+                int got = this->pread(r->buf+pagesize,m,it.raw_offset+pagesize);
+                if(got>0) count += got;
+                if(got<(int)m){
+                    margins_short++;
+                    if(report_read_errors){
+                        std::cerr << "margin after offset " << it.raw_offset << " is short: read "
+                                  << (got>0 ? got : 0) << " of " << m << " bytes\n";
+                    }
+                }
+            }
+        }
+        buf = r->buf;
+        allocated = r->size;
+        requests.erase(it.raw_offset);
+        delete r;
+    }
+    catch (const std::bad_alloc &) {
+        pthread_mutex_unlock(&reader_M);
+        throw;
+    }
+    pthread_mutex_unlock(&reader_M);
+
+    if(error){
+        int want = pagesize + margin;
+        if(size < it.raw_offset + want) want = size - it.raw_offset;
+        int got = this->pread(buf,want,it.raw_offset);
+        if(got<0) got = salvage_read(buf,want,it.raw_offset);
+        if(got<0){
+            buffer_pool::get().free(buf,allocated);
+            throw read_error();
+        }
+        count = got;
+    }
+    if(count==0){
+	buffer_pool::get().free(buf,allocated);
+	it.eof = true;
+	return 0;
+    }
+    return new pooled_sbuf(get_pos0(it),buf,count,pagesize,allocated);
+}
+
+
 /****************************************************************
  *** AFF START
  ****************************************************************/
@@ -184,8 +447,11 @@ int process_aff::open()
 
 int process_aff::pread(unsigned char *buf,size_t bytes,int64_t offset) const
 {
+    pthread_mutex_lock(&af_M);
     af_seek(af,offset,0);
-    return af_read(af,buf,bytes);
+    int ret = af_read(af,buf,bytes);
+    pthread_mutex_unlock(&af_M);
+    return ret;
 }
 
 int64_t process_aff::image_size() const
@@ -249,13 +515,14 @@ pos0_t process_aff::get_pos0(const image_process::iterator &it) const
 sbuf_t *process_aff::sbuf_alloc(image_process::iterator &it) const
 {
     size_t bufsize  = af_get_pagesize(af)+margin;
-    unsigned char *buf = (unsigned char *)malloc(bufsize);
-    if(!buf) throw std::bad_alloc();
+    unsigned char *buf = (unsigned char *)buffer_pool::get().alloc(bufsize);
 
     pos0_t pos0 = get_pos0(it);
     
+    pthread_mutex_lock(&af_M);
     af_seek(af,pos0.offset,0);
     ssize_t bytes_read = af_read(af,buf,bufsize);
+    pthread_mutex_unlock(&af_M);
     /**
      * af_read() returns 0 at end of file, if no data is available,
      * or if the data is bad. We need to be willing to return an sbuf
@@ -264,10 +531,10 @@ sbuf_t *process_aff::sbuf_alloc(image_process::iterator &it) const
     if(bytes_read>=0){
 	ssize_t af_pagesize = af_get_pagesize(af);
 	if(af_pagesize>bytes_read) af_pagesize = bytes_read;
-	sbuf_t *sbuf = new sbuf_t(pos0,buf,bytes_read,af_pagesize,true);
+	sbuf_t *sbuf = new pooled_sbuf(pos0,buf,bytes_read,af_pagesize,bufsize);
 	return sbuf;
     }
-    free(buf);
+    buffer_pool::get().free(buf,bufsize);
     return 0;				// no buffer to return
 }
 
@@ -298,6 +565,7 @@ uint64_t process_aff::seek_block(image_process::iterator &it,uint64_t block) con
 process_aff::~process_aff()
 {
     if(af) af_close(af);
+    pthread_mutex_destroy(&af_M);
 }
 #endif
 
@@ -323,7 +591,12 @@ process_aff::~process_aff()
 
 process_ewf::~process_ewf()
 {
+    stop_reader();
 #ifdef LIBEWFNG
+    for(size_t i=1;i<handles.size();i++){
+	libewf_handle_close(handles[i],NULL);
+	libewf_handle_free(&handles[i],NULL);
+    }
     if(handle){
 	libewf_handle_close(handle,NULL);
 	libewf_handle_free(&handle,NULL);
@@ -333,6 +606,8 @@ process_ewf::~process_ewf()
 	libewf_close(handle);
     }
 #endif    
+    pthread_mutex_destroy(&handle_M);
+    pthread_cond_destroy(&handle_CV);
 }
 
 #ifdef WIN32
@@ -443,6 +718,18 @@ int process_ewf::open()
 	if(error) libewf_error_fprint(error,stdout);
 	err(1,"Cannot open: %s",fname);
     }
+    /* More handles, so that several chunks can be decompressed at once */
+    handles.push_back(handle);
+    for(uint32_t i=1;i<opt_handles;i++){
+        libewf_handle_t *h = 0;
+        if(libewf_handle_initialize(&h,NULL)<0) break;
+        if(libewf_handle_open(h,libewf_filenames,amount_of_filenames,LIBEWF_OPEN_READ,NULL)<0){
+            libewf_handle_free(&h,NULL);
+            break;
+        }
+        handles.push_back(h);
+    }
+    idle_handles = handles;
     /* Free the allocated filenames */
     if(use_libewf_glob){
         if(libewf_glob_free(libewf_filenames,amount_of_filenames,&error)<0){
@@ -465,6 +752,8 @@ int process_ewf::open()
 	}
 	err(1,"libewf_open");
     }
+    handles.push_back(handle);
+    idle_handles = handles;
     libewf_get_media_size(handle,(size64_t *)&ewf_filesize);
 #endif
 
@@ -494,6 +783,7 @@ int process_ewf::open()
 	details.push_back(std::string("EXAMINER NAME: "+examinername));
     }
 #endif	
+    if(handles.size()>1) start_reader(handles.size());
     return 0;
 }
 
@@ -502,12 +792,53 @@ std::vector<std::string> process_ewf::getewfdetails() const{
 }
 
 
+/**
+ * Parallel decompression.
+ * With opt_handles>1 the image is opened that many times, and in
+ * sequential mode the pages ahead are read by as many reader threads,
+ * each decompressing with a handle of its own. A read takes whichever
+ * handle is free, and waits if none is.
+ */
+uint32_t process_ewf::opt_handles = 1;
+libewf_handle_t *process_ewf::acquire_handle() const
+{
+    pthread_mutex_lock(&handle_M);
+    if(idle_handles.empty()) handle_waits++;
+    while(idle_handles.empty()){
+        pthread_cond_wait(&handle_CV,&handle_M);
+    }
+    libewf_handle_t *h = idle_handles.back();
+    idle_handles.pop_back();
+    pthread_mutex_unlock(&handle_M);
+    return h;
+}
+
+void process_ewf::release_handle(libewf_handle_t *h) const
+{
+    pthread_mutex_lock(&handle_M);
+    idle_handles.push_back(h);
+    pthread_cond_signal(&handle_CV);
+    pthread_mutex_unlock(&handle_M);
+}
+
+void process_ewf::dump_read_stats(dfxml_writer &xreport) const
+{
+    std::stringstream ss;
+    ss << "backend='" << (reader ? reader->name() : "pread") << "' handles='" << handles.size() << "'";
+    if(reader) ss << " depth='" << read_depth << "'";
+    xreport.push("ewf_reads",ss.str());
+    xreport.xmlout("handle_waits",handle_waits);
+    xreport.pop();
+}
+
 //int process_ewf::debug = 0;
 int process_ewf::pread(unsigned char *buf,size_t bytes,int64_t offset) const
 {
 #ifdef LIBEWFNG
     libewf_error_t *error=0;
-    int ret = libewf_handle_read_random(handle,buf,bytes,offset,&error);
+    libewf_handle_t *h = acquire_handle();
+    int ret = libewf_handle_read_random(h,buf,bytes,offset,&error);
+    release_handle(h);
     if(ret<0){
 	if (report_read_errors) libewf_error_fprint(error,stderr);
 	libewf_error_free(&error);
@@ -552,27 +883,30 @@ pos0_t process_ewf::get_pos0(const image_process::iterator &it) const
 /** Read from the iterator into a newly allocated sbuf */
 sbuf_t *process_ewf::sbuf_alloc(image_process::iterator &it) const
 {
+    if(reader && sequential) return sbuf_alloc_async(it);
+
     int count = pagesize + margin;
 
     if(this->ewf_filesize < it.raw_offset + count){    /* See if that's more than I need */
 	count = this->ewf_filesize - it.raw_offset;
     }
 
-    unsigned char *buf = (unsigned char *)malloc(count);
-    if(!buf) throw std::bad_alloc();			// no memory
+    const size_t allocated = count;
+    unsigned char *buf = (unsigned char *)buffer_pool::get().alloc(allocated);
 
-    count = this->pread(buf,count,it.raw_offset); // do the read
+    count = this->read_page(buf,count,it.raw_offset); // do the read
+    if(count<0) count = salvage_read(buf,allocated,it.raw_offset);
     if(count<0){
-	free(buf);
+	buffer_pool::get().free(buf,allocated);
 	throw read_error();
     }
     if(count==0){
-	free(buf);
+	buffer_pool::get().free(buf,allocated);
 	it.eof = true;
 	return 0;
     }
 
-    sbuf_t *sbuf = new sbuf_t(get_pos0(it),buf,count,pagesize,true);
+    sbuf_t *sbuf = new pooled_sbuf(get_pos0(it),buf,count,pagesize,allocated);
     return sbuf;
 }
 
@@ -653,21 +987,31 @@ static std::string make_list_template(std::string fn,int *start)
 
 process_raw::process_raw(const std::string &fname,size_t pagesize_,size_t margin_)
     :image_process(fname,pagesize_,margin_),
-     file_list(),raw_filesize(0),current_file_name(),
+     file_list(),raw_filesize(0),fd_M(),
 #ifdef WIN32
-     current_handle(INVALID_HANDLE_VALUE)
+     current_file_name(),current_handle(INVALID_HANDLE_VALUE),
 #else
-     current_fd(-1)
+     open_files(0),use_clock(0),reopens(0),
 #endif
+     stats_M(),devices(),
+     mapped_pages(0)
 {
+    pthread_mutex_init(&fd_M,NULL);
+    pthread_mutex_init(&stats_M,NULL);
 }
 
 process_raw::~process_raw() {
+    stop_reader();
+    unmap_files();
 #ifdef WIN32
     if(current_handle!=INVALID_HANDLE_VALUE) ::CloseHandle(current_handle);
 #else
-    if(current_fd>0) ::close(current_fd);
+    for(file_list_t::const_iterator it = file_list.begin();it!=file_list.end();it++){
+        if((*it).fd>=0) ::close((*it).fd);
+    }
 #endif
+    pthread_mutex_destroy(&fd_M);
+    pthread_mutex_destroy(&stats_M);
 }
 
 #ifdef WIN32
@@ -726,18 +1070,33 @@ void process_raw::add_file(const std::string &fname)
             (ULONG)pdg.SectorsPerTrack * (ULONG)pdg.BytesPerSector;
     }
 #endif
-    file_list.push_back(file_info(fname,raw_filesize,fname_length));
+    uint64_t dev = 0;
+#ifndef WIN32
+    struct stat st;
+    if(stat(fname.c_str(),&st)==0){
+        dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev; // a disk is its own device
+    }
+#endif
+    file_list.push_back(file_info(fname,raw_filesize,fname_length,dev));
     raw_filesize += fname_length;
 }
 
+/**
+ * Find the file that holds pos. file_list is in offset order, so this is
+ * a binary search for the last file that starts at or before pos.
+ */
+bool process_raw::offset_less(int64_t pos,const file_info &fi)
+{
+    return pos < fi.offset;
+}
+
 const process_raw::file_info *process_raw::find_offset(int64_t pos) const
 {
-    for(process_raw::file_list_t::const_iterator it = file_list.begin();it != file_list.end();it++){
-	if((*it).offset<=pos && pos< ((*it).offset+(*it).length)){
-	    return &(*it);
-	}
-    }
-    return 0;
+    file_list_t::const_iterator it = std::upper_bound(file_list.begin(),file_list.end(),pos,offset_less);
+    if(it==file_list.begin()) return 0;
+    --it;
+    if(pos < (*it).offset+(*it).length) return &(*it);
+    return 0;				// past the end, or an empty file
 }
 
 /**
@@ -758,9 +1117,65 @@ int process_raw::open()
 	    add_file(std::string(probename)); // found another name
 	}
     }
+    if(opt_mmap) map_files();
+    if(opt_read_depth>0) start_reader(opt_read_depth);
     return 0;
 }
 
+/**
+ * Zero-copy reading.
+ * Each file of the image is mapped whole, and sbuf_alloc() returns sbufs
+ * that point into the mapping, so a page costs no malloc, no copy and no
+ * free(). A page that runs from one file of a split image into the next
+ * is not contiguous in memory, so it is still read into a buffer.
+ * A file that cannot be mapped (too big for the address space, or not
+ * mappable at all) is also read the normal way.
+ *
+ * An I/O error on a mapped page raises SIGBUS rather than a read error,
+ * so this is only for images on healthy local storage.
+ */
+uint32_t process_raw::opt_read_depth = 0;
+bool process_raw::opt_mmap = false;
+void process_raw::map_files()
+{
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    for(file_list_t::iterator it = file_list.begin();it!=file_list.end();it++){
+        if((*it).length<=0 || (uint64_t)(*it).length > (uint64_t)SIZE_MAX) continue;
+        int fd = ::open((*it).name.c_str(),O_RDONLY|O_BINARY);
+        if(fd<0) continue;
+        void *map = mmap(0,(size_t)(*it).length,PROT_READ,MAP_SHARED,fd,0);
+        ::close(fd);                    // the mapping keeps the file open
+        if(map==MAP_FAILED) continue;
+        (*it).map = (const uint8_t *)map;
+    }
+    set_sequential(false);
+#endif
+}
+
+void process_raw::unmap_files()
+{
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    for(file_list_t::iterator it = file_list.begin();it!=file_list.end();it++){
+        if((*it).map) munmap((void *)(*it).map,(size_t)(*it).length);
+        (*it).map = 0;
+    }
+#endif
+}
+
+/**
+ * Tell the kernel how the mappings will be read: front to back,
+ * or in random order when sampling.
+ */
+void process_raw::set_sequential(bool val)
+{
+    image_process::set_sequential(val);
+#if defined(HAVE_MMAP) && !defined(WIN32) && defined(MADV_SEQUENTIAL)
+    for(file_list_t::const_iterator it = file_list.begin();it!=file_list.end();it++){
+        if((*it).map) madvise((void *)(*it).map,(size_t)(*it).length,val ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+#endif
+}
+
 int64_t process_raw::image_size() const
 {
     return raw_filesize;
@@ -779,32 +1194,30 @@ int process_raw::pread(unsigned char *buf,size_t bytes,int64_t offset) const
     const file_info *fi = find_offset(offset);
     if(fi==0) return 0;			// nothing to read.
 
+#ifdef WIN32
     /* See if the file is the one that's currently opened.
      * If not, close the current one and open the new one.
+     * There is one handle and it has a file pointer, so reads take turns.
      */
-
+    pthread_mutex_lock(&fd_M);
     if(fi->name != current_file_name){
-#ifdef WIN32
         if(current_handle!=INVALID_HANDLE_VALUE) ::CloseHandle(current_handle);
-#else
-	if(current_fd>=0) close(current_fd);
-#endif
 
 	current_file_name = fi->name;
 	fprintf(stderr,"Attempt to open %s\n",fi->name.c_str());
-#ifdef WIN32
         current_handle = CreateFileA(fi->name.c_str(), FILE_READ_DATA,
                                     FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
 				     OPEN_EXISTING, 0, NULL);
         if(current_handle==INVALID_HANDLE_VALUE){
 	  fprintf(stderr,"bulk_extractor WIN32 subsystem: cannot open file '%s'\n",fi->name.c_str());
+          pthread_mutex_unlock(&fd_M);
 	  return -1;
 	}
+    }
 #else        
-	current_fd = ::open(fi->name.c_str(),O_RDONLY|O_BINARY);
-	if(current_fd<=0) return -1;	// can't read this data
+    int fd = acquire_fd(fi);
+    if(fd<0) return -1;                 // can't read this data
 #endif
-    }
 
 #if defined(HAVE_PREAD64)
     /* If we have pread64, make sure it is defined */
@@ -819,19 +1232,27 @@ int process_raw::pread(unsigned char *buf,size_t bytes,int64_t offset) const
     /* we have neither, so just hack it with lseek64 */
 
     assert(fi->offset <= offset);
+    double start = now();
 #ifdef WIN32
     DWORD bytes_read = 0;
     LARGE_INTEGER li;
     li.QuadPart = offset - fi->offset;
     li.LowPart = SetFilePointer(current_handle, li.LowPart, &li.HighPart, FILE_BEGIN);
-    if(li.LowPart == INVALID_SET_FILE_POINTER) return -1;
+    if(li.LowPart == INVALID_SET_FILE_POINTER){
+        pthread_mutex_unlock(&fd_M);
+        return -1;
+    }
     if (FALSE == ReadFile(current_handle, buf, (DWORD) bytes, &bytes_read, NULL)){
+        pthread_mutex_unlock(&fd_M);
         return -1;
     }
+    pthread_mutex_unlock(&fd_M);
 #else
-    ssize_t bytes_read = ::pread64(current_fd,buf,bytes,offset - fi->offset);
+    ssize_t bytes_read = ::pread64(fd,buf,bytes,offset - fi->offset);
+    release_fd(fi);
 #endif
     if(bytes_read<0) return -1;		// error???
+    account(offset,bytes_read,start,now());
     if((size_t)bytes_read==bytes) return bytes_read; // read precisely the correct amount!
 
     /* Need to recurse */
@@ -842,6 +1263,135 @@ int process_raw::pread(unsigned char *buf,size_t bytes,int64_t offset) const
     return bytes_read + bytes_read2;
 }
 
+#ifndef WIN32
+/**
+ * Open files are kept in a pool of at most opt_max_open_files, so that
+ * several threads can read from different files of a split image at the
+ * same time without reopening them, and an image in thousands of pieces
+ * does not run out of descriptors. A file is only closed, least recently
+ * used first, when no read is using it.
+ */
+uint32_t process_raw::opt_max_open_files = 128;
+int process_raw::acquire_fd(const file_info *fi) const
+{
+    pthread_mutex_lock(&fd_M);
+    if(fi->fd<0){
+        if(open_files >= opt_max_open_files) close_idle_fd();
+        if(!fi->opened){
+            fprintf(stderr,"Attempt to open %s\n",fi->name.c_str());
+        } else {
+            reopens++;
+        }
+        fi->fd = ::open(fi->name.c_str(),O_RDONLY|O_BINARY);
+        fi->opened = true;
+        if(fi->fd>=0) open_files++;
+    }
+    int fd = fi->fd;
+    if(fd>=0){
+        fi->users++;
+        fi->last_use = ++use_clock;
+    }
+    pthread_mutex_unlock(&fd_M);
+    return fd;
+}
+
+void process_raw::release_fd(const file_info *fi) const
+{
+    pthread_mutex_lock(&fd_M);
+    fi->users--;
+    pthread_mutex_unlock(&fd_M);
+}
+
+/* Close the least recently used file that no one is reading. Call with fd_M held. */
+void process_raw::close_idle_fd() const
+{
+    const file_info *victim = 0;
+    for(file_list_t::const_iterator it = file_list.begin();it!=file_list.end();it++){
+        if((*it).fd>=0 && (*it).users==0 && (victim==0 || (*it).last_use < victim->last_use)){
+            victim = &(*it);
+        }
+    }
+    if(victim==0) return;               // all busy; go over the limit for now
+    ::close(victim->fd);
+    victim->fd = -1;
+    open_files--;
+}
+#endif
+
+/**
+ * Find the file that holds image offset: its descriptor, the offset
+ * within it, and how many bytes of it remain. For the io_uring reader.
+ */
+bool process_raw::segment(int64_t offset,int *fd,int64_t *file_offset,size_t *avail) const
+{
+#ifdef WIN32
+    return false;
+#else
+    const file_info *fi = find_offset(offset);
+    if(fi==0) return false;
+    *fd = acquire_fd(fi);
+    if(*fd<0) return false;
+    *file_offset = offset - fi->offset;
+    *avail = fi->length - *file_offset;
+    return true;
+#endif
+}
+
+void process_raw::release_segment(int64_t offset) const
+{
+#ifndef WIN32
+    const file_info *fi = find_offset(offset);
+    if(fi) release_fd(fi);
+#endif
+}
+
+/**
+ * Record a completed read against the device that holds offset.
+ */
+void process_raw::account(int64_t offset,size_t bytes,double start,double end) const
+{
+    const file_info *fi = find_offset(offset);
+    if(fi==0) return;
+    pthread_mutex_lock(&stats_M);
+    device_stats &ds = devices[fi->dev];
+    ds.reads++;
+    ds.bytes += bytes;
+    if(ds.first==0 || start < ds.first) ds.first = start;
+    if(end > ds.last) ds.last = end;
+    pthread_mutex_unlock(&stats_M);
+}
+
+/**
+ * Write how the image was read, and the throughput of each device
+ * from its first read to its last.
+ */
+void process_raw::dump_read_stats(dfxml_writer &xreport) const
+{
+    std::stringstream ss;
+    ss << "backend='" << (reader ? reader->name() : (opt_mmap ? "mmap" : "pread")) << "'";
+    if(reader) ss << " depth='" << read_depth << "'";
+    xreport.push("raw_reads",ss.str());
+    if(mapped_pages) xreport.xmlout("mapped_pages",mapped_pages);
+#ifndef WIN32
+    if(reopens) xreport.xmlout("reopens",reopens);
+#endif
+    pthread_mutex_lock(&stats_M);
+    for(std::map<uint64_t,device_stats>::const_iterator it = devices.begin();it!=devices.end();it++){
+        const device_stats &ds = it->second;
+        uint32_t files = 0;
+        for(file_list_t::const_iterator fi = file_list.begin();fi!=file_list.end();fi++){
+            if((*fi).dev==it->first) files++;
+        }
+        double seconds = ds.last - ds.first;
+        std::stringstream ds_attrs;
+        ds_attrs << "id='" << it->first << "' files='" << files << "' reads='" << ds.reads
+                 << "' bytes='" << ds.bytes << "' seconds='" << seconds << "'";
+        if(seconds>0) ds_attrs << " mb_per_sec='" << ds.bytes / seconds / 1000000 << "'";
+        xreport.xmlout("device","",ds_attrs.str(),false);
+    }
+    pthread_mutex_unlock(&stats_M);
+    xreport.pop();
+}
 
 image_process::iterator process_raw::begin() const
 {
@@ -893,19 +1443,41 @@ sbuf_t *process_raw::sbuf_alloc(image_process::iterator &it) const
     if(this->raw_filesize < it.raw_offset + count){    /* See if that's more than I need */
 	count = this->raw_filesize - it.raw_offset;
     }
-    unsigned char *buf = (unsigned char *)malloc(count);
-    if(!buf) throw std::bad_alloc();			// no memory
-    count = this->pread(buf,count,it.raw_offset);       // do the read
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    /* If the page is entirely within one mapped file, point the sbuf at the mapping */
+    const file_info *fi = count>0 ? find_offset(it.raw_offset) : 0;
+    if(fi && fi->map && it.raw_offset + count <= fi->offset + fi->length){
+        const int64_t start = it.raw_offset - fi->offset;
+#ifdef MADV_WILLNEED
+        /* Start faulting in the next page while this one is scanned */
+        static const int64_t vm_pagesize = sysconf(_SC_PAGESIZE);
+        int64_t next = (start + pagesize) & ~(vm_pagesize-1);
+        if(next < fi->length){
+            int64_t len = pagesize + margin;
+            if(next + len > fi->length) len = fi->length - next;
+            madvise((void *)(fi->map+next),(size_t)len,MADV_WILLNEED);
+        }
+#endif
+        mapped_pages++;
+        return new sbuf_t(get_pos0(it),fi->map+start,count,pagesize,false);
+    }
+#endif
+    if(reader && sequential) return sbuf_alloc_async(it);
+
+    const size_t allocated = count;
+    unsigned char *buf = (unsigned char *)buffer_pool::get().alloc(allocated);
+    count = this->read_page(buf,count,it.raw_offset);   // do the read
+    if(count<0) count = salvage_read(buf,allocated,it.raw_offset);
     if(count==0){
-	free(buf);
+	buffer_pool::get().free(buf,allocated);
 	it.eof = true;
 	return 0;
     }
     if(count<0){
-	free(buf);
+	buffer_pool::get().free(buf,allocated);
 	throw read_error();
     }
-    sbuf_t *sbuf = new sbuf_t(get_pos0(it),buf,count,pagesize,true);
+    sbuf_t *sbuf = new pooled_sbuf(get_pos0(it),buf,count,pagesize,allocated);
     return sbuf;
 }
 
@@ -932,39 +1504,363 @@ uint64_t process_raw::seek_block(image_process::iterator &it,uint64_t block) con
 }
 
 
+/****************************************************************
+ *** STREAM
+ ****************************************************************/
+
+uint32_t process_stream::opt_pipe_kb = 1024;
+
+process_stream::process_stream(const std::string &fname,size_t pagesize_,size_t margin_):
+    image_process(fname,pagesize_,margin_),fd(-1),stream_pos(0),overlap()
+{
+}
+
+process_stream::~process_stream()
+{
+    if(fd>0) ::close(fd);               // never close stdin
+}
+
+int process_stream::open()
+{
+    if(image_fname()=="-"){
+        fd = 0;
+#ifdef WIN32
+        setmode(fd,O_BINARY);
+#endif
+    } else {
+        fd = ::open(image_fname().c_str(),O_RDONLY|O_BINARY);
+        if(fd<0) return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    /* A larger pipe lets the writer get further ahead while a page is being read */
+    if(opt_pipe_kb>0) fcntl(fd,F_SETPIPE_SZ,(int)opt_pipe_kb*1024);
+#endif
+    return 0;
+}
+
+/* A pipe returns what has been written so far, so keep reading until
+ * count bytes, end of file or an error.
+ */
+ssize_t process_stream::read_fully(uint8_t *buf,size_t count) const
+{
+    size_t got = 0;
+    while(got < count){
+        ssize_t r = ::read(fd,buf+got,count-got);
+        if(r<0 && errno==EINTR) continue;
+        if(r<0) return -1;
+        if(r==0) break;                 // end of file
+        got += r;
+    }
+    stream_pos += got;
+    return got;
+}
+
+/* Only the bytes that are still held from the last page can be read again */
+int process_stream::pread(uint8_t *buf,size_t bytes,int64_t offset) const
+{
+    const int64_t start = stream_pos - overlap.size();
+    if(offset<start || offset>stream_pos){
+        errno = ESPIPE;
+        return -1;
+    }
+    if(bytes > (size_t)(stream_pos-offset)) bytes = stream_pos-offset;
+    if(bytes>0) memcpy(buf,&overlap[offset-start],bytes);
+    return bytes;
+}
+
+int64_t process_stream::image_size() const
+{
+    return stream_pos;
+}
+
+image_process::iterator process_stream::begin() const
+{
+    image_process::iterator it(this);
+    return it;
+}
+
+/* The end is not known until it is read; sbuf_alloc() sets eof when it gets there */
+image_process::iterator process_stream::end() const
+{
+    image_process::iterator it(this);
+    it.raw_offset = INT64_MAX;
+    it.eof = true;
+    return it;
+}
+
+void process_stream::increment_iterator(image_process::iterator &it) const
+{
+    it.raw_offset += pagesize;
+}
+
+double process_stream::fraction_done(const image_process::iterator &it) const
+{
+    return 0;
+}
+
+std::string process_stream::str(const image_process::iterator &it) const
+{
+    char buf[64];
+    snprintf(buf,sizeof(buf),"Offset %" PRId64 "MB",it.raw_offset/1000000);
+    return std::string(buf);
+}
+
+pos0_t process_stream::get_pos0(const image_process::iterator &it) const
+{
+    return pos0_t("",it.raw_offset);
+}
+
+/** Read the page at the iterator. The start of the page may still be
+ * held from the margin of the last one; pages before that are gone, and
+ * pages after the end of what has been read are read and thrown away.
+ */
+sbuf_t *process_stream::sbuf_alloc(image_process::iterator &it) const
+{
+    const int64_t held = stream_pos - overlap.size();
+    if(it.raw_offset < held) throw read_error(); // cannot go back
+
+    const size_t allocated = pagesize + margin;
+    unsigned char *buf = (unsigned char *)buffer_pool::get().alloc(allocated);
+
+    /* Skip forward to the page */
+    while(stream_pos < it.raw_offset){
+        size_t skip = allocated;
+        if((int64_t)skip > it.raw_offset - stream_pos) skip = it.raw_offset - stream_pos;
+        ssize_t r = read_fully(buf,skip);
+        if(r<0){
+            buffer_pool::get().free(buf,allocated);
+            throw read_error();
+        }
+        if((size_t)r<skip){             // ended before the page
+            buffer_pool::get().free(buf,allocated);
+            overlap.clear();
+            it.eof = true;
+            return 0;
+        }
+        overlap.clear();
+    }
+
+    /* Reuse what is held, then read the rest */
+    size_t have = 0;
+    if(it.raw_offset < stream_pos){
+        have = stream_pos - it.raw_offset;
+        memcpy(buf,&overlap[it.raw_offset-held],have);
+        margin_bytes_reused += have;
+    }
+    ssize_t r = read_fully(buf+have,allocated-have);
+    if(r<0){
+        buffer_pool::get().free(buf,allocated);
+        throw read_error();
+    }
+    const size_t count = have + r;
+    if(count==0){
+	buffer_pool::get().free(buf,allocated);
+	it.eof = true;
+	return 0;
+    }
+
+    /* Keep the margin; it is the start of the next page */
+    if(count > pagesize) overlap.assign(buf+pagesize,buf+count);
+    else overlap.clear();
+    return new pooled_sbuf(get_pos0(it),buf,count,pagesize,allocated);
+}
+
+/* Not known until the end; the pages read so far */
+uint64_t process_stream::max_blocks(const image_process::iterator &it) const
+{
+    return (stream_pos+pagesize-1) / pagesize;
+}
+
+uint64_t process_stream::seek_block(image_process::iterator &it,uint64_t block) const
+{
+    it.raw_offset = block * pagesize;
+    return block;
+}
+
+
 /****************************************************************
  *** Directory Recursion
  ****************************************************************/
 
+void file_map::release()
+{
+    if(__sync_sub_and_fetch(&refs,1)>0) return;
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    munmap((void *)buf,size);
+#endif
+    delete this;
+}
+
 /**
- * directories don't get page sizes or margins; the page size is the entire
- * file and the margin is 0.
+ * A file no larger than pagesize+margin is one sbuf, as it always was.
+ * A larger one is paged; see file_map in image_process.h.
+ * Runs of files no larger than opt_small_file_bytes are read into one
+ * file_batch_sbuf of up to opt_batch_bytes.
  */
-process_dir::process_dir(const std::string &image_dir):
-    image_process(image_dir,0,0),files()
-{
+std::string process_dir::opt_whole_file_scanners = "elf,pdf,rar,sqlite,winpe,zip";
+std::set<std::string> process_dir::whole_file_names;
+uint32_t process_dir::opt_walk_threads = 8;
+uint32_t process_dir::opt_small_file_bytes = 64*1024;
+uint32_t process_dir::opt_batch_bytes = 4*1024*1024;
+static const size_t max_batch_files = 4096;
+
+process_dir::process_dir(const std::string &image_dir,size_t pagesize_,size_t margin_):
+    image_process(image_dir,pagesize_,margin_),files(),sizes(),current_map(0),current_map_file(0),
+    whole_file_pass(false),walk_seconds(0),batched_files(0),batches(0)
+{
+    aftimer t;
+    t.start();
+#ifdef WIN32
     /* Use dig to get a list of all the files */
     dig d(image_dir);
     for(dig::const_iterator it=d.begin();it!=d.end();++it){
-#ifdef WIN32
 	std::string fn = safe_utf16to8(*it);
 	if(ends_with(fn,"/.")) continue;
 	files.push_back(fn);
+    }
+    sizes.resize(files.size(),-1);
 #else
-	files.push_back(*it);
-#endif
+    /* List the tree with several threads; the sizes come with the names */
+    parallel_dig d(image_dir,opt_walk_threads);
+    for(std::vector<parallel_dig::entry>::const_iterator it=d.files.begin();it!=d.files.end();it++){
+        files.push_back(it->name);
+        sizes.push_back(it->size);
     }
+#endif
+    t.stop();
+    walk_seconds = t.elapsed_seconds();
 }
 
 process_dir::~process_dir()
 {
+    if(current_map) current_map->release();
 }
 
 int process_dir::open()
 {
+    std::vector<std::string> names = split(opt_whole_file_scanners,',');
+    whole_file_names.clear();
+    whole_file_names.insert(names.begin(),names.end());
+    for(be13::plugin::scanner_vector::const_iterator it = be13::plugin::current_scanners.begin();
+        it!=be13::plugin::current_scanners.end();it++){
+        if((*it)->enabled && whole_file_scanner((*it)->info.name)) whole_file_pass = true;
+    }
     return 0;				// always successful
 }
 
+bool process_dir::whole_file_scanner(const std::string &name)
+{
+    return whole_file_names.find(name)!=whole_file_names.end();
+}
+
+int64_t process_dir::file_size(size_t file_number) const
+{
+    if(sizes[file_number]<0){
+        struct stat st;
+        if(stat(files[file_number].c_str(),&st)==0) sizes[file_number] = st.st_size;
+    }
+    return sizes[file_number];
+}
+
+bool process_dir::paged(size_t file_number) const
+{
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    return file_number < files.size() && pagesize>0
+        && file_size(file_number) > (int64_t)(pagesize+margin)
+        && (uint64_t)file_size(file_number) <= (uint64_t)SIZE_MAX;
+#else
+    return false;
+#endif
+}
+
+bool process_dir::small(size_t file_number) const
+{
+    return opt_small_file_bytes>0 && file_number < files.size() && !paged(file_number)
+        && file_size(file_number)>=0 && file_size(file_number) <= (int64_t)opt_small_file_bytes;
+}
+
+size_t process_dir::batch_end(size_t file_number) const
+{
+    size_t end = file_number+1;         // the first file always fits
+    uint64_t bytes = file_size(file_number);
+    while(end < files.size() && end-file_number < max_batch_files && small(end)
+          && bytes + file_size(end) <= opt_batch_bytes){
+        bytes += file_size(end);
+        end++;
+    }
+    return end;
+}
+
+/* Read the small files of a batch one after the other into one pooled
+ * buffer. A file that cannot be read, or that has shrunk, is skipped or
+ * cut short; only a batch with nothing readable in it is a read error.
+ */
+sbuf_t *process_dir::read_batch(size_t file_number) const
+{
+    const size_t end = batch_end(file_number);
+    size_t want = 0;
+    for(size_t i=file_number;i<end;i++) want += file_size(i);
+    size_t allocated = want>0 ? want : 1;
+    uint8_t *buf = (uint8_t *)buffer_pool::get().alloc(allocated);
+    std::vector<file_batch_sbuf::member> members;
+    size_t pos = 0;
+    for(size_t i=file_number;i<end;i++){
+        size_t len = file_size(i);
+        if(len==0) continue;
+        int fd = ::open(files[i].c_str(),O_RDONLY|O_BINARY);
+        if(fd<0) continue;
+        size_t got = 0;
+        while(got<len){
+            ssize_t r = ::read(fd,buf+pos+got,len-got);
+            if(r<=0) break;
+            got += r;
+        }
+        ::close(fd);
+        if(got==0) continue;
+        members.push_back(file_batch_sbuf::member(files[i],pos,got));
+        pos += got;
+    }
+    if(members.empty() && want>0){
+        buffer_pool::get().free(buf,allocated);
+        throw read_error();
+    }
+    file_batch_sbuf *sbuf = new file_batch_sbuf(pos0_t(files[file_number],0),buf,pos,allocated);
+    sbuf->members.swap(members);
+    __sync_fetch_and_add(&batched_files,end-file_number);
+    __sync_fetch_and_add(&batches,1);
+    return sbuf;
+}
+
+void process_dir::dump_stats(dfxml_writer &xreport) const
+{
+    xreport.push("dir_stats");
+    xreport.xmlout("files",(uint64_t)files.size());
+    xreport.xmlout("walk_threads",(uint64_t)opt_walk_threads);
+    xreport.xmlout("walk_seconds",walk_seconds);
+    xreport.xmlout("batched_files",batched_files);
+    xreport.xmlout("batches",batches);
+    xreport.pop();
+}
+
+/* Map a large file, keeping it for its next page */
+file_map *process_dir::map_file(size_t file_number) const
+{
+    if(current_map && current_map_file==file_number) return current_map;
+    if(current_map) current_map->release();
+    current_map = 0;
+#if defined(HAVE_MMAP) && !defined(WIN32)
+    const size_t size = file_size(file_number);
+    int fd = ::open(files[file_number].c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) return 0;
+    void *buf = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);                        // the mapping keeps the file open
+    if(buf==MAP_FAILED) return 0;
+    current_map = new file_map((const uint8_t *)buf,size);
+    current_map_file = file_number;
+#endif
+    return current_map;
+}
+
 int process_dir::pread(unsigned char *buf,size_t bytes,int64_t offset) const
 {
     err(1,"process_dir does not support pread");
@@ -989,14 +1885,28 @@ image_process::iterator process_dir::end() const
     return it;
 }
 
+/* The pages of a large file are at raw_offset 0, pagesize, ...;
+ * its whole-file unit is at raw_offset == its size.
+ */
 void process_dir::increment_iterator(image_process::iterator &it) const
 {
-    it.file_number++;
+    if(paged(it.file_number) && it.raw_offset < file_size(it.file_number)){
+        it.raw_offset += pagesize;
+        if(it.raw_offset < file_size(it.file_number)) return;
+        it.raw_offset = file_size(it.file_number);
+        if(whole_file_pass) return;
+    }
+    it.raw_offset = 0;
+    if(small(it.file_number)) it.file_number = batch_end(it.file_number);
+    else it.file_number++;
     if(it.file_number>files.size()) it.file_number=files.size();
 }
 
 pos0_t process_dir::get_pos0(const image_process::iterator &it) const
 {
+    if(it.raw_offset>0 && it.raw_offset < file_size(it.file_number)){
+        return pos0_t(files[it.file_number],it.raw_offset);
+    }
     return pos0_t(files[it.file_number],0);
 }
 
@@ -1006,6 +1916,19 @@ pos0_t process_dir::get_pos0(const image_process::iterator &it) const
 sbuf_t *process_dir::sbuf_alloc(image_process::iterator &it) const
 {
     std::string fname = files[it.file_number];
+    if(small(it.file_number)) return read_batch(it.file_number);
+    if(paged(it.file_number)){
+        file_map *map = map_file(it.file_number);
+        if(map==0) throw read_error();
+        if(it.raw_offset >= (int64_t)map->size){
+            return new file_part_sbuf(get_pos0(it),map,0,map->size,map->size,true);
+        }
+        size_t count = pagesize + margin;
+        size_t page  = pagesize;
+        if(it.raw_offset + count > map->size) count = map->size - it.raw_offset;
+        if(page > count) page = count;
+        return new file_part_sbuf(get_pos0(it),map,it.raw_offset,count,page,false);
+    }
     sbuf_t *sbuf = sbuf_t::map_file(fname);
     if(sbuf==0) throw read_error();	// can't read
     return sbuf;
@@ -1030,6 +1953,7 @@ uint64_t process_dir::max_blocks(const image_process::iterator &it) const
 uint64_t process_dir::seek_block(class image_process::iterator &it,uint64_t block) const
 {
     it.file_number = block;
+    it.raw_offset = 0;
     return it.file_number;
 }
 
@@ -1055,10 +1979,18 @@ image_process *image_process::open(std::string fn,bool opt_recurse,
 #endif
 
     memset(&st,0,sizeof(st));
-    if(stat(fn.c_str(),&st) && !is_windows_unc){
+    if(fn=="-"){
+        ip = new process_stream(fn,pagesize_,margin_); // stdin
+    }
+    else if(stat(fn.c_str(),&st) && !is_windows_unc){
 	return 0;			// no file?
     }
-    if(S_ISDIR(st.st_mode)){
+#ifdef S_ISFIFO
+    else if(S_ISFIFO(st.st_mode)){
+        ip = new process_stream(fn,pagesize_,margin_);
+    }
+#endif
+    else if(S_ISDIR(st.st_mode)){
 	/* If this is a directory, process specially */
 	if(opt_recurse==0){
 	    std::cerr << "error: " << fn << " is a directory but -R (opt_recurse) not set\n";
@@ -1088,7 +2020,7 @@ image_process *image_process::open(std::string fn,bool opt_recurse,
             }
         }
         closedir(dirp);
-	ip = new process_dir(fn);
+	ip = new process_dir(fn,pagesize_,margin_);
     }
     else {
 	/* Otherwise open a file by checking extension.
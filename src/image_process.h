@@ -13,6 +13,7 @@
  * process_ewf - process an EWF file
  * process_aff - process an AFF file
  * process_raw - process a RAW or splitraw file.
+ * process_stream - process a pipe or stdin ("-"), reading it once, in order.
  * process_dir - recursively process a directory of files (but not E01 or AFF files)
  * 
  * Conditional compilation assures that this compiles no matter which class libraries are installed.
@@ -44,6 +45,11 @@
 
 #include "sbuf.h"
 #include "dig.h"
+#include "buffer_pool.h"
+#include <map>
+#include <set>
+#include <vector>
+#include <pthread.h>
 
 #if defined(WIN32) 
 #  include <winsock2.h>
@@ -71,6 +77,22 @@ private:
 
     /****************************************************************/
     const std::string image_fname_;			/* image filename */
+
+    /* Sequential reading: the margin of one page is the start of the next,
+     * so it is kept here instead of being read again. Only the producer
+     * thread calls sbuf_alloc(), so these need no lock.
+     */
+    mutable std::vector<uint8_t> carry;		/* bytes at carry_offset from the last read */
+    mutable int64_t carry_offset;
+    /* Read errors; see salvage_read() */
+    typedef std::map<int64_t,int64_t> bad_range_map_t;  /* offset -> length, coalesced */
+    mutable bad_range_map_t bad_ranges;
+    int salvage(uint8_t *buf,size_t count,int64_t offset) const;
+    void add_bad_range(int64_t offset,int64_t len) const;
+protected:
+    bool  sequential;
+    int read_page(uint8_t *buf,size_t count,int64_t offset) const; /* pread(), reusing the last margin */
+    int salvage_read(uint8_t *buf,size_t count,int64_t offset) const; /* after a failed read; -1 if off */
 public:    
     /**
      * open() figures out which child class to call, calls its open, then
@@ -81,6 +103,13 @@ public:
     const size_t pagesize;                    // page size we are using
     const size_t margin;                      // margin size we are using
     bool  report_read_errors;
+    mutable uint64_t margin_bytes_reused;     // bytes copied from the previous page instead of read
+    mutable uint64_t margins_short;           // asynchronous pages whose margin could not all be read
+    static uint32_t opt_sector_bytes;         // read errors are narrowed down to this; 0 skips the page
+    static uint32_t opt_sector_retries;       // reads of a failing sector before it is zeroed
+    mutable uint64_t salvaged_reads;          // failed reads that were read again by sectors
+    mutable uint64_t bad_sectors;             // sectors zeroed
+    void dump_read_errors(class dfxml_writer &xreport) const;
 
     class read_error: public std::exception {
 	virtual const char *what() const throw() {
@@ -123,9 +152,33 @@ public:
         void set_raw_offset(int64_t anOffset){ raw_offset=anOffset;}
     };
 
-    image_process(const std::string &fn,size_t pagesize_,size_t margin_):image_fname_(fn),pagesize(pagesize_),margin(margin_),
-                                                                         report_read_errors(true){}
-    virtual ~image_process(){};
+protected:
+    /* Asynchronous reads, for images that can have several reads going at once; see raw_reader.h.
+     * A subclass that calls start_reader() must call stop_reader() in its destructor,
+     * since the reader calls its pread().
+     */
+    class raw_reader *reader;
+    uint32_t    read_depth;                     /* chunks kept in flight */
+    typedef std::map<int64_t,class raw_request *> request_map_t;
+    mutable request_map_t requests;             /* chunks in flight, by offset */
+    mutable pthread_mutex_t reader_M;
+    void        start_reader(uint32_t depth);
+    void        stop_reader();
+    class raw_request *request_chunk(int64_t offset) const;
+    void        cancel_requests(int64_t before) const;
+    sbuf_t      *sbuf_alloc_async(class image_process::iterator &it) const;
+public:
+    image_process(const std::string &fn,size_t pagesize_,size_t margin_):image_fname_(fn),
+                                                                         carry(),carry_offset(0),bad_ranges(),sequential(false),
+                                                                         pagesize(pagesize_),margin(margin_),
+                                                                         report_read_errors(true),margin_bytes_reused(0),margins_short(0),
+                                                                         salvaged_reads(0),bad_sectors(0),
+                                                                         reader(0),read_depth(0),requests(),reader_M(){
+        pthread_mutex_init(&reader_M,NULL);
+    }
+    virtual ~image_process(){
+        pthread_mutex_destroy(&reader_M);
+    };
 
     /* image support */
     virtual int open()=0;				    /* open; return 0 if successful */
@@ -144,7 +197,9 @@ public:
     virtual uint64_t max_blocks(const class image_process::iterator &it) const = 0;
     // seek_block modifies the iterator, but not the image!
     virtual uint64_t seek_block(class image_process::iterator &it,uint64_t block) const = 0; // returns -1 if failure
+    virtual bool can_seek() const { return true; }      // false if pages can only be read in order
     virtual void set_report_read_errors(bool val){report_read_errors=val;}
+    virtual void set_sequential(bool val){sequential=val;carry.clear();} // pages will be read in order
 };
 
 inline image_process::iterator & operator++(image_process::iterator &it){
@@ -170,9 +225,12 @@ class process_aff : public image_process {
     /****************************************************************/
 
     mutable AFFILE *af;
+    mutable pthread_mutex_t af_M;       // af has one read position; the image hasher reads too
     std::vector<int64_t> pagelist;
 public:
-    process_aff(std::string fname,size_t pagesize_,size_t margin_) : image_process(fname,pagesize_,margin_),af(0),pagelist(){}
+    process_aff(std::string fname,size_t pagesize_,size_t margin_) : image_process(fname,pagesize_,margin_),af(0),af_M(),pagelist(){
+        pthread_mutex_init(&af_M,NULL);
+    }
     virtual ~process_aff();
 
     virtual image_process::iterator begin() const;
@@ -218,12 +276,26 @@ class process_ewf : public image_process {
     int64_t ewf_filesize;
     std::vector<std::string> details; 	       
     mutable libewf_handle_t *handle;
+    /* libewf handles are not thread-safe, so each concurrent read needs one of its own */
+    std::vector<libewf_handle_t *> handles;     /* handle and the extra ones */
+    mutable std::vector<libewf_handle_t *> idle_handles; /* guarded by handle_M */
+    mutable pthread_mutex_t handle_M;
+    mutable pthread_cond_t  handle_CV;
+    mutable uint64_t handle_waits;              /* reads that had to wait for a handle */
+    libewf_handle_t *acquire_handle() const;
+    void        release_handle(libewf_handle_t *h) const;
     //static int debug;
 
  public:
+    static uint32_t opt_handles;                /* handles to open; >1 decompresses that many pages at once */
     process_ewf(const std::string &fname,size_t pagesize_,size_t margin_) :
-        image_process(fname,pagesize_,margin_), ewf_filesize(0), details() ,handle(0) {}
+        image_process(fname,pagesize_,margin_), ewf_filesize(0), details() ,handle(0),
+        handles(),idle_handles(),handle_M(),handle_CV(),handle_waits(0) {
+        pthread_mutex_init(&handle_M,NULL);
+        pthread_cond_init(&handle_CV,NULL);
+    }
     virtual ~process_ewf();
+    void dump_read_stats(class dfxml_writer &xreport) const;
     std::vector<std::string> getewfdetails() const;
     int open();
     int pread(uint8_t *,size_t bytes,int64_t offset) const;	    /* read */
@@ -247,28 +319,70 @@ class process_ewf : public image_process {
  ****************************************************************/
 
 class process_raw : public image_process {
+    /******************************************************
+     *** neither copying nor assignment is implemented. ***
+     ******************************************************/
+    process_raw(const process_raw &);
+    process_raw &operator=(const process_raw &);
+
     class file_info {
     public:;
-        file_info(const std::string &name_,int64_t offset_,int64_t length_):name(name_),offset(offset_),length(length_){};
+        file_info(const std::string &name_,int64_t offset_,int64_t length_,uint64_t dev_):
+            name(name_),offset(offset_),length(length_),dev(dev_),map(0),fd(-1),users(0),last_use(0),opened(false){};
         std::string name;
 	int64_t offset;
 	int64_t length;
+        uint64_t dev;                           /* device the file is on, for stats */
+        const uint8_t *map;                     /* the whole file, if it is mmapped */
+        mutable int fd;                         /* -1 if not open; this and below guarded by fd_M */
+        mutable uint32_t users;                 /* reads using fd; it is not closed while >0 */
+        mutable uint64_t last_use;              /* for closing the least recently used */
+        mutable bool opened;                    /* has ever been opened */
+    };
+    /* Read statistics for each device the image is on */
+    class device_stats {
+    public:
+        device_stats():reads(0),bytes(0),first(0),last(0){}
+        uint64_t reads;
+        uint64_t bytes;
+        double   first;                         /* start of the first read */
+        double   last;                          /* end of the last read */
     };
     typedef std::vector<file_info> file_list_t;
     file_list_t file_list;
     void        add_file(const std::string &fname);
     class       file_info const *find_offset(int64_t offset) const;
+    static bool offset_less(int64_t pos,const file_info &fi);
     int64_t     raw_filesize;			/* sume of all the lengths */
-    mutable std::string current_file_name;		/* which file is currently open */
+    void        map_files();			/* mmap each file, if we can */
+    void        unmap_files();
+    mutable pthread_mutex_t fd_M;               /* opening and closing files */
 #ifdef WIN32
-    mutable HANDLE current_handle;		/* currently open file */
+    mutable std::string current_file_name;	/* which file is currently open */
+    mutable HANDLE current_handle;		/* currently open file; guarded by fd_M */
 #else
-    mutable int current_fd;			/* currently open file */
+    mutable uint32_t open_files;                /* files with an fd; guarded by fd_M */
+    mutable uint64_t use_clock;
+    mutable uint64_t reopens;                   /* files opened again after being closed */
+    int         acquire_fd(const file_info *fi) const;
+    void        release_fd(const file_info *fi) const;
+    void        close_idle_fd() const;
 #endif
+    mutable pthread_mutex_t stats_M;
+    mutable std::map<uint64_t,device_stats> devices;
 public:
+    static bool opt_mmap;			/* build sbufs directly on mmapped files */
+    static uint32_t opt_read_depth;		/* pages to keep in flight; 0 for one blocking read at a time */
+    static uint32_t opt_max_open_files;		/* open files kept for a split image */
+    mutable uint64_t mapped_pages;		/* pages handed out without a copy */
+    void        account(int64_t offset,size_t bytes,double start,double end) const; /* a read finished */
+    bool        segment(int64_t offset,int *fd,int64_t *file_offset,size_t *avail) const; /* where offset is */
+    void        release_segment(int64_t offset) const;  /* done with the fd from segment() */
+    void        dump_read_stats(class dfxml_writer &xreport) const;
     process_raw(const std::string &image_fname,size_t pagesize,size_t margin);
     virtual ~process_raw();
     virtual int open();
+    virtual void set_sequential(bool val);
     virtual int pread(uint8_t *,size_t bytes,int64_t offset) const;	    /* read */
 
     /* iterator support */
@@ -285,29 +399,155 @@ public:
     virtual uint64_t seek_block(class image_process::iterator &it,uint64_t block) const; // returns -1 if failue
 };
 
+/****************************************************************
+ *** STREAM
+ ****************************************************************/
+
+/* A pipe or stdin, read in order as the pages are asked for. Only the
+ * margin of the last page is held here; how far reading gets ahead of
+ * the scanners is bounded by phase 1's read-ahead queue, so the writer
+ * of the pipe is held back when the scanners fall behind. Pages can be
+ * skipped (restarts, -Y, -z) by reading past them, but not read again.
+ * The size of the image is not known until it has all been read.
+ */
+class process_stream : public image_process {
+    /******************************************************
+     *** neither copying nor assignment is implemented. ***
+     ******************************************************/
+    process_stream(const process_stream &);
+    process_stream &operator=(const process_stream &);
+
+    int         fd;
+    mutable int64_t stream_pos;			/* bytes read from fd so far */
+    mutable std::vector<uint8_t> overlap;	/* the last bytes read, ending at stream_pos */
+    ssize_t     read_fully(uint8_t *buf,size_t count) const;
+public:
+    static uint32_t opt_pipe_kb;		/* pipe buffer to ask the kernel for; 0 leaves it alone */
+    process_stream(const std::string &fname,size_t pagesize_,size_t margin_);
+    virtual ~process_stream();
+    virtual int open();
+    virtual int pread(uint8_t *,size_t bytes,int64_t offset) const;	    /* only from the last page's margin */
+    virtual bool can_seek() const { return false; }
+
+    /* iterator support */
+    virtual image_process::iterator begin() const;
+    virtual image_process::iterator end() const;
+    virtual void     increment_iterator(class image_process::iterator &it) const;
+
+    virtual pos0_t   get_pos0(const class image_process::iterator &it) const;    
+    virtual sbuf_t  *sbuf_alloc(class image_process::iterator &it) const;
+    virtual double   fraction_done(const class image_process::iterator &it) const;
+    virtual std::string str(const class image_process::iterator &it) const;
+    virtual int64_t  image_size() const;	/* bytes read so far */
+    virtual uint64_t max_blocks(const class image_process::iterator &it) const;
+    virtual uint64_t seek_block(class image_process::iterator &it,uint64_t block) const; // forward only
+};
+
 /****************************************************************
  *** Directory Recursion
  ****************************************************************/
 
 
+/* A file of a -R run that is too large to be one sbuf is mapped once and
+ * handed out as pages of pagesize+margin, with forensic paths relative
+ * to the file, so that its pages are scanned in parallel like an image's.
+ * The whole-file scanners (opt_whole_file_scanners) still see the file
+ * in one piece: after its pages comes a unit of the whole file, which
+ * only they are run on; the pages are run through all of the others.
+ */
+class file_map {
+    /*** neither copying nor assignment is implemented ***/
+    file_map(const file_map &);
+    file_map &operator=(const file_map &);
+public:
+    file_map(const uint8_t *buf_,size_t size_):buf(buf_),size(size_),refs(1){}
+    const uint8_t *buf;
+    const size_t size;
+    volatile int refs;                          /* the process_dir and each sbuf (atomic) */
+    void retain(){ __sync_fetch_and_add(&refs,1); }
+    void release();                             /* the last one unmaps the file */
+};
+
+class file_part_sbuf : public sbuf_t {
+    /*** neither copying nor assignment is implemented ***/
+    file_part_sbuf(const file_part_sbuf &);
+    file_part_sbuf &operator=(const file_part_sbuf &);
+    file_map *map;
+public:
+    const bool whole_file;                      /* true: only the whole-file scanners; false: all but them */
+    file_part_sbuf(const pos0_t &pos0_,file_map *map_,size_t offset,size_t bufsize_,size_t pagesize_,bool whole_file_):
+        sbuf_t(pos0_,map_->buf+offset,bufsize_,pagesize_,false),map(map_),whole_file(whole_file_){
+        map->retain();
+    }
+    virtual ~file_part_sbuf(){ map->release(); }
+};
+
+/* Small files of a -R run are read into one pooled buffer, many to a
+ * unit, so that a tree of millions of tiny files is not one task and one
+ * mmap per file. The worker runs each file through process_sbuf() on its
+ * own, with the file's own pos0.
+ */
+class file_batch_sbuf : public pooled_sbuf {
+    /*** neither copying nor assignment is implemented ***/
+    file_batch_sbuf(const file_batch_sbuf &);
+    file_batch_sbuf &operator=(const file_batch_sbuf &);
+public:
+    class member {
+    public:
+        member(const std::string &name_,size_t offset_,size_t len_):name(name_),offset(offset_),len(len_){}
+        std::string name;
+        size_t      offset;                     /* where in buf */
+        size_t      len;
+    };
+    std::vector<member> members;
+    file_batch_sbuf(const pos0_t &pos0_,const uint8_t *buf_,size_t bufsize_,size_t allocated_):
+        pooled_sbuf(pos0_,buf_,bufsize_,bufsize_,allocated_),members(){}
+};
+
 class process_dir : public image_process {
  private:
+    /******************************************************
+     *** neither copying nor assignment is implemented. ***
+     ******************************************************/
+    process_dir(const process_dir &);
+    process_dir &operator=(const process_dir &);
+
     std::vector<std::string> files;		/* all of the files */
+    mutable std::vector<int64_t> sizes;		/* of files; -1 until they are stat()ed */
+    mutable file_map *current_map;		/* the large file whose pages are being handed out */
+    mutable size_t current_map_file;
+    bool        whole_file_pass;		/* a whole-file scanner is enabled */
+    static std::set<std::string> whole_file_names;
+    double      walk_seconds;			/* time to list the files */
+    mutable uint64_t batched_files;		/* small files read into batches */
+    mutable uint64_t batches;
+    int64_t     file_size(size_t file_number) const;
+    bool        paged(size_t file_number) const; /* too large to be one sbuf */
+    bool        small(size_t file_number) const; /* read into a batch */
+    size_t      batch_end(size_t file_number) const; /* one past the last file of the batch starting here */
+    file_map    *map_file(size_t file_number) const;
+    sbuf_t      *read_batch(size_t file_number) const;
 
  public:
-    process_dir(const std::string &image_dir);
+    static std::string opt_whole_file_scanners;	/* comma-separated */
+    static uint32_t opt_walk_threads;		/* threads listing the directories */
+    static uint32_t opt_small_file_bytes;	/* files this size or smaller are batched; 0 for none */
+    static uint32_t opt_batch_bytes;		/* most bytes of small files in one batch */
+    void        dump_stats(class dfxml_writer &xreport) const;
+    static bool whole_file_scanner(const std::string &name);
+    process_dir(const std::string &image_dir,size_t pagesize_,size_t margin_);
     virtual ~process_dir();
 
     virtual int open();
     virtual int pread(uint8_t *,size_t bytes,int64_t offset) const __attribute__((__noreturn__));	 /* read */
     
-    /* iterator support */
+    /* iterator support; raw_offset is the offset of a page in a large file */
     virtual image_process::iterator begin() const;
     virtual image_process::iterator end() const;
     virtual void increment_iterator(class image_process::iterator &it) const;
     
     virtual pos0_t   get_pos0(const class image_process::iterator &it)   const;    
-    virtual sbuf_t   *sbuf_alloc(class image_process::iterator &it) const;   /* maps the next dir */
+    virtual sbuf_t   *sbuf_alloc(class image_process::iterator &it) const;   /* maps the next file, or page */
     virtual double   fraction_done(const class image_process::iterator &it) const; /* number of dirs processed */
     virtual std::string str(const class image_process::iterator &it) const;
     virtual int64_t  image_size() const;				    /* total bytes */
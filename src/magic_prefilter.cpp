@@ -0,0 +1,173 @@
+/*
+ * magic_prefilter.cpp:
+ * One pass over a buffer for the carving scanners' magic numbers; see magic_prefilter.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "magic_prefilter.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool     magic_prefilter::opt_enabled = true;
+uint64_t magic_prefilter::buffers = 0;
+uint64_t magic_prefilter::bytes = 0;
+uint64_t magic_prefilter::hits = 0;
+
+static pthread_key_t  scope_key;
+static pthread_once_t scope_key_once = PTHREAD_ONCE_INIT;
+static void make_scope_key()
+{
+    if(pthread_key_create(&scope_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+magic_prefilter::scope::scope(const sbuf_t &sbuf):pf(0),saved(0)
+{
+    if(!opt_enabled) return;
+    pthread_once(&scope_key_once,make_scope_key);
+    saved = (magic_prefilter *)pthread_getspecific(scope_key);
+    pf = new magic_prefilter(sbuf);
+    pthread_setspecific(scope_key,pf);
+}
+
+magic_prefilter::scope::~scope()
+{
+    if(!pf) return;
+    pthread_setspecific(scope_key,saved);
+    delete pf;
+}
+
+magic_prefilter::magic_prefilter(const sbuf_t &sbuf_):found(),sbuf(sbuf_),done(false)
+{
+}
+
+const magic_prefilter *magic_prefilter::get(const sbuf_t &sbuf)
+{
+    if(!opt_enabled) return 0;
+    pthread_once(&scope_key_once,make_scope_key);
+    magic_prefilter *pf = (magic_prefilter *)pthread_getspecific(scope_key);
+    /* Scanners are handed copies of the sbuf, so compare what it points to */
+    if(pf==0 || pf->sbuf.buf!=sbuf.buf || pf->sbuf.bufsize!=sbuf.bufsize) return 0;
+    if(!pf->done) pf->run();
+    return pf;
+}
+
+/* The signatures that start at buf[i], with n bytes in the buffer */
+static uint32_t signatures_at(const uint8_t *buf,size_t n,size_t i)
+{
+    const uint8_t *b = buf+i;
+    const size_t left = n-i;
+    uint32_t mask = 0;
+    if(left>=3 && b[0]==0x1f && b[1]==0x8b && b[2]==0x08) mask |= magic_prefilter::GZIP;
+    if(left>=4 && b[0]==0x50 && b[1]==0x4b && b[2]==0x03 && b[3]==0x04) mask |= magic_prefilter::ZIP;
+    if(left>=3 && b[0]==0xff && b[1]==0xd8 && b[2]==0xff) mask |= magic_prefilter::JPEG;
+    if(left>=6 && memcmp(b,"8BPS\0\1",6)==0) mask |= magic_prefilter::PSD;
+    if(left>=4 && (memcmp(b,"II*\0",4)==0 || memcmp(b,"MM\0*",4)==0)) mask |= magic_prefilter::TIFF;
+    if(left>=8 && memcmp(b,"\x81\x81xpress",8)==0) mask |= magic_prefilter::HIBERFILE;
+    if(left>=4 && memcmp(b,"\x7f" "ELF",4)==0) mask |= magic_prefilter::ELF;
+    if(left>=8 && memcmp(b,"\x4c\0\0\0\x01\x14\x02\0",8)==0) mask |= magic_prefilter::LNK;
+    if(left>=8 && (b[0]==0x11 || b[0]==0x17) && memcmp(b+1,"\0\0\0SCCA",7)==0) mask |= magic_prefilter::PREFETCH;
+    if((left>=7 && memcmp(b,"Rar!\x1a\x07\0",7)==0) || (left>=5 && b[2]==0x74 && (b[4]&0xe0)==0x80)){
+        mask |= magic_prefilter::RAR;
+    }
+    return mask;
+}
+
+#ifdef __SSE2__
+static inline __m128i pair(__m128i v0,__m128i v1,char a,char b)
+{
+    return _mm_and_si128(_mm_cmpeq_epi8(v0,_mm_set1_epi8(a)),_mm_cmpeq_epi8(v1,_mm_set1_epi8(b)));
+}
+#endif
+
+void magic_prefilter::run()
+{
+    done = true;
+    const uint8_t *buf = sbuf.buf;
+    const size_t n = sbuf.bufsize;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Each signature has two bytes that rule out nearly every offset;
+     * for RAR file headers and prefetch files they are not the first two.
+     */
+    const __m128i rar_flags = _mm_set1_epi8((char)0xe0);
+    for(;i+16+5<=n;i+=16){
+        const __m128i v0 = _mm_loadu_si128((const __m128i *)(buf+i));
+        const __m128i v1 = _mm_loadu_si128((const __m128i *)(buf+i+1));
+        const __m128i v2 = _mm_loadu_si128((const __m128i *)(buf+i+2));
+        const __m128i v4 = _mm_loadu_si128((const __m128i *)(buf+i+4));
+        const __m128i v5 = _mm_loadu_si128((const __m128i *)(buf+i+5));
+        __m128i m = pair(v0,v1,(char)0x1f,(char)0x8b);                             // GZIP
+        m = _mm_or_si128(m,pair(v0,v1,'P','K'));                                   // ZIP
+        m = _mm_or_si128(m,pair(v0,v1,(char)0xff,(char)0xd8));                     // JPEG
+        m = _mm_or_si128(m,pair(v0,v1,'8','B'));                                   // PSD
+        m = _mm_or_si128(m,pair(v0,v1,'I','I'));                                   // TIFF
+        m = _mm_or_si128(m,pair(v0,v1,'M','M'));
+        m = _mm_or_si128(m,pair(v0,v1,(char)0x81,(char)0x81));                     // HIBERFILE
+        m = _mm_or_si128(m,pair(v0,v1,0x7f,'E'));                                  // ELF
+        m = _mm_or_si128(m,pair(v0,v1,0x4c,0x00));                                 // LNK
+        m = _mm_or_si128(m,pair(v4,v5,'S','C'));                                   // PREFETCH
+        m = _mm_or_si128(m,pair(v0,v1,'R','a'));                                   // RAR marker
+        m = _mm_or_si128(m,_mm_and_si128(_mm_cmpeq_epi8(v2,_mm_set1_epi8(0x74)),   // RAR file header
+                                         _mm_cmpeq_epi8(_mm_and_si128(v4,rar_flags),_mm_set1_epi8((char)0x80))));
+        int bits = _mm_movemask_epi8(m);
+        while(bits){
+            const size_t at = i + __builtin_ctz(bits);
+            bits &= bits-1;
+            const uint32_t mask = signatures_at(buf,n,at);
+            if(mask) found.push_back(hit(at,mask));
+        }
+    }
+#endif
+    for(;i<n;i++){
+        const uint32_t mask = signatures_at(buf,n,i);
+        if(mask) found.push_back(hit(i,mask));
+    }
+    __sync_fetch_and_add(&buffers,1);
+    __sync_fetch_and_add(&bytes,(uint64_t)n);
+    __sync_fetch_and_add(&hits,(uint64_t)found.size());
+}
+
+void magic_prefilter::dump_stats(dfxml_writer &xreport)
+{
+    if(!opt_enabled) return;
+    xreport.push("magic_prefilter");
+    xreport.xmlout("buffers",buffers);
+    xreport.xmlout("bytes",bytes);
+    xreport.xmlout("candidates",hits);
+    xreport.pop();
+}
+
+void magic_prefilter::reset_stats()
+{
+    buffers = bytes = hits = 0;
+}
+
+magic_cursor::magic_cursor(const sbuf_t &sbuf,uint32_t mask_,size_t end_,size_t every_):
+    hits(0),mask(mask_),end(end_),every(every_),i(0),started(false)
+{
+    const magic_prefilter *pf = magic_prefilter::get(sbuf);
+    if(pf) hits = &pf->found;
+}
+
+bool magic_cursor::next(size_t &pos)
+{
+    const size_t from = started ? pos+1 : 0;
+    started = true;
+    if(hits==0){
+        pos = from;
+        return pos<end;
+    }
+    while(i<hits->size() && ((*hits)[i].offset<from || ((*hits)[i].mask & mask)==0)) i++;
+    size_t at = i<hits->size() ? (*hits)[i].offset : end;
+    if(every){
+        size_t boundary = ((from+every-1)/every)*every;
+        if(boundary<at) at = boundary;
+    }
+    if(at>=end) return false;
+    pos = at;
+    return true;
+}
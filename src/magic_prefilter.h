@@ -0,0 +1,98 @@
+#ifndef _MAGIC_PREFILTER_H_
+#define _MAGIC_PREFILTER_H_
+
+/**
+ * \file
+ * magic_prefilter finds the magic numbers of the carving scanners in one
+ * pass over a buffer, instead of each scanner comparing every byte of
+ * the page with its own loop.
+ *
+ * A worker opens a magic_prefilter::scope around each buffer it scans
+ * (and threadpool::recurse() around each child buffer). The first scanner
+ * that asks for candidates in that buffer makes the pass, with SSE2 where
+ * it is available; it tests every offset for the first two bytes of each
+ * signature (or two bytes further in, for those that start with a common
+ * byte), then checks the whole signature at the offsets that pass. The
+ * other scanners reuse the list.
+ *
+ * A scanner opts in by walking its buffer with a magic_cursor instead of
+ * every offset. Its own test at each offset stays as it was, so that
+ * outside a scope (or with the prefilter turned off) the cursor visits
+ * every offset and the scanner behaves as before.
+ */
+
+#include <vector>
+#include <pthread.h>
+
+class magic_prefilter {
+    /*** neither copying nor assignment is implemented ***/
+    magic_prefilter(const magic_prefilter &);
+    magic_prefilter &operator=(const magic_prefilter &);
+public:
+    enum {
+        GZIP      = 0x0001,             // 1f 8b 08
+        ZIP       = 0x0002,             // PK 03 04
+        JPEG      = 0x0004,             // ff d8 ff
+        PSD       = 0x0008,             // 8BPS 00 01
+        TIFF      = 0x0010,             // II*\0 or MM\0*
+        HIBERFILE = 0x0020,             // 81 81 xpress
+        ELF       = 0x0040,             // 7f ELF
+        LNK       = 0x0080,             // 4c 00 00 00 01 14 02 00
+        PREFETCH  = 0x0100,             // 11|17 00 00 00 SCCA
+        RAR       = 0x0200              // Rar! 1a 07 00, or a file header (type 74, flag 8000)
+    };
+    class hit {
+    public:
+        hit(size_t offset_,uint32_t mask_):offset(offset_),mask(mask_){}
+        size_t   offset;
+        uint32_t mask;                  // the signatures that start here
+    };
+    static bool opt_enabled;
+
+    /* statistics */
+    static uint64_t buffers;            // passes made
+    static uint64_t bytes;
+    static uint64_t hits;
+    static void dump_stats(class dfxml_writer &xreport);
+    static void reset_stats();
+
+    /* The prefilter for the buffer being scanned on this thread, made on first use; 0 if none */
+    static const magic_prefilter *get(const sbuf_t &sbuf);
+
+    class scope {
+        /*** neither copying nor assignment is implemented ***/
+        scope(const scope &);
+        scope &operator=(const scope &);
+        magic_prefilter *pf;
+        magic_prefilter *saved;
+    public:
+        scope(const sbuf_t &sbuf);
+        ~scope();
+    };
+
+    std::vector<hit> found;             // in order of offset
+private:
+    magic_prefilter(const sbuf_t &sbuf_);
+    const sbuf_t &sbuf;
+    bool done;
+    void run();
+};
+
+/**
+ * Walk the offsets below end where one of the signatures in mask starts
+ * (and every multiple of every, if it is not 0). The caller may move pos
+ * forward between calls to skip what it has consumed.
+ */
+class magic_cursor {
+    const std::vector<magic_prefilter::hit> *hits; // 0 to visit every offset
+    const uint32_t mask;
+    const size_t end;
+    const size_t every;
+    size_t i;
+    bool started;
+public:
+    magic_cursor(const sbuf_t &sbuf,uint32_t mask_,size_t end_,size_t every_=0);
+    bool next(size_t &pos);
+};
+
+#endif
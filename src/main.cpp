@@ -19,6 +19,15 @@
 #include "findopts.h"
 #include "image_process.h"
 #include "threadpool.h"
+#include "buffer_pool.h"
+#include "image_hasher.h"
+#include "checkpoint.h"
+#include "shard_merge.h"
+#include "magic_prefilter.h"
+#include "page_classifier.h"
+#include "page_dedup.h"
+#include "child_memo.h"
+#include "scanner_profile.h"
 #include "be13_api/aftimer.h"
 #include "be13_api/histogram.h"
 #include "dfxml/src/dfxml_writer.h"
@@ -53,6 +62,10 @@
 #include <sys/sysctl.h>
 #endif
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 #ifdef WIN32 
 // Allows us to open standard input in binary mode by default 
 // See http://gnuwin32.sourceforge.net/compile.html for more 
@@ -88,6 +101,7 @@ static void usage(const char *progname)
     std::cout << "\n";
     std::cout << "Required parameters:\n";
     std::cout << "   imagefile     - the file to extract\n";
+    std::cout << "                  (a named pipe, or - for stdin, is read once, in order)\n";
     std::cout << " or  -R filedir  - recurse through a directory of files\n";
 #ifdef HAVE_LIBEWF
     std::cout << "                  HAS SUPPORT FOR E01 FILES\n";
@@ -105,6 +119,7 @@ static void usage(const char *progname)
     std::cout << "                  bulk_extractor creates this directory.\n";
     std::cout << "Options:\n";
     std::cout << "   -i           - INFO mode. Do a quick random sample and print a report.\n";
+    std::cout << "                  (samples 1% of the image unless -s is given)\n";
     std::cout << "   -b banner.txt- Add banner.txt contents to the top of every output file.\n";
     std::cout << "   -r alert_list.txt  - a file containing the alert list of features to alert\n";
     std::cout << "                       (can be a feature file or a list of globs)\n";
@@ -138,6 +153,10 @@ static void usage(const char *progname)
     std::cout << "   -Y <o1>      - Start processing at o1 (o1 may be 1, 1K, 1M or 1G)\n";
     std::cout << "   -Y <o1>-<o2> - Process o1-o2\n";
     std::cout << "   -A <off>     - Add <off> to all reported feature offsets\n";
+    std::cout << "   -L <manifest> - Process every image in <manifest>, one per line as\n";
+    std::cout << "                  image<TAB>outdir, sharing the scanners and the threads\n";
+    std::cout << "   -J <n>       - Split the image (or the -Y range) into <n> shards, scan each\n";
+    std::cout << "                  with its own process and merge their output into outdir\n";
     std::cout << "\nDebugging:\n";
     std::cout << "   -h           - print this message\n";
     std::cout << "   -H           - print detailed info on the scanners\n";
@@ -238,6 +257,7 @@ void be_mkdir(const std::string &dir)
  */
 void validate_fn(const std::string &fn)
 {
+    if(fn=="-") return;                 // stdin
     int r= access(fn.c_str(),R_OK);
     if(r!=0){
 #ifndef WIN32
@@ -278,6 +298,26 @@ static bool directory_empty(const std::string &d)
     return false;
 }
 
+/* Return the first file found in a subdirectory of d (a carved file), or "" if there is none */
+static std::string file_in_subdirectory(const std::string &d,bool top=true)
+{
+    std::string found;
+    DIR *dirp = opendir(d.c_str());
+    if(dirp==0) return found;
+    struct dirent *dp;
+    while(found.size()==0 && (dp = readdir(dirp)) != NULL){
+        std::string name = dp->d_name;
+        if(name=="." || name=="..") continue;
+        std::string fname = d + "/" + name;
+        struct stat st;
+        if(stat(fname.c_str(),&st)) continue;
+        if(S_ISDIR(st.st_mode)) found = file_in_subdirectory(fname,false);
+        else if(!top) found = fname;
+    }
+    closedir(dirp);
+    return found;
+}
+
 
 /***************************************************************************************
  *** PATH PRINTER - Used by bulk_extractor for printing pages associated with a path ***
@@ -716,6 +756,558 @@ static void add_if_present(std::vector<std::string> &scanner_dirs,const std::str
     }
 }
 
+/**
+ * The first enabled scanner whose output page_dedup cannot replay, or ""
+ * if there is none. Replay writes feature lines again; it does not carve
+ * files, write packets.pcap or import block hashes.
+ */
+static std::string page_dedup_blocker(const scanner_info::scanner_config &s_config)
+{
+    static const char *carvers[][2] = {     // scanner, setting that turns its carving off with 0
+        {"exif","jpeg_carve_mode"},{"zip","unzip_carve_mode"},{"rar","unrar_carve_mode"},
+        {"sqlite","sqlite_carve_mode"},{"winpe","winpe_carve_mode"},
+        {"kml",0},{"vcard",0},{"net",0}
+    };
+    std::vector<std::string> enabled;
+    be13::plugin::get_enabled_scanners(enabled);
+    std::set<std::string> names(enabled.begin(),enabled.end());
+    for(size_t i=0;i<sizeof(carvers)/sizeof(carvers[0]);i++){
+        if(names.count(carvers[i][0])==0) continue;
+        if(carvers[i][1]){
+            scanner_info::config_t::const_iterator it = s_config.namevals.find(carvers[i][1]);
+            if(it!=s_config.namevals.end() && it->second=="0") continue;
+        }
+        return carvers[i][0];
+    }
+    if(names.count("hashdb")){
+        scanner_info::config_t::const_iterator it = s_config.namevals.find("hashdb_mode");
+        if(it!=s_config.namevals.end() && it->second=="import") return "hashdb";
+    }
+    return "";
+}
+
+/**
+ * Settings shared by every image of a run.
+ */
+class run_context {
+    /*** neither copying nor assignment is implemented ***/
+    run_context(const run_context &);
+    run_context &operator=(const run_context &);
+public:
+    run_context(BulkExtractor_Phase1::Config &cfg_,scanner_info::scanner_config &s_config_,
+                word_and_context_list &alert_list_,word_and_context_list &stop_list_):
+        cfg(cfg_),s_config(s_config_),alert_list(alert_list_),stop_list(stop_list_),
+        command_line(),sampling_params(),feature_file_names(),flags(0),
+        recurse(false),enable_histograms(true),zap(false){}
+    BulkExtractor_Phase1::Config  &cfg;
+    scanner_info::scanner_config  &s_config;
+    word_and_context_list         &alert_list;
+    word_and_context_list         &stop_list;
+    std::string                   command_line;
+    std::string                   sampling_params;
+    feature_file_names_t          feature_file_names;
+    uint32_t                      flags;  // for the feature_recorder_set
+    bool                          recurse;
+    bool                          enable_histograms;
+    bool                          zap;    // erase each output directory first (-Z)
+};
+
+/**
+ * One image and the output directory it is processed into.
+ */
+class image_run {
+    /*** neither copying nor assignment is implemented ***/
+    image_run(const image_run &);
+    image_run &operator=(const image_run &);
+public:
+    image_run(const std::string &image_fname_,const std::string &outdir_):
+        image_fname(image_fname_),outdir(outdir_),reportfilename(outdir_+"/report.xml"),
+        checkpointfilename(outdir_+"/"+page_checkpoint::file_name),old_reportfilename(),
+        seen_page_ids(),timer(),p(0),fs(0),xreport(0),phase1(0),checkpoint(0){}
+    const std::string image_fname;
+    const std::string outdir;
+    const std::string reportfilename;
+    const std::string checkpointfilename;
+    std::string       old_reportfilename; // set when restarting
+    BulkExtractor_Phase1::seen_page_ids_t seen_page_ids; // pages that do not need re-processing
+    aftimer               timer;
+    image_process         *p;           // the image process iterator
+    feature_recorder_set  *fs;
+    dfxml_writer          *xreport;
+    BulkExtractor_Phase1  *phase1;
+    page_checkpoint       *checkpoint;
+};
+
+/**
+ * The zap option wipes the contents of a directory, useful for debugging.
+ * Directories in it (carved files, the shards of -J) are wiped as well.
+ */
+static void zap_outdir(const std::string &outdir)
+{
+    DIR *dirp = opendir(outdir.c_str());
+    if(dirp){
+        struct dirent *dp;
+        while ((dp = readdir(dirp)) != NULL){
+            std::string name = dp->d_name;
+            if(name=="." || name=="..") continue;
+            std::string fname = outdir + std::string("/") + name;
+            struct stat st;
+            if(stat(fname.c_str(),&st)==0 && S_ISDIR(st.st_mode)){
+                zap_outdir(fname);
+                continue;
+            }
+            unlink(fname.c_str());
+            std::cout << "erasing " << fname << "\n";
+        }
+        closedir(dirp);
+    }
+    if(rmdir(outdir.c_str())){
+        std::cout << "rmdir " << outdir << "\n";
+    }
+}
+
+/**
+ * Create the output directory, or get ready to restart into it.
+ */
+static void prepare_outdir(image_run &r,const run_context &ctx)
+{
+    /* Start the clock */
+    r.timer.start();
+    if(ctx.zap) zap_outdir(r.outdir);
+
+    /* If output directory does not exist, we are not restarting! */
+    if(directory_missing(r.outdir) || directory_empty(r.outdir)){
+        /* First time running */
+	validate_fn(r.image_fname);
+	if (directory_missing(r.outdir)) be_mkdir(r.outdir);
+    } else {
+	/* Restarting; start_image() reads the old report if there is no checkpoint to use */
+	std::cout << "Restarting from " << r.outdir << "\n";
+        if(access(r.reportfilename.c_str(),R_OK)){
+            std::cerr << r.outdir << ": error\n";
+            std::cerr << "report.xml file is missing or unreadable.\n";
+            std::cerr << "Directory may not have been created by bulk_extractor.\n";
+            std::cerr << "Cannot continue.\n";
+            exit(1);
+        }
+
+        /* Rename the old report and create a new one */
+        r.old_reportfilename = r.reportfilename + "." + itos(time(0));
+        if(rename(r.reportfilename.c_str(),r.old_reportfilename.c_str())){
+            std::cerr << "Could not rename " << r.reportfilename << " to " << r.old_reportfilename << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Open the image, create its feature recorders, initialize the scanners
+ * for them and run phase 1 until every page has been handed to the
+ * threadpool. If tp is given, the image is scanned with that pool
+ * (created here if *tp is 0) instead of one of its own.
+ */
+static void start_image(image_run &r,const run_context &ctx,threadpool **tp)
+{
+    const BulkExtractor_Phase1::Config &cfg = ctx.cfg;
+
+    /* Open the image file (or the device) now */
+    r.p = image_process::open(r.image_fname,ctx.recurse,cfg.opt_pagesize,cfg.opt_marginsize);
+    if(!r.p) err(1,"Cannot open %s: ",r.image_fname.c_str());
+
+    /* A restart skips the pages in the checkpoint, or else the pages in the old report.
+     * With a checkpoint, what the last run wrote for the other pages is removed first.
+     */
+    r.checkpoint = page_checkpoint::open(r.checkpointfilename,*r.p,r.image_fname);
+    if(r.old_reportfilename.size()>0){
+        if(r.checkpoint && r.checkpoint->resumed()){
+            /* Only the feature files can be cut back to the pages that were finished */
+            if(ctx.flags & feature_recorder_set::ENABLE_SQLITE3_RECORDERS){
+                errx(1,"%s: cannot resume from %s with SQLite feature output; "
+                     "remove it to restart from report.xml",r.outdir.c_str(),r.checkpointfilename.c_str());
+            }
+            std::string carved = file_in_subdirectory(r.outdir);
+            if(carved.size()>0){
+                errx(1,"%s: cannot resume from %s: the last run carved files (%s); "
+                     "remove it to restart from report.xml",r.outdir.c_str(),r.checkpointfilename.c_str(),carved.c_str());
+            }
+            std::cout << "Using the checkpoint in " << r.checkpointfilename << "\n";
+            feature_file_names_t names(ctx.feature_file_names);
+            names.insert(feature_recorder_set::ALERT_RECORDER_NAME);
+            for(feature_file_names_t::const_iterator it=names.begin();it!=names.end();it++){
+                r.checkpoint->drop_unfinished(r.outdir + "/" + *it + ".txt");
+                r.checkpoint->drop_unfinished(r.outdir + "/" + *it + "_stopped.txt");
+            }
+        } else {
+            bulk_extractor_restarter restarter(r.outdir,r.old_reportfilename,r.image_fname,r.seen_page_ids);
+        }
+    }
+    
+    /***
+     *** Create the feature recording set.
+     *** Initialize the scanners.
+     ****/
+
+    r.fs = new dedup_feature_recorder_set(ctx.flags,be_hash,r.image_fname,r.outdir);
+    feature_recorder_set &fs = *r.fs;
+    fs.init(ctx.feature_file_names);
+    if(ctx.enable_histograms) be13::plugin::add_enabled_scanner_histograms_to_feature_recorder_set(fs);
+    be13::plugin::scanners_init(fs);
+
+    fs.set_stop_list(&ctx.stop_list);
+    fs.set_alert_list(&ctx.alert_list);
+
+    /* Look for commands that impact per-recorders */
+    for(scanner_info::config_t::const_iterator it=ctx.s_config.namevals.begin();it!=ctx.s_config.namevals.end();it++){
+        /* see if there is a <recorder>: */
+        std::vector<std::string> params = split(it->first,':');
+        if(params.size()>=3 && params.at(0)=="fr"){
+            feature_recorder *fr = fs.get_name(params.at(1));
+            const std::string &cmd = params.at(2);
+            if(fr){
+                if(cmd=="window")        fr->set_context_window(stoi64(it->second));
+                if(cmd=="window_before") fr->set_context_window_before(stoi64(it->second));
+                if(cmd=="window_after")  fr->set_context_window_after(stoi64(it->second));
+            }
+        }
+        /* See if there is a scanner? */
+    }
+
+    /* Store the configuration in the XML file */
+    r.xreport = new dfxml_writer(r.reportfilename,false);
+    dfxml_create(*r.xreport,ctx.command_line,cfg);
+    r.xreport->xmlout("provided_filename",r.image_fname); // save this information
+
+    /* provide documentation to the user; the DFXML information comes from elsewhere */
+    if(!cfg.opt_quiet){
+        std::cout << "bulk_extractor version: " << PACKAGE_VERSION << "\n";
+#ifdef HAVE_GETHOSTNAME
+        char hostname[1024];
+        memset(hostname,0,sizeof(hostname));
+        if(gethostname(hostname,sizeof(hostname)-1)==0){
+            if (hostname[0]) std::cout << "Hostname: " << hostname << "\n";
+        }
+#endif
+        std::cout << "Input file: " << r.image_fname << "\n";
+        std::cout << "Output directory: " << r.outdir << "\n";
+        std::cout << "Disk Size: " << r.p->image_size() << "\n";
+        std::cout << "Threads: " << cfg.num_threads << "\n";
+    }
+
+    /****************************************************************
+     *** THIS IS IT! PHASE 1!
+     ****************************************************************/
+
+    if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS )) {
+        fs.db_transaction_begin();
+    }
+    r.phase1 = new BulkExtractor_Phase1(*r.xreport,r.timer,ctx.cfg);
+    if(tp){
+        if(*tp==0) *tp = new threadpool(cfg.num_threads,fs);
+        r.phase1->set_threadpool(*tp);
+    }
+    if(r.checkpoint) r.checkpoint->set_recorders(&fs);
+    r.phase1->set_checkpoint(r.checkpoint);
+    if(cfg.debug & DEBUG_PRINT_STEPS) std::cerr << "DEBUG: STARTING PHASE 1\n";
+
+    if(ctx.sampling_params.size()>0){
+        std::string sampling_params = ctx.sampling_params;
+        BulkExtractor_Phase1::set_sampling_parameters(ctx.cfg,sampling_params);
+    }
+    r.xreport->add_timestamp("phase1 start");
+    r.phase1->run(*r.p,fs,r.seen_page_ids);
+}
+
+/**
+ * Wait for the image's pages to be scanned, then shut the scanners down
+ * for its feature recorders, make the histograms and finish the report.
+ */
+static void finish_image(image_run &r,const run_context &ctx)
+{
+    const BulkExtractor_Phase1::Config &cfg = ctx.cfg;
+    feature_recorder_set &fs = *r.fs;
+    dfxml_writer *xreport = r.xreport;
+    BulkExtractor_Phase1 &phase1 = *r.phase1;
+
+    if(cfg.debug & DEBUG_PRINT_STEPS) std::cerr << "DEBUG: WAITING FOR WORKERS\n";
+    std::string md5_string;
+    phase1.wait_for_workers(*r.p,&md5_string);
+    phase1.dump_sample_estimates(*r.p,fs,ctx.feature_file_names);
+    delete r.p;				// not strictly needed, but why not?
+    r.p = 0;
+
+    if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS )) {
+        fs.db_transaction_commit();
+    }
+    xreport->add_timestamp("phase1 end");
+    if(md5_string.size()>0){
+        std::cout << "MD5 of Disk Image: " << md5_string << "\n";
+    }
+
+    /*** PHASE 2 --- Shutdown ***/
+    if(cfg.opt_quiet==0) std::cout << "Phase 2. Shutting down scanners\n";
+    xreport->add_timestamp("phase2 (shutdown) start");
+    be13::plugin::phase_shutdown(fs);
+    xreport->add_timestamp("phase2 (shutdown) end");
+
+    /*** PHASE 3 --- Create Histograms ***/
+    if(cfg.opt_quiet==0) std::cout << "Phase 3. Creating Histograms\n";
+    xreport->add_timestamp("phase3 (histograms) start");
+    if(ctx.enable_histograms) fs.dump_histograms(0,histogram_dump_callback,0);        // TK - add an xml error notifier!
+    xreport->add_timestamp("phase3 (histograms) end");
+
+    /*** PHASE 4 ---  report and then print final usage information ***/
+    xreport->push("report");
+    xreport->xmlout("total_bytes",phase1.get_total_bytes());
+    xreport->xmlout("elapsed_seconds",r.timer.elapsed_seconds());
+    xreport->xmlout("max_depth_seen",be13::plugin::get_max_depth_seen());
+    xreport->xmlout("dup_data_encountered",be13::plugin::dup_data_encountered);
+    be13::plugin::dup_data_encountered = 0; // counted since the last report, like the pool's counters
+    xreport->pop();			// report
+    xreport->flush();
+
+    xreport->push("scanner_times");
+    fs.get_stats(xreport,stat_callback);
+    xreport->pop();
+    xreport->add_rusage();
+    xreport->pop();			// bulk_extractor
+    xreport->close();
+    if(cfg.opt_quiet==0){
+        float mb_per_sec = (phase1.get_total_bytes() / 1000000.0) / r.timer.elapsed_seconds();
+
+        std::cout.precision(4);
+        printf("Elapsed time: %g sec.\n",r.timer.elapsed_seconds());
+        printf("Total MB processed: %d\n",int(phase1.get_total_bytes() / 1000000));
+        
+        printf("Overall performance: %g MBytes/sec (%g MBytes/sec/thread)\n",
+               mb_per_sec,mb_per_sec/cfg.num_threads);
+        if (fs.has_name("email")) {
+            feature_recorder *fr = fs.get_name("email");
+            if(fr){
+                std::cout << "Total " << fr->name << " features found: " << fr->count() << "\n";
+            }
+        }
+    }
+    delete r.phase1;
+    r.phase1 = 0;
+    delete r.checkpoint;
+    r.checkpoint = 0;
+    delete r.xreport;
+    r.xreport = 0;
+    delete r.fs;
+    r.fs = 0;
+}
+
+/**
+ * Batch mode (-L manifest).
+ * The manifest has a line for each image: the image, a tab, and its
+ * output directory; blank lines and lines starting with # are skipped.
+ * The scanners are loaded once and one threadpool scans every image.
+ * The next image is started before the last one is finished, so that its
+ * pages fill the pool while the last pages of the other are scanned; an
+ * image is waited for only when its report is due, once the next one has
+ * been read. The counters that belong to the pool rather than to an image
+ * are in whichever report is written after they were counted.
+ */
+static void run_batch(const std::string &manifest,const run_context &ctx)
+{
+    std::ifstream in(manifest.c_str());
+    if(!in.is_open()) err(1,"Cannot open manifest %s",manifest.c_str());
+    std::vector<image_run *> runs;
+    std::string line;
+    while(getline(in,line)){
+        if(line.size()>0 && line[line.size()-1]=='\r') line.erase(line.size()-1);
+        if(line.size()==0 || line[0]=='#') continue;
+        size_t tab = line.find('\t');
+        if(tab==std::string::npos) errx(1,"%s: expected image<TAB>outdir: %s",manifest.c_str(),line.c_str());
+        runs.push_back(new image_run(line.substr(0,tab),line.substr(tab+1)));
+    }
+    if(runs.size()==0) errx(1,"%s: no images",manifest.c_str());
+    std::set<std::string> outdirs;
+    for(size_t i=0;i<runs.size();i++){
+        if(!outdirs.insert(runs[i]->outdir).second){
+            errx(1,"%s: %s is the output directory of more than one image",manifest.c_str(),runs[i]->outdir.c_str());
+        }
+    }
+
+    threadpool *tp = 0;
+    for(size_t i=0;i<runs.size();i++){
+        if(ctx.cfg.opt_quiet==0) std::cout << "Batch image " << i+1 << " of " << runs.size() << "\n";
+        prepare_outdir(*runs[i],ctx);
+        start_image(*runs[i],ctx,&tp);
+        if(i>0){
+            finish_image(*runs[i-1],ctx); // its units ran while this image was read
+            delete runs[i-1];
+        }
+    }
+    finish_image(*runs.back(),ctx);
+    delete runs.back();
+}
+
+/**
+ * Sharded mode (-J n).
+ * The image, or the -Y range of it, is cut at page boundaries into n
+ * shards. Each shard is scanned by a process of its own, forked once
+ * the options are parsed and the scanners are loaded, into the output
+ * directory outdir/shard-NNN, with its output going to outdir/shard-NNN.log.
+ * Each process gets -j/n threads (or shard_threads) and, on a machine
+ * with more than one NUMA node, is bound to the CPUs of node i%nodes.
+ *
+ * When all of them have exited, their output is merged into outdir (see
+ * shard_merge.h) and the histograms are made from the merged feature
+ * files. A shard that fails leaves the merge undone; running the same
+ * command again restarts each shard, from its checkpoint if
+ * checkpoint_seconds is set and from its report.xml otherwise.
+ */
+static void run_shards(const std::string &image_fname,const std::string &outdir,uint32_t nshards,
+                       uint32_t shard_threads,bool shard_numa,run_context &ctx)
+{
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    BulkExtractor_Phase1::Config &cfg = ctx.cfg;
+    aftimer timer;
+    timer.start();
+    if(ctx.recurse) errx(1,"-J cannot be used with -R");
+    if(ctx.zap){
+        zap_outdir(outdir);
+        ctx.zap = false;                // the shards start in an empty directory
+    }
+    if(access((outdir+"/report.xml").c_str(),F_OK)==0){
+        errx(1,"%s already holds a finished run",outdir.c_str());
+    }
+    validate_fn(image_fname);
+
+    /* Cut the range at page boundaries */
+    image_process *p = image_process::open(image_fname,false,cfg.opt_pagesize,cfg.opt_marginsize);
+    if(!p) err(1,"Cannot open %s: ",image_fname.c_str());
+    if(!p->can_seek() || dynamic_cast<process_dir *>(p)) errx(1,"%s cannot be read in shards",image_fname.c_str());
+    const int64_t start = cfg.opt_offset_start;
+    const int64_t end   = cfg.opt_offset_end ? cfg.opt_offset_end : p->image_size();
+    delete p;
+    if(end<=start) errx(1,"nothing to scan between %lld and %lld",(long long)start,(long long)end);
+    const int64_t pages = (end-start+cfg.opt_pagesize-1) / cfg.opt_pagesize;
+    if((int64_t)nshards > pages) nshards = pages;
+    std::vector<int64_t> bounds;
+    for(uint32_t i=0;i<=nshards;i++){
+        bounds.push_back(start + (pages*i/nshards) * (int64_t)cfg.opt_pagesize);
+    }
+    bounds[nshards] = cfg.opt_offset_end; // 0 for the end of the image
+
+    const std::vector<std::vector<int> > nodes = threadpool::numa_nodes();
+    if(shard_threads==0) shard_threads = cfg.num_threads/nshards > 0 ? cfg.num_threads/nshards : 1;
+    if(directory_missing(outdir)) be_mkdir(outdir);
+
+    std::vector<std::string> dirs;
+    std::vector<pid_t> pids;
+    for(uint32_t i=0;i<nshards;i++){
+        char name[32];
+        snprintf(name,sizeof(name),"shard-%03u",i);
+        dirs.push_back(outdir + "/" + name);
+        const std::string logname = dirs[i] + ".log";
+        const size_t node = i % nodes.size();
+        std::cout << "Shard " << i << ": " << bounds[i] << "-";
+        if(bounds[i+1]) std::cout << bounds[i+1];
+        else std::cout << "end";
+        std::cout << ", " << shard_threads << " threads";
+        if(shard_numa && nodes.size()>1) std::cout << " on NUMA node " << node;
+        std::cout << "; output in " << logname << "\n";
+
+        std::cout.flush();              // or the child would write it again
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid<0) err(1,"fork");
+        if(pid==0){
+            int fd = open(logname.c_str(),O_WRONLY|O_CREAT|O_APPEND,0666);
+            if(fd<0) err(1,"Cannot open %s",logname.c_str());
+            dup2(fd,1);
+            dup2(fd,2);
+            close(fd);
+            if(shard_numa && nodes.size()>1 && !threadpool::bind_cpus(nodes[node])){
+                std::cerr << "Cannot bind to the CPUs of NUMA node " << node << ": " << strerror(errno) << "\n";
+            }
+            cfg.opt_offset_start  = bounds[i];
+            cfg.opt_offset_end    = bounds[i+1];
+            cfg.num_threads       = shard_threads;
+            ctx.enable_histograms = false;  // made once, from the merged feature files
+            image_run r(image_fname,dirs[i]);
+            prepare_outdir(r,ctx);
+            start_image(r,ctx,0);
+            finish_image(r,ctx);
+            exit(0);
+        }
+        pids.push_back(pid);
+    }
+
+    /* Wait for all of them */
+    std::vector<int> statuses(nshards,0);
+    std::vector<double> seconds(nshards,0);
+    int failed = 0;
+    for(uint32_t done=0;done<nshards;done++){
+        int status = 0;
+        pid_t pid = waitpid(-1,&status,0);
+        if(pid<0) err(1,"waitpid");
+        for(uint32_t i=0;i<nshards;i++){
+            if(pids[i]!=pid) continue;
+            statuses[i] = status;
+            seconds[i]  = timer.elapsed_seconds();
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status)==0;
+            if(!ok) failed++;
+            std::cout << "Shard " << i << (ok ? " finished" : " FAILED") << " after " << seconds[i] << " seconds\n";
+        }
+    }
+    if(failed) errx(1,"%d of %u shards failed; see their logs, then run the same command again to restart them",
+                    failed,nshards);
+
+    /* Merge; feature offsets carry -A */
+    if(cfg.opt_quiet==0) std::cout << "Merging the shards into " << outdir << "\n";
+    std::vector<shard_merger::shard> shards;
+    for(uint32_t i=0;i<nshards;i++){
+        shards.push_back(shard_merger::shard(dirs[i],bounds[i]+feature_recorder::offset_add,
+                                             bounds[i+1] ? bounds[i+1]+feature_recorder::offset_add : 0));
+    }
+    shard_merger merger(outdir,shards,ctx.feature_file_names);
+    merger.merge();
+
+    dfxml_writer xreport(outdir+"/report.xml",false);
+    dfxml_create(xreport,ctx.command_line,cfg);
+    xreport.xmlout("provided_filename",image_fname);
+    xreport.push("shards","count='" + itos(nshards) + "'");
+    for(uint32_t i=0;i<nshards;i++){
+        std::stringstream ss;
+        ss << "n='" << i << "' start='" << bounds[i] << "' end='" << bounds[i+1] << "' threads='" << shard_threads << "'";
+        if(shard_numa && nodes.size()>1) ss << " numa_node='" << i % nodes.size() << "'";
+        xreport.push("shard",ss.str());
+        xreport.xmlout("outdir",dirs[i]);
+        xreport.xmlout("exit_status",WIFEXITED(statuses[i]) ? WEXITSTATUS(statuses[i]) : -1);
+        xreport.xmlout("elapsed_seconds",seconds[i]);
+        xreport.pop();
+    }
+    xreport.pop();                      // shards
+    merger.dump_stats(xreport);
+
+    if(ctx.enable_histograms && (ctx.flags & feature_recorder_set::DISABLE_FILE_RECORDERS)==0){
+        if(cfg.opt_quiet==0) std::cout << "Creating Histograms\n";
+        xreport.add_timestamp("phase3 (histograms) start");
+        feature_recorder_set fs(ctx.flags,be_hash,image_fname,outdir);
+        fs.init(ctx.feature_file_names);
+        be13::plugin::add_enabled_scanner_histograms_to_feature_recorder_set(fs);
+        fs.dump_histograms(0,histogram_dump_callback,0);
+        xreport.add_timestamp("phase3 (histograms) end");
+    }
+    xreport.push("report");
+    xreport.xmlout("elapsed_seconds",timer.elapsed_seconds());
+    xreport.pop();                      // report
+    xreport.add_rusage();
+    xreport.pop();                      // bulk_extractor
+    xreport.close();
+    if(cfg.opt_quiet==0){
+        std::cout << "Merged " << merger.feature_lines << " features ("
+                  << merger.boundary_duplicates << " found by two shards)\n";
+        printf("Elapsed time: %g sec.\n",timer.elapsed_seconds());
+    }
+#else
+    errx(1,"-J is not available on this platform");
+#endif
+}
+
 int main(int argc,char **argv)
 {
 #ifdef HAVE_MCHECK
@@ -741,6 +1333,10 @@ int main(int argc,char **argv)
     int         opt_H = 0;
     std::string opt_sampling_params;
     std::string opt_outdir;
+    std::string opt_batch;              // manifest of images to process
+    uint32_t    opt_shards = 0;         // -J
+    uint32_t    opt_shard_threads = 0;  // 0 divides -j among the shards
+    bool        opt_shard_numa = true;
     bool        opt_write_feature_files = true;
     bool        opt_write_sqlite3     = false;
     bool        opt_enable_histograms = true;
@@ -771,7 +1367,7 @@ int main(int argc,char **argv)
 
     /* Process options */
     int ch;
-    while ((ch = getopt(argc, argv, "A:B:b:C:d:E:e:F:f:G:g:Hhij:M:m:o:P:p:q:Rr:S:s:VW:w:x:Y:z:Z")) != -1) {
+    while ((ch = getopt(argc, argv, "A:B:b:C:d:E:e:F:f:G:g:HhiJ:j:L:M:m:o:P:p:q:Rr:S:s:VW:w:x:Y:z:Z")) != -1) {
 	switch (ch) {
 	case 'A': feature_recorder::offset_add  = stoi64(optarg);break;
 	case 'b': feature_recorder::banner_file = optarg; break;
@@ -810,7 +1406,9 @@ int main(int argc,char **argv)
             std::cout << "info mode:\n";
             cfg.opt_info = true;
             break;
+	case 'J': opt_shards = atoi(optarg); break;
 	case 'j': cfg.num_threads = atoi(optarg); break;
+	case 'L': opt_batch = optarg; break;
 	case 'M': scanner_def::max_depth = atoi(optarg); break;
 	case 'm': cfg.max_bad_alloc_errors = atoi(optarg); break;
 	case 'o': opt_outdir = optarg;break;
@@ -837,12 +1435,6 @@ int main(int argc,char **argv)
 	    continue;
 	}
 	case 's':
-#if defined(HAVE_SRANDOM) && !defined(HAVE_SRANDOMDEV)
-            srandom(time(0));
-#endif
-#if defined(HAVE_SRANDOMDEV)
-            srandomdev();               // if we are sampling initialize
-#endif
             opt_sampling_params = optarg;
             break;
 	case 'V': std::cout << "bulk_extractor " << PACKAGE_VERSION << "\n"; exit (1);
@@ -879,6 +1471,16 @@ int main(int argc,char **argv)
     argc -= optind;
     argv += optind;
 
+    if(cfg.opt_info && opt_sampling_params.size()==0) opt_sampling_params = "0.01";
+    if(opt_sampling_params.size()>0){
+#if defined(HAVE_SRANDOM) && !defined(HAVE_SRANDOMDEV)
+        srandom(time(0));
+#endif
+#if defined(HAVE_SRANDOMDEV)
+        srandomdev();                   // if we are sampling initialize
+#endif
+    }
+
     if(cfg.debug & DEBUG_PRINT_STEPS) std::cerr << "DEBUG: DEBUG_PRINT_STEPS\n";
     if(cfg.debug & DEBUG_PEDANTIC) validateOrEscapeUTF8_validate = true;
 
@@ -900,18 +1502,104 @@ int main(int argc,char **argv)
     si.get_config("write_feature_files",&opt_write_feature_files,"Write features to flat files");
     si.get_config("write_feature_sqlite3",&opt_write_sqlite3,"Write feature files to report.sqlite3");
     si.get_config("report_read_errors",&cfg.opt_report_read_errors,"Report read errors");
+    si.get_config("read_error_sector_bytes",&image_process::opt_sector_bytes,
+                  "Size a failed read is split down to before it is zero-filled (0 skips the page instead)");
+    si.get_config("read_error_retries",&image_process::opt_sector_retries,
+                  "Times to read a failing sector again before it is zero-filled");
+    si.get_config("readahead_pages",&cfg.opt_readahead_pages,"Pages to read ahead of the scanners on a thread of their own (0, the default, disables read-ahead)");
+    si.get_config("readahead_mb",&cfg.opt_readahead_mb,"Maximum MiB of pages held in the read-ahead queue");
+    si.get_config("sample_run_blocks",&cfg.sampling_run_blocks,
+                  "Consecutive pages read for each sample of -s or -i");
+    si.get_config("async_recursion",&threadpool::opt_async_recursion,
+                  "Run decompressed child buffers as independent threadpool tasks (turns off page_dedup)");
+    si.get_config("async_recursion_min_bytes",&threadpool::opt_async_recursion_min_bytes,
+                  "Smallest child buffer to run as its own task");
+    si.get_config("async_recursion_max_mb",&threadpool::opt_async_recursion_max_mb,
+                  "Maximum MiB of child buffers waiting to be scanned");
+    si.get_config("tail_split",&threadpool::opt_tail_split,
+                  "At the end of the image, run each scanner on the last pages as its own task");
+    si.get_config("skip_constant",&threadpool::opt_skip_constant,
+                  "Do not scan pages, or the start of pages, that are a single byte value");
+    si.get_config("skip_constant_min_bytes",&threadpool::opt_skip_constant_min_bytes,
+                  "Shortest constant run at the start of a page that is not scanned");
+    si.get_config("raw_mmap",&process_raw::opt_mmap,
+                  "Scan raw images through mmap without copying (healthy local disks only)");
+    si.get_config("raw_read_depth",&process_raw::opt_read_depth,
+                  "Raw image pages to keep in flight with io_uring or reader threads (0 reads one at a time)");
+    si.get_config("raw_max_open_files",&process_raw::opt_max_open_files,
+                  "Files of a split raw image to keep open at once");
+#ifdef HAVE_LIBEWF
+    si.get_config("ewf_handles",&process_ewf::opt_handles,
+                  "Times to open an E01 image, to decompress that many pages at once");
+#endif
+    si.get_config("stream_pipe_kb",&process_stream::opt_pipe_kb,
+                  "KiB of pipe buffer to ask for when reading a pipe or stdin (0 to leave it alone)");
+    si.get_config("dir_whole_file_scanners",&process_dir::opt_whole_file_scanners,
+                  "Scanners that see each large -R file whole; the others see it in pages");
+    si.get_config("dir_walk_threads",&process_dir::opt_walk_threads,
+                  "Threads that list the directories of a -R run");
+    si.get_config("dir_small_file_bytes",&process_dir::opt_small_file_bytes,
+                  "-R files this size or smaller are read many to a work unit (0 to read each alone)");
+    si.get_config("dir_batch_bytes",&process_dir::opt_batch_bytes,
+                  "Most bytes of small -R files in one work unit");
+    si.get_config("buffer_pool_mb",&buffer_pool::opt_pool_mb,
+                  "MiB of page and decompression buffers to share between threads for reuse (0 to malloc each one)");
+    si.get_config("buffer_pool_hugepages",&buffer_pool::opt_hugepages,"Back pooled buffers with huge pages");
+    si.get_config("checkpoint_seconds",&page_checkpoint::opt_seconds,
+                  "Seconds between syncs of the restart checkpoint (0, the default, for no checkpoint)");
+    si.get_config("image_hash",&image_hasher::opt_algorithms,
+                  "Hashes of the whole image for report.xml: any of md5,sha1,sha256 (empty for none)");
+    si.get_config("image_hash_queue_mb",&image_hasher::opt_queue_mb,
+                  "MiB of pages that may wait to be hashed before reading waits for the hasher");
+    si.get_config("shard_threads",&opt_shard_threads,
+                  "Threads for each -J shard (0 divides -j among them)");
+    si.get_config("shard_numa",&opt_shard_numa,
+                  "Bind each -J shard to the CPUs of one NUMA node, round robin");
+    si.get_config("magic_prefilter",&magic_prefilter::opt_enabled,
+                  "Find the carving scanners' magic numbers in one pass over each buffer");
+    si.get_config("page_classes",&page_classifier::opt_enabled,
+                  "Skip the text scanners on blocks of random (encrypted or compressed) data (off by default)");
+    si.get_config("page_class_block_size",&page_classifier::opt_block_size,
+                  "Bytes in each block classified as text, binary or random");
+    si.get_config("page_class_entropy",&page_classifier::opt_random_centibits,
+                  "Entropy, in hundredths of a bit per byte, from which a block is random");
+    si.get_config("page_dedup",&page_dedup::opt_enabled,
+                  "Scan each distinct image page once and write its features at every copy (off by default;"
+                  " not with carving, net or hashdb import)");
+    si.get_config("page_dedup_cache_mb",&page_dedup::opt_cache_mb,
+                  "MiB of features kept for pages that may be seen again");
+    si.get_config("child_memo_entries",&child_memo::opt_max_entries,
+                  "Compressed inputs remembered so that their repeats in an image are not decompressed again (0 for none)");
+    si.get_config("scanner_profile",&scanner_profile::opt_enabled,
+                  "Report the calls, bytes, features and time of each scanner at each depth (reads the CPU clock for every call)");
 
     /* Make sure that the user selected a valid hash */
     {
         uint8_t buf[1];
         be_hash_func(buf,0);
     }
+    if(!image_hasher::valid_algorithms(image_hasher::opt_algorithms)){
+        errx(1,"image_hash must be a list of md5, sha1 and sha256; you provided '%s'",
+             image_hasher::opt_algorithms.c_str());
+    }
+    if(page_classifier::opt_block_size==0) errx(1,"page_class_block_size must be at least 1");
 
     /* Load all the scanners and enable the ones we care about */
 
     be13::plugin::load_scanner_directories(scanner_dirs,s_config);
     be13::plugin::load_scanners(scanners_builtin,s_config); 
     be13::plugin::scanners_process_enable_disable_commands();
+    scanner_profile::install();
+
+    /* Offloaded children are scanned outside the captures that page_dedup depends on */
+    if(threadpool::opt_async_recursion) page_dedup::opt_enabled = false;
+    if(page_dedup::opt_enabled){
+        std::string blocker = page_dedup_blocker(s_config);
+        if(blocker.size()){
+            std::cerr << "page_dedup is off: the " << blocker << " scanner writes output that it cannot replay\n";
+            page_dedup::opt_enabled = false;
+        }
+    }
 
     /* Print usage if necessary */
     if(opt_H){ be13::plugin::info_scanners(true,true,scanners_builtin,'e','x'); exit(0);}
@@ -935,36 +1623,30 @@ int main(int argc,char **argv)
 	process_path(argv[0],opt_path,cfg.opt_pagesize,cfg.opt_marginsize);
 	exit(0);
     }
+    /* Determine the feature files that will be used */
+    run_context ctx(cfg,s_config,alert_list,stop_list);
+    be13::plugin::get_scanner_feature_file_names(ctx.feature_file_names);
+    if (stop_list.size()>0)        ctx.flags |= feature_recorder_set::CREATE_STOP_LIST_RECORDERS;
+    if (opt_write_sqlite3)         ctx.flags |= feature_recorder_set::ENABLE_SQLITE3_RECORDERS;
+    if (!opt_write_feature_files)  ctx.flags |= feature_recorder_set::DISABLE_FILE_RECORDERS;
+    ctx.command_line      = command_line;
+    ctx.sampling_params   = opt_sampling_params;
+    ctx.recurse           = opt_recurse;
+    ctx.enable_histograms = opt_enable_histograms;
+    ctx.zap               = opt_zap;
+
+    if(opt_batch.size()>0){
+        if(argc!=0) errx(1,"-L takes the images from the manifest; no image may be given.");
+        run_batch(opt_batch,ctx);
+        exit(0);
+    }
     if(opt_outdir.size()==0) errx(1,"error: -o outdir must be specified");
-
-    /* The zap option wipes the contents of a directory, useful for debugging */
-    if(opt_zap){
-	DIR *dirp = opendir(opt_outdir.c_str());
-	if(dirp){
-	    struct dirent *dp;
-	    while ((dp = readdir(dirp)) != NULL){
-                std::string name = dp->d_name;
-		if(name=="." || name=="..") continue;
-                std::string fname = opt_outdir + std::string("/") + name;
-		unlink(fname.c_str());
-		std::cout << "erasing " << fname << "\n";
-	    }
-	}
-	if(rmdir(opt_outdir.c_str())){
-            std::cout << "rmdir " << opt_outdir << "\n";
-        }
+    if(opt_shards>1){
+        if(argc!=1) errx(1,"-J requires a single image.");
+        run_shards(argv[0],opt_outdir,opt_shards,opt_shard_threads,opt_shard_numa,ctx);
+        exit(0);
     }
 
-    /* Start the clock */
-    aftimer timer;
-    timer.start();
-
-    /* If output directory does not exist, we are not restarting! */
-    std::string reportfilename = opt_outdir + "/report.xml";
-
-    BulkExtractor_Phase1::seen_page_ids_t seen_page_ids; // pages that do not need re-processing
-    image_process *p = 0;                                // the image process iterator
-
     /* Get image or directory */
     if (*argv == NULL) {
         if (opt_recurse) {
@@ -974,167 +1656,15 @@ int main(int argc,char **argv)
         }
         exit(1);
     }
-    std::string image_fname = *argv;
-
-    if(opt_outdir.size()==0){
-        fprintf(stderr,"output directory not provided\n");
-        exit(1);
-    }
-
-    if(directory_missing(opt_outdir) || directory_empty(opt_outdir)){
-        /* First time running */
-	/* Validate the args */
-	if ( argc !=1 ) errx(1,"Disk image option not provided. Run with -h for help.");
-	validate_fn(image_fname);
-	if (directory_missing(opt_outdir)) be_mkdir(opt_outdir);
-    } else {
-	/* Restarting */
-	std::cout << "Restarting from " << opt_outdir << "\n";
-        bulk_extractor_restarter r(opt_outdir,reportfilename,image_fname,seen_page_ids);
 
-        /* Rename the old report and create a new one */
-        std::string old_reportfilename = reportfilename + "." + itos(time(0));
-        if(rename(reportfilename.c_str(),old_reportfilename.c_str())){
-            std::cerr << "Could not rename " << reportfilename << " to " << old_reportfilename << ": " << strerror(errno) << "\n";
-            exit(1);
-        }
+    image_run r(*argv,opt_outdir);
+    if((directory_missing(opt_outdir) || directory_empty(opt_outdir)) && argc!=1){
+	errx(1,"Disk image option not provided. Run with -h for help.");
     }
+    prepare_outdir(r,ctx);
+    start_image(r,ctx,0);
+    finish_image(r,ctx);
 
-    /* Open the image file (or the device) now */
-    p = image_process::open(image_fname,opt_recurse,cfg.opt_pagesize,cfg.opt_marginsize);
-    if(!p) err(1,"Cannot open %s: ",image_fname.c_str());
-    
-    /***
-     *** Create the feature recording set.
-     *** Initialize the scanners.
-     ****/
-
-    /* Determine the feature files that will be used */
-    feature_file_names_t feature_file_names;
-    be13::plugin::get_scanner_feature_file_names(feature_file_names);
-    uint32_t flags = 0;
-    if (stop_list.size()>0)        flags |= feature_recorder_set::CREATE_STOP_LIST_RECORDERS;
-    if (opt_write_sqlite3)         flags |= feature_recorder_set::ENABLE_SQLITE3_RECORDERS;
-    if (!opt_write_feature_files)  flags |= feature_recorder_set::DISABLE_FILE_RECORDERS;
-
-    {
-        feature_recorder_set fs(flags,be_hash,image_fname,opt_outdir);
-        fs.init(feature_file_names);
-        if(opt_enable_histograms) be13::plugin::add_enabled_scanner_histograms_to_feature_recorder_set(fs);
-        be13::plugin::scanners_init(fs);
-
-        fs.set_stop_list(&stop_list);
-        fs.set_alert_list(&alert_list);
-
-        /* Look for commands that impact per-recorders */
-        for(scanner_info::config_t::const_iterator it=s_config.namevals.begin();it!=s_config.namevals.end();it++){
-            /* see if there is a <recorder>: */
-            std::vector<std::string> params = split(it->first,':');
-            if(params.size()>=3 && params.at(0)=="fr"){
-                feature_recorder *fr = fs.get_name(params.at(1));
-                const std::string &cmd = params.at(2);
-                if(fr){
-                    if(cmd=="window")        fr->set_context_window(stoi64(it->second));
-                    if(cmd=="window_before") fr->set_context_window_before(stoi64(it->second));
-                    if(cmd=="window_after")  fr->set_context_window_after(stoi64(it->second));
-                }
-            }
-            /* See if there is a scanner? */
-        }
-
-        /* Store the configuration in the XML file */
-        dfxml_writer  *xreport = new dfxml_writer(reportfilename,false);
-        dfxml_create(*xreport,command_line,cfg);
-        xreport->xmlout("provided_filename",image_fname); // save this information
-
-        /* provide documentation to the user; the DFXML information comes from elsewhere */
-        if(!cfg.opt_quiet){
-            std::cout << "bulk_extractor version: " << PACKAGE_VERSION << "\n";
-#ifdef HAVE_GETHOSTNAME
-            char hostname[1024];
-            memset(hostname,0,sizeof(hostname));
-            if(gethostname(hostname,sizeof(hostname)-1)==0){
-                if (hostname[0]) std::cout << "Hostname: " << hostname << "\n";
-            }
-#endif
-            std::cout << "Input file: " << image_fname << "\n";
-            std::cout << "Output directory: " << opt_outdir << "\n";
-            std::cout << "Disk Size: " << p->image_size() << "\n";
-            std::cout << "Threads: " << cfg.num_threads << "\n";
-        }
-
-        /****************************************************************
-         *** THIS IS IT! PHASE 1!
-         ****************************************************************/
-
-        if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS )) {
-            fs.db_transaction_begin();
-        }
-        BulkExtractor_Phase1 phase1(*xreport,timer,cfg);
-        if(cfg.debug & DEBUG_PRINT_STEPS) std::cerr << "DEBUG: STARTING PHASE 1\n";
-
-        if(opt_sampling_params.size()>0) BulkExtractor_Phase1::set_sampling_parameters(cfg,opt_sampling_params);
-        xreport->add_timestamp("phase1 start");
-        phase1.run(*p,fs,seen_page_ids);
-
-        if(cfg.debug & DEBUG_PRINT_STEPS) std::cerr << "DEBUG: WAITING FOR WORKERS\n";
-        std::string md5_string;
-        phase1.wait_for_workers(*p,&md5_string);
-        delete p;				// not strictly needed, but why not?
-        p = 0;
-
-        if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS )) {
-            fs.db_transaction_commit();
-        }
-        xreport->add_timestamp("phase1 end");
-        if(md5_string.size()>0){
-            std::cout << "MD5 of Disk Image: " << md5_string << "\n";
-        }
-
-        /*** PHASE 2 --- Shutdown ***/
-        if(cfg.opt_quiet==0) std::cout << "Phase 2. Shutting down scanners\n";
-        xreport->add_timestamp("phase2 (shutdown) start");
-        be13::plugin::phase_shutdown(fs);
-        xreport->add_timestamp("phase2 (shutdown) end");
-
-        /*** PHASE 3 --- Create Histograms ***/
-        if(cfg.opt_quiet==0) std::cout << "Phase 3. Creating Histograms\n";
-        xreport->add_timestamp("phase3 (histograms) start");
-        if(opt_enable_histograms) fs.dump_histograms(0,histogram_dump_callback,0);        // TK - add an xml error notifier!
-        xreport->add_timestamp("phase3 (histograms) end");
-
-        /*** PHASE 4 ---  report and then print final usage information ***/
-        xreport->push("report");
-        xreport->xmlout("total_bytes",phase1.total_bytes);
-        xreport->xmlout("elapsed_seconds",timer.elapsed_seconds());
-        xreport->xmlout("max_depth_seen",be13::plugin::get_max_depth_seen());
-        xreport->xmlout("dup_data_encountered",be13::plugin::dup_data_encountered);
-        xreport->pop();			// report
-        xreport->flush();
-
-        xreport->push("scanner_times");
-        fs.get_stats(xreport,stat_callback);
-        xreport->pop();
-        xreport->add_rusage();
-        xreport->pop();			// bulk_extractor
-        xreport->close();
-        if(cfg.opt_quiet==0){
-            float mb_per_sec = (phase1.total_bytes / 1000000.0) / timer.elapsed_seconds();
-
-            std::cout.precision(4);
-            printf("Elapsed time: %g sec.\n",timer.elapsed_seconds());
-            printf("Total MB processed: %d\n",int(phase1.total_bytes / 1000000));
-        
-            printf("Overall performance: %g MBytes/sec (%g MBytes/sec/thread)\n",
-                   mb_per_sec,mb_per_sec/cfg.num_threads);
-            if (fs.has_name("email")) {
-                feature_recorder *fr = fs.get_name("email");
-                if(fr){
-                    std::cout << "Total " << fr->name << " features found: " << fr->count() << "\n";
-                }
-            }
-        }
-    }
 #ifdef HAVE_MCHECK
     muntrace();
 #endif
@@ -0,0 +1,318 @@
+/*
+ * page_classifier.cpp:
+ * Tag the blocks of a buffer as text, binary or random; see page_classifier.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "page_classifier.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool     page_classifier::opt_enabled = false;
+uint32_t page_classifier::opt_block_size = 4096;
+uint32_t page_classifier::opt_random_centibits = 750;
+uint64_t page_classifier::class_bytes[3] = {0,0,0};
+page_classifier::coverage_table *page_classifier::tables = 0;
+
+static pthread_key_t  scope_key;
+static pthread_once_t scope_key_once = PTHREAD_ONCE_INIT;
+static void make_scope_key()
+{
+    if(pthread_key_create(&scope_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+page_classifier::scope::scope(const sbuf_t &sbuf):pc(0),saved(0)
+{
+    if(!opt_enabled) return;
+    pthread_once(&scope_key_once,make_scope_key);
+    saved = (page_classifier *)pthread_getspecific(scope_key);
+    pc = new page_classifier(sbuf);
+    pthread_setspecific(scope_key,pc);
+}
+
+page_classifier::scope::~scope()
+{
+    if(!pc) return;
+    pthread_setspecific(scope_key,saved);
+    delete pc;
+}
+
+page_classifier::page_classifier(const sbuf_t &sbuf_):classes(),sbuf(sbuf_),done(false)
+{
+}
+
+/* Only its thread writes a table. M keeps out a report, which in a batch
+ * may be written while the workers scan the next image; it is not contended. */
+class page_classifier::coverage_table {
+public:
+    coverage_table():next(0),M(),coverage_map(){
+        pthread_mutex_init(&M,NULL);
+    }
+    coverage_table *next;
+    pthread_mutex_t M;
+    coverage_map_t coverage_map;
+};
+
+static pthread_key_t  table_key;
+static pthread_once_t table_key_once = PTHREAD_ONCE_INIT;
+static void make_table_key()
+{
+    if(pthread_key_create(&table_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+page_classifier::coverage_table *page_classifier::my_table()
+{
+    pthread_once(&table_key_once,make_table_key);
+    coverage_table *t = (coverage_table *)pthread_getspecific(table_key);
+    if(t==0){
+        t = new coverage_table();
+        do {
+            t->next = tables;
+        } while(!__sync_bool_compare_and_swap(&tables,t->next,t));
+        pthread_setspecific(table_key,t);
+    }
+    return t;
+}
+
+const page_classifier *page_classifier::get(const sbuf_t &sbuf)
+{
+    if(!opt_enabled) return 0;
+    pthread_once(&scope_key_once,make_scope_key);
+    page_classifier *pc = (page_classifier *)pthread_getspecific(scope_key);
+    if(pc==0 || pc->sbuf.buf!=sbuf.buf || pc->sbuf.bufsize!=sbuf.bufsize) return 0;
+    if(!pc->done) pc->run();
+    return pc;
+}
+
+/* Printable ASCII, tab, newline and carriage return in buf[0..len) */
+static size_t count_printable(const uint8_t *buf,size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Flip the top bit so that a signed compare tests 0x20..0x7e */
+    const __m128i flip = _mm_set1_epi8((char)0x80);
+    const __m128i lo   = _mm_set1_epi8((char)(0x1f ^ 0x80));
+    const __m128i hi   = _mm_set1_epi8((char)(0x7f ^ 0x80));
+    for(;i+16<=len;i+=16){
+        const __m128i v = _mm_loadu_si128((const __m128i *)(buf+i));
+        const __m128i x = _mm_xor_si128(v,flip);
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi8(x,lo),_mm_cmplt_epi8(x,hi));
+        m = _mm_or_si128(m,_mm_cmpeq_epi8(v,_mm_set1_epi8('\t')));
+        m = _mm_or_si128(m,_mm_cmpeq_epi8(v,_mm_set1_epi8('\n')));
+        m = _mm_or_si128(m,_mm_cmpeq_epi8(v,_mm_set1_epi8('\r')));
+        count += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+#endif
+    for(;i<len;i++){
+        const uint8_t c = buf[i];
+        if((c>=0x20 && c<0x7f) || c=='\t' || c=='\n' || c=='\r') count++;
+    }
+    return count;
+}
+
+/* -c/n log2(c/n) for c=0..n, for blocks of n bytes */
+static std::vector<double> entropy_terms;
+static pthread_once_t entropy_terms_once = PTHREAD_ONCE_INIT;
+static void make_entropy_terms()
+{
+    const double n = page_classifier::opt_block_size;
+    entropy_terms.resize(page_classifier::opt_block_size+1);
+    for(size_t c=1;c<entropy_terms.size();c++){
+        const double p = c/n;
+        entropy_terms[c] = -p * log2(p);
+    }
+}
+
+static double entropy(const uint8_t *buf,size_t len)
+{
+    /* Four histograms, so that runs of one value do not wait on each other */
+    uint32_t h[4][256];
+    memset(h,0,sizeof(h));
+    size_t i = 0;
+    for(;i+4<=len;i+=4){
+        h[0][buf[i]]++;
+        h[1][buf[i+1]]++;
+        h[2][buf[i+2]]++;
+        h[3][buf[i+3]]++;
+    }
+    for(;i<len;i++) h[0][buf[i]]++;
+    double s = 0;
+    const bool full = (len==page_classifier::opt_block_size);
+    for(int v=0;v<256;v++){
+        const uint32_t c = h[0][v]+h[1][v]+h[2][v]+h[3][v];
+        if(c==0) continue;
+        if(full){
+            s += entropy_terms[c];
+        } else {
+            const double p = (double)c/len;
+            s -= p * log2(p);
+        }
+    }
+    return s;
+}
+
+void page_classifier::run()
+{
+    done = true;
+    pthread_once(&entropy_terms_once,make_entropy_terms);
+    const size_t bs = opt_block_size;
+    const double random_bits = opt_random_centibits / 100.0;
+    const size_t page = std::min(sbuf.pagesize,sbuf.bufsize);
+    classes.reserve((sbuf.bufsize+bs-1)/bs);
+    for(size_t start=0;start<sbuf.bufsize;start+=bs){
+        const size_t len = std::min(bs,sbuf.bufsize-start);
+        uint8_t c = BINARY;
+        if(count_printable(sbuf.buf+start,len) >= len - len/8){
+            c = TEXT;
+        } else if(entropy(sbuf.buf+start,len) >= random_bits){
+            c = RANDOM;
+        }
+        classes.push_back(c);
+        if(start<page){
+            const uint64_t in_page = std::min(len,page-start);
+            __sync_fetch_and_add(&class_bytes[c==TEXT ? 0 : (c==BINARY ? 1 : 2)],in_page);
+        }
+    }
+}
+
+/* Add [offset,offset+len), joining it with the ranges it touches; a range that touches none is omitted at max_ranges */
+void page_classifier::coverage::add_range(uint64_t offset,uint64_t len)
+{
+    uint64_t end = offset + len;
+    bool joined = false;
+    std::map<uint64_t,uint64_t>::iterator it = ranges.upper_bound(offset);
+    if(it!=ranges.begin()){
+        std::map<uint64_t,uint64_t>::iterator prev = it;
+        --prev;
+        if(prev->first + prev->second >= offset){
+            offset = prev->first;
+            if(prev->first + prev->second > end) end = prev->first + prev->second;
+            ranges.erase(prev);
+            joined = true;
+        }
+    }
+    while(it!=ranges.end() && it->first <= end){
+        if(it->first + it->second > end) end = it->first + it->second;
+        ranges.erase(it++);
+        joined = true;
+    }
+    if(!joined && ranges.size()>=max_ranges){
+        ranges_omitted++;
+        return;
+    }
+    ranges[offset] = end - offset;
+}
+
+bool page_classifier::gate(const scanner_params &sp,const recursion_control_block &rcb,
+                           scanner_t *scanner,const char *name,uint32_t wants)
+{
+    static const size_t guard = 512;    // bytes scanned on either side of a run, for features that cross into it
+    const page_classifier *pc = get(sp.sbuf);
+    if(pc==0) return false;
+    const sbuf_t &sbuf = sp.sbuf;
+    const size_t bs = opt_block_size;
+    const size_t page = std::min(sbuf.pagesize,sbuf.bufsize);
+
+    /* The runs of wanted blocks that start in the page, widened by guard and joined where they meet */
+    std::vector<std::pair<size_t,size_t> > runs;
+    for(size_t b=0;b<pc->classes.size() && b*bs<page;){
+        if((pc->classes[b] & wants)==0){
+            b++;
+            continue;
+        }
+        size_t e = b;
+        while(e<pc->classes.size() && (pc->classes[e] & wants)) e++;
+        const size_t start = b*bs>guard ? b*bs-guard : 0;
+        const size_t end = std::min(e*bs+guard,sbuf.bufsize);
+        if(runs.size()>0 && runs.back().second>=start){
+            runs.back().second = end;
+        } else {
+            runs.push_back(std::pair<size_t,size_t>(start,end));
+        }
+        b = e;
+    }
+    const bool whole = runs.size()==1 && runs[0].first==0 && runs[0].second==sbuf.bufsize;
+
+    coverage_table *t = my_table();
+    pthread_mutex_lock(&t->M);
+    coverage &c = t->coverage_map[name];
+    c.bytes += page;
+    size_t at = 0;
+    for(size_t i=0;i<=runs.size();i++){
+        const size_t gap_end = std::min(i<runs.size() ? runs[i].first : page,page);
+        if(gap_end>at){
+            c.skipped += gap_end-at;
+            if(sbuf.pos0.path.size()==0) c.add_range(sbuf.pos0.offset+at,gap_end-at);
+        }
+        if(i<runs.size()) at = runs[i].second;
+    }
+    pthread_mutex_unlock(&t->M);
+
+    if(whole) return false;
+    for(std::vector<std::pair<size_t,size_t> >::const_iterator it=runs.begin();it!=runs.end();it++){
+        /* The part's page ends where the buffer's does; what is past it is margin, as it was */
+        const size_t part_page = it->first<page ? std::min(it->second,page)-it->first : 0;
+        sbuf_t part(sbuf.pos0+it->first,sbuf.buf+it->first,it->second-it->first,part_page,false);
+        part.page_number = sbuf.page_number;
+        scanner_params psp(sp,part);
+        psp.depth = sp.depth;
+        (*scanner)(psp,rcb);
+    }
+    return true;
+}
+
+void page_classifier::dump_stats(dfxml_writer &xreport)
+{
+    if(!opt_enabled) return;
+    std::stringstream ss;
+    ss << "block_size='" << opt_block_size << "' random_centibits='" << opt_random_centibits << "'";
+    xreport.push("page_classes",ss.str());
+    xreport.xmlout("text_bytes",class_bytes[0]);
+    xreport.xmlout("binary_bytes",class_bytes[1]);
+    xreport.xmlout("random_bytes",class_bytes[2]);
+    coverage_map_t totals;
+    for(coverage_table *t=tables;t;t=t->next){
+        pthread_mutex_lock(&t->M);
+        for(coverage_map_t::const_iterator it=t->coverage_map.begin();it!=t->coverage_map.end();it++){
+            coverage &c = totals[it->first];
+            c.bytes   += it->second.bytes;
+            c.skipped += it->second.skipped;
+            c.ranges_omitted += it->second.ranges_omitted;
+            for(std::map<uint64_t,uint64_t>::const_iterator r=it->second.ranges.begin();r!=it->second.ranges.end();r++){
+                c.add_range(r->first,r->second);
+            }
+        }
+        pthread_mutex_unlock(&t->M);
+    }
+    for(coverage_map_t::const_iterator it=totals.begin();it!=totals.end();it++){
+        const coverage &c = it->second;
+        std::stringstream cs;
+        cs << "scanner='" << it->first << "' bytes='" << c.bytes << "' skipped='" << c.skipped << "'";
+        if(c.ranges_omitted) cs << " ranges_omitted='" << c.ranges_omitted << "'";
+        xreport.push("coverage",cs.str());
+        for(std::map<uint64_t,uint64_t>::const_iterator r=c.ranges.begin();r!=c.ranges.end();r++){
+            std::stringstream rs;
+            rs << "offset='" << r->first << "' length='" << r->second << "'";
+            xreport.xmlout("skipped","",rs.str(),false);
+        }
+        xreport.pop();
+    }
+    xreport.pop();
+}
+
+void page_classifier::reset_stats()
+{
+    for(size_t i=0;i<3;i++) class_bytes[i] = 0;
+    for(coverage_table *t=tables;t;t=t->next){
+        pthread_mutex_lock(&t->M);
+        t->coverage_map.clear();
+        pthread_mutex_unlock(&t->M);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef _PAGE_CLASSIFIER_H_
+#define _PAGE_CLASSIFIER_H_
+
+/**
+ * \file
+ * page_classifier tags each block of a buffer as text, binary or random,
+ * so that the scanners that look for text can skip the parts of encrypted
+ * volumes and compressed media where they cannot match anything.
+ *
+ * A block is text if nearly all of it is printable ASCII or whitespace,
+ * which is counted 16 bytes at a time with SSE2; otherwise it is random
+ * if the entropy of its byte histogram reaches page_class_entropy, and
+ * binary if not. This is the classifier of old_scanners/scan_bulk.cpp
+ * without its ngram and autocorrelation tests.
+ *
+ * As with magic_prefilter, a worker opens a page_classifier::scope around
+ * each buffer it scans and the first scanner that asks classifies it.
+ * A scanner says which classes it wants by calling gate() first thing in
+ * its scan phase; gate() runs the scanner on each run of wanted blocks
+ * (with a little on either side) and returns true, or returns false if
+ * the scanner should scan the whole buffer itself. What each scanner
+ * skipped is reported in report.xml as coverage. Each thread counts it in
+ * a table of its own, under a lock that only a report contends for; the
+ * skipped ranges are joined as they are recorded, and at most max_ranges
+ * are kept for each scanner.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class page_classifier {
+    /*** neither copying nor assignment is implemented ***/
+    page_classifier(const page_classifier &);
+    page_classifier &operator=(const page_classifier &);
+public:
+    enum {
+        TEXT   = 0x01,
+        BINARY = 0x02,
+        RANDOM = 0x04
+    };
+    static bool     opt_enabled;
+    static uint32_t opt_block_size;
+    static uint32_t opt_random_centibits; // entropy, in hundredths of a bit per byte, from which a block is random
+
+    /* The classifier for the buffer being scanned on this thread, made on first use; 0 if none */
+    static const page_classifier *get(const sbuf_t &sbuf);
+
+    /* Run scanner on the parts of sp.sbuf in the classes it wants; false if it should scan all of it */
+    static bool gate(const scanner_params &sp,const recursion_control_block &rcb,
+                     scanner_t *scanner,const char *name,uint32_t wants);
+
+    class scope {
+        /*** neither copying nor assignment is implemented ***/
+        scope(const scope &);
+        scope &operator=(const scope &);
+        page_classifier *pc;
+        page_classifier *saved;
+    public:
+        scope(const sbuf_t &sbuf);
+        ~scope();
+    };
+
+    /* statistics */
+    static uint64_t class_bytes[3];     // page bytes of each class
+    static void dump_stats(class dfxml_writer &xreport);
+    static void reset_stats();          // after a report
+
+    std::vector<uint8_t> classes;       // one per block
+private:
+    page_classifier(const sbuf_t &sbuf_);
+    const sbuf_t &sbuf;
+    bool done;
+    void run();
+
+    static const size_t max_ranges = 10000; // per scanner
+    class coverage {
+    public:
+        coverage():bytes(0),skipped(0),ranges(),ranges_omitted(0){}
+        uint64_t bytes;                 // page bytes offered
+        uint64_t skipped;
+        std::map<uint64_t,uint64_t> ranges; // image offset -> length, coalesced
+        uint64_t ranges_omitted;        // not kept, beyond max_ranges
+        void add_range(uint64_t offset,uint64_t len);
+    };
+    typedef std::map<std::string,coverage> coverage_map_t;
+    class coverage_table;               // one per thread
+    static coverage_table *tables;      // pushed with compare-and-swap, never removed
+    static coverage_table *my_table();
+};
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * page_dedup.cpp:
+ * Scan each distinct page once and replay its features; see page_dedup.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "page_dedup.h"
+#include "scanner_profile.h"
+#include "dfxml/src/dfxml_writer.h"
+#include "dfxml/src/hash_t.h"
+
+bool     page_dedup::opt_enabled = false;
+uint32_t page_dedup::opt_cache_mb = 64;
+uint64_t page_dedup::pages_hashed = 0;
+uint64_t page_dedup::hits = 0;
+uint64_t page_dedup::lines_replayed = 0;
+uint64_t page_dedup::not_cached = 0;
+uint64_t page_dedup::evictions = 0;
+uint64_t page_dedup::mismatches = 0;
+page_dedup::cache_t  page_dedup::cache;
+std::list<page_dedup::key> page_dedup::lru;
+uint64_t page_dedup::cache_bytes = 0;
+pthread_mutex_t page_dedup::cache_M = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t  capture_key;
+static pthread_key_t  writing_key;      // the depth of write() calls on the thread
+static pthread_once_t capture_key_once = PTHREAD_ONCE_INIT;
+static void make_capture_key()
+{
+    if(pthread_key_create(&capture_key,NULL)) errx(1,"pthread_key_create failed");
+    if(pthread_key_create(&writing_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+/****************************************************************
+ * The hash: four lanes of 64-bit words, as in xxHash64, finished
+ * two ways so that the key has 128 bits.
+ */
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+
+static inline uint64_t rotl(uint64_t x,int r) { return (x<<r) | (x>>(64-r)); }
+static inline uint64_t round64(uint64_t acc,uint64_t w) { return rotl(acc + w*P2,31) * P1; }
+static inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+static inline uint64_t word(const uint8_t *p)
+{
+    uint64_t w;
+    memcpy(&w,p,sizeof(w));
+    return w;
+}
+
+bool page_dedup::eligible(const sbuf_t &sbuf)
+{
+    return opt_enabled && sbuf.pos0.path.size()==0 && sbuf.bufsize>0;
+}
+
+void page_dedup::hash(const uint8_t *p,size_t len,uint64_t *h1,uint64_t *h2)
+{
+    uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = -P1;
+    size_t i = 0;
+    for(;i+32<=len;i+=32){
+        v1 = round64(v1,word(p+i));
+        v2 = round64(v2,word(p+i+8));
+        v3 = round64(v3,word(p+i+16));
+        v4 = round64(v4,word(p+i+24));
+    }
+    uint64_t tail = len;
+    for(;i+8<=len;i+=8) tail = rotl(tail ^ round64(0,word(p+i)),27) * P1 + P4;
+    for(;i<len;i++) tail = rotl(tail ^ (p[i] * P1),11) * P2;
+    *h1 = avalanche(rotl(v1,1) + rotl(v2,7) + rotl(v3,12) + rotl(v4,18) + tail);
+    *h2 = avalanche((v1 ^ rotl(v4,23)) * P3 + (v2 ^ rotl(v3,41)) * P4 + rotl(tail,32));
+}
+
+page_dedup::key page_dedup::make_key(const sbuf_t &sbuf,const feature_recorder_set &fs)
+{
+    key k;
+    k.fs = &fs;
+    hash(sbuf.buf,sbuf.bufsize,&k.h1,&k.h2);
+    k.bufsize  = sbuf.bufsize;
+    k.pagesize = sbuf.pagesize;
+    __sync_fetch_and_add(&pages_hashed,1);
+    return k;
+}
+
+/****************************************************************
+ * Capture
+ */
+feature_capture::feature_capture():saved(0)
+{
+    pthread_once(&capture_key_once,make_capture_key);
+    saved = (feature_capture *)pthread_getspecific(capture_key);
+    pthread_setspecific(capture_key,this);
+}
+
+feature_capture::~feature_capture()
+{
+    pthread_setspecific(capture_key,saved);
+}
+
+bool feature_capture::active()
+{
+    pthread_once(&capture_key_once,make_capture_key);
+    return pthread_getspecific(capture_key)!=0;
+}
+
+void feature_capture::record(const std::string &recorder,const pos0_t &pos0,
+                             const std::string &feature,const std::string &context)
+{
+    pthread_once(&capture_key_once,make_capture_key);
+    for(feature_capture *c = (feature_capture *)pthread_getspecific(capture_key);c;c=c->saved){
+        c->add(recorder,pos0,feature,context);
+    }
+}
+
+feature_capture::writing::writing():outermost(false)
+{
+    pthread_once(&capture_key_once,make_capture_key);
+    intptr_t depth = (intptr_t)pthread_getspecific(writing_key);
+    outermost = depth==0;
+    pthread_setspecific(writing_key,(void *)(depth+1));
+}
+
+feature_capture::writing::~writing()
+{
+    pthread_setspecific(writing_key,(void *)((intptr_t)pthread_getspecific(writing_key)-1));
+}
+
+page_dedup::capture::capture(const key &k_,const sbuf_t &sbuf_):
+    k(k_),page_offset(sbuf_.pos0.offset),lines(),bytes(0),overflow(false),repeat(false),sbuf(sbuf_)
+{
+}
+
+void page_dedup::capture::commit()
+{
+    if(repeat) return;                  // its scan left out what a first copy finds
+    if(overflow){
+        __sync_fetch_and_add(&not_cached,1);
+        return;
+    }
+    insert(*this);
+}
+
+/* Features found in a child buffer have a path that starts with the image offset, as in 1234-GZIP-56 */
+void page_dedup::capture::add(const std::string &recorder,const pos0_t &pos0,
+                              const std::string &feature,const std::string &context)
+{
+    if(overflow) return;
+    int64_t delta = 0;
+    std::string suffix;
+    if(pos0.path.size()==0){
+        delta = (int64_t)pos0.offset - (int64_t)page_offset;
+    } else {
+        size_t digits = 0;
+        while(digits<pos0.path.size() && isdigit(pos0.path[digits])) digits++;
+        if(digits==0){
+            overflow = true;
+            return;
+        }
+        delta = strtoll(pos0.path.substr(0,digits).c_str(),0,10) - (int64_t)page_offset;
+        suffix = pos0.path.substr(digits);
+    }
+    if(suffix.size()==0 && recorder==feature_recorder_set::ALERT_RECORDER_NAME
+       && feature.compare(0,9,"DUP SBUF ")==0){
+        repeat = true;
+        return;
+    }
+    lines.push_back(line(recorder,delta,suffix,pos0.path.size() ? pos0.offset : 0,feature,context));
+    bytes += lines.back().bytes();
+    if(bytes > (uint64_t)opt_cache_mb*1024*1024/16){
+        overflow = true;
+        lines.clear();
+    }
+}
+
+/****************************************************************
+ * The cache
+ */
+void page_dedup::insert(const capture &c)
+{
+    const uint64_t limit = (uint64_t)opt_cache_mb*1024*1024;
+    const size_t bytes = c.bytes + sizeof(entry) + sizeof(key)*2;
+    const md5_t md5 = md5_generator::hash_buf(c.sbuf.buf,c.sbuf.bufsize);
+    pthread_mutex_lock(&cache_M);
+    if(cache.find(c.k)==cache.end()){
+        while(lru.size()>0 && cache_bytes + bytes > limit){
+            cache_t::iterator victim = cache.find(lru.back());
+            cache_bytes -= victim->second.bytes;
+            cache.erase(victim);
+            lru.pop_back();
+            evictions++;
+        }
+        entry &e = cache[c.k];
+        e.lines = c.lines;
+        e.bytes = bytes;
+        memcpy(e.md5,md5.digest,sizeof(e.md5));
+        lru.push_front(c.k);
+        e.lru = lru.begin();
+        cache_bytes += bytes;
+    }
+    pthread_mutex_unlock(&cache_M);
+}
+
+bool page_dedup::replay(const key &k,const sbuf_t &sbuf,feature_recorder_set &fs)
+{
+    std::vector<feature_capture::line> lines;
+    uint8_t digest[16];
+    pthread_mutex_lock(&cache_M);
+    cache_t::iterator it = cache.find(k);
+    if(it==cache.end()){
+        pthread_mutex_unlock(&cache_M);
+        return false;
+    }
+    lru.splice(lru.begin(),lru,it->second.lru);
+    lines = it->second.lines;
+    memcpy(digest,it->second.md5,sizeof(digest));
+    pthread_mutex_unlock(&cache_M);
+
+    /* Only the MD5 says that the pages are the same */
+    const md5_t md5 = md5_generator::hash_buf(sbuf.buf,sbuf.bufsize);
+    if(memcmp(md5.digest,digest,sizeof(digest))!=0){
+        __sync_fetch_and_add(&mismatches,1);
+        return false;
+    }
+
+    /* What process_sbuf() does with a buffer it has seen before */
+    feature_recorder *alert_recorder = fs.get_alert_recorder();
+    if(alert_recorder && be13::plugin::dup_data_alerts){
+        std::stringstream ss;
+        ss << "<buflen>" << sbuf.bufsize << "</buflen>";
+        alert_recorder->write(sbuf.pos0,"DUP SBUF "+md5.hexdigest(),ss.str());
+    }
+    __sync_fetch_and_add(&be13::plugin::dup_data_encountered,(uint64_t)sbuf.bufsize);
+
+    const int64_t page_offset = sbuf.pos0.offset;
+    for(std::vector<feature_capture::line>::const_iterator l=lines.begin();l!=lines.end();l++){
+        feature_recorder *fr = fs.get_name(l->recorder);
+        if(fr==0) continue;
+        if(l->suffix.size()==0){
+            fr->write(pos0_t("",page_offset + l->delta),l->feature,l->context);
+        } else {
+            std::stringstream ss;
+            ss << page_offset + l->delta << l->suffix;
+            fr->write(pos0_t(ss.str(),l->offset),l->feature,l->context);
+        }
+    }
+    __sync_fetch_and_add(&hits,1);
+    __sync_fetch_and_add(&lines_replayed,(uint64_t)lines.size());
+    return true;
+}
+
+void page_dedup::dump_stats(dfxml_writer &xreport)
+{
+    if(!opt_enabled) return;
+    pthread_mutex_lock(&cache_M);
+    std::stringstream ss;
+    ss << "cache_mb='" << opt_cache_mb << "'";
+    xreport.push("page_dedup",ss.str());
+    xreport.xmlout("pages_hashed",pages_hashed);
+    xreport.xmlout("pages_replayed",hits);
+    xreport.xmlout("lines_replayed",lines_replayed);
+    xreport.xmlout("pages_not_cached",not_cached);
+    xreport.xmlout("cache_entries",(uint64_t)cache.size());
+    xreport.xmlout("cache_bytes",cache_bytes);
+    xreport.xmlout("evictions",evictions);
+    xreport.xmlout("hash_mismatches",mismatches);
+    xreport.pop();
+    pthread_mutex_unlock(&cache_M);
+}
+
+void page_dedup::forget(const feature_recorder_set &fs)
+{
+    pthread_mutex_lock(&cache_M);
+    for(cache_t::iterator it=cache.begin();it!=cache.end();){
+        if(it->first.fs==&fs){
+            cache_bytes -= it->second.bytes;
+            lru.erase(it->second.lru);
+            cache.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    pthread_mutex_unlock(&cache_M);
+}
+
+void page_dedup::reset_stats()
+{
+    pthread_mutex_lock(&cache_M);
+    pages_hashed = hits = lines_replayed = not_cached = evictions = mismatches = 0;
+    pthread_mutex_unlock(&cache_M);
+}
+
+/****************************************************************
+ * The feature recorders
+ */
+class dedup_feature_recorder: public feature_recorder {
+    /*** neither copying nor assignment is implemented ***/
+    dedup_feature_recorder(const dedup_feature_recorder &);
+    dedup_feature_recorder &operator=(const dedup_feature_recorder &);
+public:
+    dedup_feature_recorder(class feature_recorder_set &fs_,const std::string &name_):
+        feature_recorder(fs_,name_){
+    }
+    using feature_recorder::write;
+    virtual void write(const pos0_t &pos0,const std::string &feature,const std::string &context){
+        feature_capture::writing w;     // what write() writes itself is written again when this line is
+        if(w.outermost) feature_capture::record(name,pos0,feature,context);
+        feature_recorder::write(pos0,feature,context);
+    }
+    virtual void write0(const pos0_t &pos0,const std::string &feature,const std::string &context){
+        scanner_profile::feature();
+        feature_recorder::write0(pos0,feature,context);
+    }
+};
+
+feature_recorder *dedup_feature_recorder_set::create_name_factory(const std::string &name_)
+{
+    return new dedup_feature_recorder(*this,name_);
+}
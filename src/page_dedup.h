@@ -0,0 +1,194 @@
+#ifndef _PAGE_DEDUP_H_
+#define _PAGE_DEDUP_H_
+
+/**
+ * \file
+ * page_dedup scans each distinct image page once. VM images and backups
+ * hold the same operating system pages many times over; rather than scan
+ * every copy, the features found in the first copy are written again at
+ * the forensic path of each later one.
+ *
+ * Each top-level image page is hashed with a fast non-cryptographic hash
+ * (two 64-bit digests of four 64-bit lanes, with the page and margin
+ * sizes) to find it in the cache. That hash is not trusted: each entry
+ * also holds the MD5 of its page, and a page whose MD5 differs is scanned
+ * and counted as a mismatch rather than replayed. While a worker scans a
+ * page that was not in the cache, the feature recorders of a
+ * dedup_feature_recorder_set copy every line passed to write() into a
+ * capture; when the scan is done, the lines go into the cache with their
+ * offsets made relative to the page. Replay passes them to write() again,
+ * so the stop list, the alert list and the histograms see each copy; the
+ * lines those write themselves are not captured. The cache holds at most
+ * page_dedup_cache_mb of lines and drops the least recently used page
+ * first. A page that wrote more than a sixteenth of that is not cached.
+ *
+ * Entries belong to the feature_recorder_set of an image, and forget()
+ * drops them when the image is done, so images in a batch share nothing.
+ * In a plain scan, process_sbuf() finds that a later copy was seen before
+ * and reports it only with the DUP SBUF alert (with dup_data_alerts) and
+ * dup_data_encountered. A replay does the same and then writes the
+ * features of the first copy, so the output is a plain scan's with the
+ * features of each copy added. A page that process_sbuf() itself found
+ * to be a repeat (and wrote a DUP SBUF alert for) is not cached.
+ *
+ * The capturing is done by feature_capture. A capture only sees the
+ * features written on its own thread, so the children that
+ * async_recursion hands to other threads would be missing from it;
+ * main() turns page_dedup off when async_recursion is on.
+ *
+ * Only feature lines are replayed. Files carved from the first copy are
+ * not carved again, packets are not written to packets.pcap again, and
+ * hashdb does not import the page again, so main() turns page_dedup off
+ * when a scanner that does those is enabled. Scanners that keep state from
+ * one page to the next only see the first copy. page_dedup is off by
+ * default.
+ */
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * The lines written on this thread while a capture is in scope. Captures
+ * nest; each line goes to every capture in scope, which keeps it in its
+ * own terms so that it can be written again somewhere else.
+ */
+class feature_capture {
+    /*** neither copying nor assignment is implemented ***/
+    feature_capture(const feature_capture &);
+    feature_capture &operator=(const feature_capture &);
+    feature_capture *saved;
+public:
+    class line {
+    public:
+        line(const std::string &recorder_,int64_t delta_,const std::string &suffix_,uint64_t offset_,
+             const std::string &feature_,const std::string &context_):
+            recorder(recorder_),delta(delta_),suffix(suffix_),offset(offset_),feature(feature_),context(context_){}
+        std::string recorder;
+        int64_t     delta;              // from the page to the image offset in the forensic path
+        std::string suffix;             // the rest of the path of a feature in a child buffer
+        uint64_t    offset;             // in that child buffer
+        std::string feature;
+        std::string context;
+        size_t bytes() const {
+            return sizeof(*this) + recorder.size() + suffix.size() + feature.size() + context.size();
+        }
+    };
+    feature_capture();
+    virtual ~feature_capture();
+    virtual void add(const std::string &recorder,const pos0_t &pos0,
+                     const std::string &feature,const std::string &context)=0;
+    static bool active();               // a capture is in scope on this thread
+    static void record(const std::string &recorder,const pos0_t &pos0,
+                       const std::string &feature,const std::string &context);
+
+    /* In scope for each call of write(); only the outermost call on a thread is recorded */
+    class writing {
+        /*** neither copying nor assignment is implemented ***/
+        writing(const writing &);
+        writing &operator=(const writing &);
+    public:
+        writing();
+        ~writing();
+        bool outermost;
+    };
+};
+
+class page_dedup {
+public:
+    static bool     opt_enabled;
+    static uint32_t opt_cache_mb;
+
+    class key {
+    public:
+        key():fs(0),h1(0),h2(0),bufsize(0),pagesize(0){}
+        const feature_recorder_set *fs;
+        uint64_t h1,h2;
+        uint64_t bufsize,pagesize;
+        bool operator<(const key &k) const {
+            if(fs!=k.fs) return fs<k.fs;
+            if(h1!=k.h1) return h1<k.h1;
+            if(h2!=k.h2) return h2<k.h2;
+            if(bufsize!=k.bufsize) return bufsize<k.bufsize;
+            return pagesize<k.pagesize;
+        }
+    };
+    static bool eligible(const sbuf_t &sbuf);   // a top-level image page
+    static key  make_key(const sbuf_t &sbuf,const feature_recorder_set &fs);
+
+    /* Write the features of a page with the same contents at sbuf's offset; false if it is not cached */
+    static bool replay(const key &k,const sbuf_t &sbuf,feature_recorder_set &fs);
+
+    /* The 128-bit hash of buf[0..len) */
+    static void hash(const uint8_t *buf,size_t len,uint64_t *h1,uint64_t *h2);
+
+    /* The lines written while a page is scanned; commit() caches them */
+    class capture: public feature_capture {
+        /*** neither copying nor assignment is implemented ***/
+        capture(const capture &);
+        capture &operator=(const capture &);
+    public:
+        capture(const key &k,const sbuf_t &sbuf);
+        virtual void add(const std::string &recorder,const pos0_t &pos0,
+                         const std::string &feature,const std::string &context);
+        void commit();
+        const key   k;
+        const uint64_t page_offset;
+        std::vector<line> lines;
+        size_t      bytes;
+        bool        overflow;           // too much to cache, or a path that cannot be moved
+        bool        repeat;             // process_sbuf() wrote the page's DUP SBUF alert
+        const sbuf_t &sbuf;
+    };
+
+    /* statistics */
+    static uint64_t pages_hashed;
+    static uint64_t hits;
+    static uint64_t lines_replayed;
+    static uint64_t not_cached;         // captures that were too large
+    static uint64_t evictions;
+    static uint64_t mismatches;         // the fast hash matched and the MD5 did not
+    static void dump_stats(class dfxml_writer &xreport);
+    static void forget(const feature_recorder_set &fs); // fs's image is done; before fs is deleted
+    static void reset_stats();          // after a report; the cache is kept
+
+private:
+    class entry {
+    public:
+        entry():lines(),bytes(0),lru(){
+            memset(md5,0,sizeof(md5));
+        }
+        std::vector<feature_capture::line> lines;
+        size_t bytes;
+        uint8_t md5[16];                // of the page the lines were found in
+        std::list<key>::iterator lru;
+    };
+    typedef std::map<key,entry> cache_t;
+    static cache_t        cache;
+    static std::list<key> lru;          // most recently used first
+    static uint64_t       cache_bytes;
+    static pthread_mutex_t cache_M;
+    static void insert(const capture &c);
+};
+
+/**
+ * The feature recorders for an image: they write as usual and also copy
+ * each line passed to write() into the captures in scope on the thread,
+ * if there are any, and count each line written for the scanner that is
+ * running (see scanner_profile.h).
+ */
+class dedup_feature_recorder_set: public feature_recorder_set {
+    /*** neither copying nor assignment is implemented ***/
+    dedup_feature_recorder_set(const dedup_feature_recorder_set &);
+    dedup_feature_recorder_set &operator=(const dedup_feature_recorder_set &);
+public:
+    dedup_feature_recorder_set(uint32_t flags_,const hash_def &hasher_,
+                               const std::string &input_fname_,const std::string &outdir_):
+        feature_recorder_set(flags_,hasher_,input_fname_,outdir_){
+    }
+    virtual feature_recorder *create_name_factory(const std::string &name_);
+};
+
+#endif
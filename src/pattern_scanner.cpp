@@ -33,9 +33,14 @@ bool PatternScanner::handleParseError(const Handler& h, LG_Error* err) const {
 }
 
 void PatternScanner::shutdown(const scanner_params&) {
+  releaseHandlers();
+}
+
+void PatternScanner::releaseHandlers() {
   for (vector<const Handler*>::iterator itr(Handlers.begin()); itr != Handlers.end(); ++itr) {
     delete *itr;
   }
+  Handlers.clear();
 }
 /*********************************************************/
 
@@ -44,11 +49,16 @@ LightgrepController::LightgrepController()
   Fsm(lg_create_fsm(1 << 20)),              // Reserve space for 1M states in the automaton--will grow if needed
   PatternInfo(lg_create_pattern_map(1000)), // Reserve space for 1000 patterns in the pattern map
   Prog(0),
+  Compiled(false),
   Scanners()
 {
 }
 
 LightgrepController::~LightgrepController() {
+  // the handlers are shut down with the program that refers to them, after the last image of a batch (-L)
+  for (vector<PatternScanner*>::iterator itr(Scanners.begin()); itr != Scanners.end(); ++itr) {
+    (*itr)->releaseHandlers();
+  }
   lg_destroy_pattern(ParsedPattern);
   lg_destroy_pattern_map(PatternInfo);
   lg_destroy_program(Prog);
@@ -174,6 +184,7 @@ void LightgrepController::regcomp() {
   // Create an optimized, immutable form of the accumulated automaton
   Prog = lg_create_program(Fsm, &progOpts);
   lg_destroy_fsm(Fsm);
+  Compiled = true;
 
   cerr << lg_pattern_map_size(PatternInfo) << " lightgrep patterns, logic size is " << lg_program_size(Prog) << " bytes, " << Scanners.size() << " active scanners" << std::endl;
   #ifdef LGBENCHMARK
@@ -285,6 +296,10 @@ void scan_lg(PatternScanner& scanner, const class scanner_params &sp, const recu
     scanner.startup(sp);
     break;
   case scanner_params::PHASE_INIT:
+    // the patterns are compiled once; later images in a batch (-L) reuse them
+    if (LightgrepController::Get().compiled()) {
+      break;
+    }
     scanner.init(sp);
     if (!LightgrepController::Get().addScanner(scanner)) {
       // It's fine for user patterns not to parse, but there's no excuse for a scanner so exit.
@@ -293,7 +308,7 @@ void scan_lg(PatternScanner& scanner, const class scanner_params &sp, const recu
     }
     break;
   case scanner_params::PHASE_SHUTDOWN:
-    scanner.shutdown(sp);
+    // the compiled program refers to the handlers; ~LightgrepController() releases them
     break;
   default:
     break;
@@ -39,6 +39,7 @@ public:
   virtual void finishScan(const scanner_params& sp) {} // done searching a region
 
   virtual void shutdown(const scanner_params& sp); // perform any shutdown, if necessary
+  void releaseHandlers(); // delete the handlers; the controller does this once it is done with them
 
   // return bool indicates whether scanner addition should be continued
   // default is to print message to stderr and quit parsing scanner patterns
@@ -103,6 +104,7 @@ public:
   bool addUserPatterns(PatternScanner& scanner, CallbackFnType* callbackPtr, const FindOpts& userPatterns);
 
   void regcomp();
+  bool compiled() const { return Compiled; } // patterns can no longer be added
   void scan(const scanner_params& sp, const recursion_control_block& rcb);
   void processHit(const vector<PatternScanner*>& sTbl, const LG_SearchHit& hit, const scanner_params& sp, const recursion_control_block& rcb);
 
@@ -119,6 +121,7 @@ private:
   LG_HFSM         Fsm;
   LG_HPATTERNMAP  PatternInfo;
   LG_HPROGRAM     Prog;
+  bool            Compiled;
 
   vector<PatternScanner*> Scanners;
 };
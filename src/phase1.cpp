@@ -2,6 +2,138 @@
 #include "bulk_extractor.h"
 #include "phase1.h"
 #include "threadpool.h"
+#include "buffer_pool.h"
+#include "image_hasher.h"
+#include "checkpoint.h"
+#include "magic_prefilter.h"
+#include "page_classifier.h"
+#include "page_dedup.h"
+#include "child_memo.h"
+#include "scanner_profile.h"
+
+/****************************************************************
+ *** readahead_queue
+ ****************************************************************/
+
+readahead_queue::readahead_queue(size_t max_pages_,size_t max_bytes_):
+    M(),NOT_FULL(),NOT_EMPTY(),q(),bytes(0),closed(false),
+    max_pages(max_pages_),max_bytes(max_bytes_),
+    pushes(0),depth_total(0),depth_max(0),bytes_max(0),reader_blocked(),dispatcher_starved()
+{
+    if(pthread_mutex_init(&M,NULL))        errx(1,"pthread_mutex_init failed");
+    if(pthread_cond_init(&NOT_FULL,NULL))  errx(1,"pthread_cond_init #1 failed");
+    if(pthread_cond_init(&NOT_EMPTY,NULL)) errx(1,"pthread_cond_init #2 failed");
+}
+
+readahead_queue::~readahead_queue()
+{
+    pthread_mutex_destroy(&M);
+    pthread_cond_destroy(&NOT_FULL);
+    pthread_cond_destroy(&NOT_EMPTY);
+}
+
+/**
+ * Add a page. Blocks while the queue holds max_pages pages or
+ * adding the page would go over max_bytes. A page is always accepted
+ * into an empty queue, so a single page larger than the cap cannot deadlock.
+ */
+void readahead_queue::push(sbuf_t *sbuf)
+{
+    pthread_mutex_lock(&M);
+    if(q.size()>=max_pages || (q.size()>0 && bytes+sbuf->bufsize > max_bytes)){
+        reader_blocked.start();
+        while(q.size()>=max_pages || (q.size()>0 && bytes+sbuf->bufsize > max_bytes)){
+            pthread_cond_wait(&NOT_FULL,&M);
+        }
+        reader_blocked.stop();
+    }
+    pushes++;
+    depth_total += q.size();
+    if(q.size()>depth_max) depth_max = q.size();
+    q.push_back(sbuf);
+    bytes += sbuf->bufsize;
+    if(bytes>bytes_max) bytes_max = bytes;
+    pthread_cond_signal(&NOT_EMPTY);
+    pthread_mutex_unlock(&M);
+}
+
+sbuf_t *readahead_queue::pop()
+{
+    pthread_mutex_lock(&M);
+    if(q.empty() && !closed){
+        dispatcher_starved.start();
+        while(q.empty() && !closed){
+            pthread_cond_wait(&NOT_EMPTY,&M);
+        }
+        dispatcher_starved.stop();
+    }
+    sbuf_t *sbuf = 0;
+    if(!q.empty()){
+        sbuf = q.front();
+        q.pop_front();
+        bytes -= sbuf->bufsize;
+        pthread_cond_signal(&NOT_FULL);
+    }
+    pthread_mutex_unlock(&M);
+    return sbuf;
+}
+
+void readahead_queue::close()
+{
+    pthread_mutex_lock(&M);
+    closed = true;
+    pthread_cond_broadcast(&NOT_EMPTY);
+    pthread_mutex_unlock(&M);
+}
+
+void readahead_queue::dump_stats(dfxml_writer &xreport) const
+{
+    std::stringstream ss;
+    ss << "max_pages='" << max_pages << "' max_bytes='" << max_bytes << "'";
+    xreport.push("readahead",ss.str());
+    xreport.xmlout("pages",pushes);
+    xreport.xmlout("average_depth",pushes ? (double)depth_total/pushes : 0.0);
+    xreport.xmlout("max_depth",(uint64_t)depth_max);
+    xreport.xmlout("max_bytes_queued",(uint64_t)bytes_max);
+    xreport.xmlout("reader_blocked_seconds",reader_blocked.elapsed_seconds());
+    xreport.xmlout("dispatcher_starved_seconds",dispatcher_starved.elapsed_seconds());
+    xreport.pop();
+}
+
+/****************************************************************
+ *** block_sampler
+ ****************************************************************/
+
+block_sampler::block_sampler(uint64_t max_blocks_,double frac,uint32_t run_blocks_):
+    max_blocks(max_blocks_),run_blocks(run_blocks_>0 ? run_blocks_ : 1),
+    runs((max_blocks_+run_blocks-1)/run_blocks),
+    samples(runs==0 ? 0 : (uint64_t)(runs*frac+0.5)>0 ? (uint64_t)(runs*frac+0.5) : 1),
+    stratum(0),first(0),offset(0)
+{
+    if(samples>0) pick();
+}
+
+/* Stratum i is runs [i*runs/samples, (i+1)*runs/samples) */
+void block_sampler::pick()
+{
+    uint64_t lo = (uint64_t)((double)stratum*runs/samples);
+    uint64_t hi = (uint64_t)((double)(stratum+1)*runs/samples);
+    if(hi<=lo) hi = lo+1;
+    uint64_t r = ((((uint64_t)random()) << 31) | random()) % (hi-lo);
+    first  = (lo+r) * run_blocks;
+    offset = 0;
+}
+
+bool block_sampler::next()
+{
+    if(++offset < run_blocks && first+offset < max_blocks) return false;
+    if(++stratum < samples) pick();
+    return true;
+}
+
+/****************************************************************
+ *** BulkExtractor_Phase1
+ ****************************************************************/
 
 void BulkExtractor_Phase1::msleep(uint32_t msec)
 {
@@ -74,27 +206,89 @@ sbuf_t *BulkExtractor_Phase1::get_sbuf(image_process::iterator &it)
 }
 
 
-void BulkExtractor_Phase1::make_sorted_random_blocklist(blocklist_t *blocklist,uint64_t max_blocks,float frac)
+/* A page is data unless every byte of it is the same */
+void BulkExtractor_Phase1::note_sampled_page(const sbuf_t &sbuf)
 {
-    while(blocklist->size() < max_blocks * frac){
-        uint64_t blk_high = ((uint64_t)random()) << 32;
-        uint64_t blk_low  = random();
-        uint64_t blk      = (blk_high | blk_low) % max_blocks;
-        blocklist->insert(blk); // will be added even if already present
-    }
+    size_t len = sbuf.pagesize < sbuf.bufsize ? sbuf.pagesize : sbuf.bufsize;
+    run_pages++;
+    if(len>1 && memcmp(sbuf.buf,sbuf.buf+1,len-1)!=0) run_data_pages++;
+    sampled_bytes += len;
+}
+
+void BulkExtractor_Phase1::end_sampled_run()
+{
+    if(run_pages>0) data_estimate.add((double)run_data_pages/run_pages); // an unreadable run counts for nothing
+    run_pages = 0;
+    run_data_pages = 0;
+}
+
+
+/**
+ * Queue a page for hashing and hand it to the threadpool.
+ * Called on the dispatcher thread, or on the reader if there is no read-ahead.
+ */
+void BulkExtractor_Phase1::dispatch(sbuf_t *sbuf)
+{
+    if(hasher) hasher->add(*sbuf);      // a copy; hashed on the hasher's thread
+    __sync_fetch_and_add(&total_bytes,(uint64_t)sbuf->pagesize);
+                        
+    /***************************
+     **** SCHEDULE THE WORK ****
+     ***************************/
+                        
+    tp->schedule_work(sbuf,job);	
 }
 
+void *BulkExtractor_Phase1::dispatcher_run(void *arg)
+{
+    BulkExtractor_Phase1 &self = *(BulkExtractor_Phase1 *)arg;
+    while(sbuf_t *sbuf = self.raq->pop()){
+        self.dispatch(sbuf);
+    }
+    return 0;
+}
 
 void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
                                seen_page_ids_t &seen_page_ids)
 {
     p.set_report_read_errors(config.opt_report_read_errors);
-    md5g = new md5_generator();		// keep track of MD5
-    uint64_t md5_next = 0;              // next byte to hash
+    if(sampling() && !p.can_seek()){
+        errx(1,"%s can only be read in order, so it cannot be sampled",p.image_fname().c_str());
+    }
+    p.set_sequential(!sampling());      // each page's margin is the start of the next
 
-    if(config.debug & DEBUG_PRINT_STEPS) std::cout << "DEBUG: CREATING THREAD POOL\n";
-    
-    tp = new threadpool(config.num_threads,fs,xreport);	
+    /* Enough page buffers for every page that can be in memory at once */
+    buffer_pool::get().prefill(p.pagesize+p.margin,
+                               config.num_threads*2 + config.opt_readahead_pages + process_raw::opt_read_depth + 2);
+    /* Hash the image unless only part of it is being scanned; skipped pages are read by the hasher */
+    if(image_hasher::opt_algorithms.size()>0 && !sampling()
+       && config.opt_page_start==0 && config.opt_offset_start==0 && config.opt_offset_end==0
+       && dynamic_cast<process_dir *>(&p)==0){
+        hasher = new image_hasher(p,image_hasher::opt_algorithms);
+    }
+
+    if(tp==0){
+        if(config.debug & DEBUG_PRINT_STEPS) std::cout << "DEBUG: CREATING THREAD POOL\n";
+        tp = new threadpool(config.num_threads,fs);	
+    }
+    job = new scan_job(fs,xreport);
+    job->checkpoint = checkpoint;
+    tp->set_default_job(job);
+
+    /* In a batch the last image's units may still be running; its tail is over */
+    tp->clear_tail();                   // the last image of a batch may have set it
+    producer_wait0 = tp->waiting.elapsed_seconds();
+    worker_wait0.clear();
+    for(threadpool::worker_vector::const_iterator ij=tp->workers.begin();ij!=tp->workers.end();ij++){
+        worker_wait0.push_back((*ij)->waiting.elapsed_seconds());
+    }
+
+    if(config.opt_readahead_pages>0){
+        raq = new readahead_queue(config.opt_readahead_pages,(size_t)config.opt_readahead_mb*1024*1024);
+        if(pthread_create(&dispatcher,NULL,dispatcher_run,(void *)this)){
+            errx(1,"cannot create read-ahead dispatcher thread");
+        }
+    }
 
     uint64_t page_ctr=0;
     xreport.push("runtime","xmlns:debug=\"http://www.github.com/simsong/bulk_extractor/issues\"");
@@ -103,12 +297,10 @@ void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
      *
      * it -- the regular image_iterator; it knows how to read blocks.
      * 
-     * si -- the sampling iterator. It is a iterator for an STL set.
+     * sampler -- the blocks to sample, in order.
      *
-     * If sampling, si is used to ask for a specific page from it.
+     * If sampling, the sampler is used to ask for a specific page from it.
      */
-    blocklist_t blocks_to_sample;
-    blocklist_t::const_iterator si = blocks_to_sample.begin(); // sampling iterator
     image_process::iterator     it = p.begin(); // sequential iterator
 
     if(config.opt_offset_start){
@@ -117,15 +309,13 @@ void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
     }
 
     if(sampling()){
-        /* Create a list of blocks to sample */
-        make_sorted_random_blocklist(&blocks_to_sample,it.max_blocks(),config.sampling_fraction);
-        si = blocks_to_sample.begin();    // get the new beginning
+        sampler = new block_sampler(it.max_blocks(),config.sampling_fraction,config.sampling_run_blocks);
     }
     /* Loop over the blocks to sample */
     while(true){
         if(sampling()){
-            if(si==blocks_to_sample.end()) break;
-            it.seek_block(*si);
+            if(sampler->done()) break;
+            it.seek_block(sampler->block());
         } else {
             /* Not sampling; no need to seek, it's the next one */
             if (it == p.end()){
@@ -138,30 +328,19 @@ void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
         }
         if(config.opt_page_start<=page_ctr && config.opt_offset_start<=it.raw_offset){
             // Make sure we haven't done this page yet
-            if(seen_page_ids.find(it.get_pos0().str()) == seen_page_ids.end()){
+            if(checkpoint && checkpoint->done(it.raw_offset)){
+                pages_skipped++;
+            } else if(seen_page_ids.empty() || seen_page_ids.find(it.get_pos0().str()) == seen_page_ids.end()){
                 try {
                     sbuf_t *sbuf = get_sbuf(it);
                     if(sbuf==0) break;	// eof?
                     sbuf->page_number = page_ctr;
-                        
-                    /* compute the md5 hash */
-                    if(md5g){
-                        if(sbuf->pos0.offset==md5_next){ 
-                            // next byte follows logically, so continue to compute hash
-                            md5g->update(sbuf->buf,sbuf->pagesize);
-                            md5_next += sbuf->pagesize;
-                        } else {
-                            delete md5g; // we had a logical gap; stop hashing
-                            md5g = 0;
-                        }
+                    if(sampler) note_sampled_page(*sbuf);
+                    if(raq){
+                        raq->push(sbuf);        // the dispatcher hashes and schedules it
+                    } else {
+                        dispatch(sbuf);
                     }
-                    total_bytes += sbuf->pagesize;
-                        
-                    /***************************
-                     **** SCHEDULE THE WORK ****
-                     ***************************/
-                        
-                    tp->schedule_work(sbuf);	
                     if(!config.opt_quiet) notify_user(it);
                 }
                 catch (const std::exception &e) {
@@ -181,12 +360,23 @@ void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
          * Otherwise increment the it iterator.
          */
         if(sampling()){
-            ++si;
+            if(sampler->next()) end_sampled_run();
         } else {
             ++it;
+            /* Start splitting pages by scanner while there are about as many left as workers */
+            if(!tp->tail && p.can_seek() && (1.0-it.fraction_done())*it.max_blocks() <= config.num_threads){
+                tp->set_tail();
+            }
         }
         ++page_ctr;
     }
+    tp->set_tail();
+
+    /* Let the dispatcher drain the read-ahead queue */
+    if(raq){
+        raq->close();
+        pthread_join(dispatcher,NULL);
+    }
 	    
     if(!config.opt_quiet){
         std::cout << "All data are read; waiting for threads to finish...\n";
@@ -195,12 +385,13 @@ void BulkExtractor_Phase1::run(image_process &p,feature_recorder_set &fs,
 
 void BulkExtractor_Phase1::wait_for_workers(image_process &p,std::string *md5_string)
 {
-    /* Now wait for all of the threads to be free */
-    tp->mode = 1;			// waiting for workers to finish
+    /* Now wait for all of the threads to be free, or for this image's units if the pool is shared */
+    if(!shared_tp) tp->mode = 1;	// waiting for workers to finish
     time_t wait_start = time(0);
     for(int32_t counter = 0;;counter++){
+        if(tp->job_done(*job)) break;
         int num_remaining = config.num_threads - tp->get_free_count();
-        if(num_remaining==0) break;
+        if(num_remaining<1) num_remaining = 1; // work is queued but not yet picked up
 
         msleep(100);
         time_t time_waiting   = time(0) - wait_start;
@@ -226,37 +417,87 @@ void BulkExtractor_Phase1::wait_for_workers(image_process &p,std::string *md5_st
         }
     }
     if(config.opt_quiet==0) std::cout << "All Threads Finished!\n";
+    child_memo::forget(job->fs);        // before fs is deleted and its address used again
+    page_dedup::forget(job->fs);
 	
     xreport.pop();			// pop runtime
     /* We can write out the source info now, since we (might) know the hash */
     xreport.push("source");
     xreport.xmlout("image_filename",p.image_fname());
     xreport.xmlout("image_size",p.image_size());  
-    if(md5g){
-        md5_t md5 = md5g->final();
-        if(md5_string) *md5_string = md5.hexdigest();
-        xreport.xmlout("hashdigest",md5.hexdigest(),"type='MD5'",false);
-        delete md5g;
-    }
+    if(hasher) hasher->dump_digests(xreport,md5_string);
     xreport.pop();			// source
 
     /* Record the feature files and their counts in the output */
-    tp->fs.dump_name_count_stats(xreport);
+    job->fs.dump_name_count_stats(xreport);
 
-    if(config.opt_quiet==0) std::cout << "Producer time spent waiting: " << tp->waiting.elapsed_seconds() << " sec.\n";
+    const double producer_wait = tp->waiting.elapsed_seconds() - producer_wait0;
+    if(config.opt_quiet==0) std::cout << "Producer time spent waiting: " << producer_wait << " sec.\n";
     
-    xreport.xmlout("thread_wait",dtos(tp->waiting.elapsed_seconds()),"thread='0'",false);
+    xreport.xmlout("thread_wait",dtos(producer_wait),"thread='0'",false);
     double worker_wait_average = 0;
     for(threadpool::worker_vector::const_iterator ij=tp->workers.begin();ij!=tp->workers.end();ij++){
-        worker_wait_average += (*ij)->waiting.elapsed_seconds() / config.num_threads;
+        const double worker_wait = (*ij)->waiting.elapsed_seconds() - worker_wait0.at((*ij)->id);
+        worker_wait_average += worker_wait / config.num_threads;
         std::stringstream ss;
         ss << "thread='" << (*ij)->id << "'";
-        xreport.xmlout("thread_wait",dtos((*ij)->waiting.elapsed_seconds()),ss.str(),false);
+        xreport.xmlout("thread_wait",dtos(worker_wait),ss.str(),false);
+    }
+    tp->dump_tail_stats(*job,xreport);
+    tp->dump_constant_stats(xreport);
+    magic_prefilter::dump_stats(xreport);
+    page_classifier::dump_stats(xreport);
+    page_dedup::dump_stats(xreport);
+    child_memo::dump_stats(xreport);
+    scanner_profile::dump_stats(xreport);
+    if(tp->file_parts) xreport.xmlout("file_parts",tp->file_parts); // -R files scanned in pages
+    xreport.xmlout("work_steals",tp->steals);
+    if(threadpool::opt_async_recursion) xreport.xmlout("async_children",tp->async_children);
+
+    /* The pool-wide counters start again for the next report. In a batch the
+     * next image may be running by now, so each report has what was counted
+     * since the one before it.
+     */
+    tp->reset_stats();
+    magic_prefilter::reset_stats();
+    page_classifier::reset_stats();
+    page_dedup::reset_stats();
+    child_memo::reset_stats();
+    scanner_profile::reset_stats();
+    if(p.margin_bytes_reused) xreport.xmlout("margin_bytes_reused",p.margin_bytes_reused);
+    if(p.margins_short) xreport.xmlout("margins_short",p.margins_short);
+    p.dump_read_errors(xreport);
+    const process_raw *raw = dynamic_cast<const process_raw *>(&p);
+    if(raw) raw->dump_read_stats(xreport);
+#ifdef HAVE_LIBEWF
+    const process_ewf *ewf = dynamic_cast<const process_ewf *>(&p);
+    if(ewf) ewf->dump_read_stats(xreport);
+#endif
+    const process_dir *dir = dynamic_cast<const process_dir *>(&p);
+    if(dir) dir->dump_stats(xreport);
+    buffer_pool::get().dump_stats(xreport);
+    if(checkpoint){
+        checkpoint->sync();
+        if(pages_skipped) xreport.xmlout("pages_skipped_by_checkpoint",pages_skipped);
+        checkpoint->dump_stats(xreport);
+    }
+    if(hasher){
+        hasher->dump_stats(xreport);
+        delete hasher;
+        hasher = 0;
+    }
+    if(raq){
+        raq->dump_stats(xreport);
+        delete raq;
+        raq = 0;
     }
+    if(tp->default_job==job) tp->set_default_job(0); // the next image of a batch may have set its own
+    delete job;                         // none of its units are left
+    job = 0;
     xreport.pop();
     xreport.flush();
     if(config.opt_quiet==0) std::cout << "Average consumer time spent waiting: " << worker_wait_average << " sec.\n";
-    if(worker_wait_average > tp->waiting.elapsed_seconds()*2
+    if(worker_wait_average > producer_wait*2
        && worker_wait_average>10 && config.opt_quiet==0){
         std::cout << "*******************************************\n";
         std::cout << "** bulk_extractor is probably I/O bound. **\n";
@@ -264,8 +505,8 @@ void BulkExtractor_Phase1::wait_for_workers(image_process &p,std::string *md5_st
         std::cout << "**      to get better performance.       **\n";
         std::cout << "*******************************************\n";
     }
-    if(tp->waiting.elapsed_seconds() > worker_wait_average * 2
-       && tp->waiting.elapsed_seconds()>10 && config.opt_quiet==0){
+    if(producer_wait > worker_wait_average * 2
+       && producer_wait>10 && config.opt_quiet==0){
         std::cout << "*******************************************\n";
         std::cout << "** bulk_extractor is probably CPU bound. **\n";
         std::cout << "**    Run on a computer with more cores  **\n";
@@ -274,3 +515,61 @@ void BulkExtractor_Phase1::wait_for_workers(image_process &p,std::string *md5_st
     }
     /* end of phase 1 */
 }
+
+/**
+ * What a -s or -i sample says about the whole image: how much of it is
+ * data, and how many features of each kind a full run would find. The
+ * feature intervals treat features as independent of one another, which
+ * they are not (they come in clusters), so they are narrower than they
+ * should be; the data interval makes no such assumption.
+ */
+void BulkExtractor_Phase1::dump_sample_estimates(image_process &p,feature_recorder_set &fs,
+                                                 const feature_file_names_t &names)
+{
+    if(sampler==0) return;
+    uint64_t runs = sampler->total_runs();
+    uint64_t n    = data_estimate.count(); // runs that were read
+    double   frac = runs ? (double)n/runs : 0;
+    delete sampler;
+    sampler = 0;
+
+    std::stringstream ss;
+    ss << "fraction='" << config.sampling_fraction << "' run_blocks='" << config.sampling_run_blocks << "'";
+    xreport.push("sampling",ss.str());
+    xreport.xmlout("runs",runs);
+    xreport.xmlout("runs_sampled",n);
+    xreport.xmlout("bytes_sampled",sampled_bytes);
+    if(n==0 || frac<=0){
+        xreport.pop();
+        return;
+    }
+
+    double data = data_estimate.mean();
+    double hw   = data_estimate.half_width(frac);
+    std::stringstream ds;
+    ds << "low='" << std::max(0.0,data-hw) << "' high='" << std::min(1.0,data+hw) << "'";
+    xreport.xmlout("data_fraction",dtos(data),ds.str(),false);
+    if(config.opt_info){
+        printf("Estimated data: %4.2f%% of %s (95%% confidence %4.2f%% to %4.2f%%)\n",
+               data*100.0,p.image_fname().c_str(),std::max(0.0,data-hw)*100.0,std::min(1.0,data+hw)*100.0);
+    }
+
+    for(feature_file_names_t::const_iterator it=names.begin();it!=names.end();it++){
+        feature_recorder *fr = fs.get_name(*it);
+        if(fr==0) continue;
+        double found = fr->count();
+        double est   = found/frac;
+        double fhw   = 1.96 * sqrt(found*(1.0-frac)) / frac;
+        std::stringstream attrs,value;
+        attrs << "name='" << dfxml_writer::xmlescape(*it) << "' found='" << fr->count() << "'"
+              << " low='" << (uint64_t)std::max(found,est-fhw) << "' high='" << (uint64_t)(est+fhw) << "'";
+        value << (uint64_t)est;
+        xreport.xmlout("feature_estimate",value.str(),attrs.str(),false);
+        if(config.opt_info && found>0){
+            printf("Estimated %s features: %llu (95%% confidence %llu to %llu)\n",it->c_str(),
+                   (unsigned long long)est,(unsigned long long)std::max(found,est-fhw),
+                   (unsigned long long)(est+fhw));
+        }
+    }
+    xreport.pop();
+}
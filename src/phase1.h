@@ -7,6 +7,99 @@
 #include "dfxml/src/dfxml_writer.h"
 #include "dfxml/src/hash_t.h"
 
+#include <cmath>
+#include <deque>
+
+
+/****************************************************************
+ *** READ-AHEAD
+ *** A bounded queue of sbufs that have been read from the image but
+ *** not yet handed to the threadpool. The reader fills it while the
+ *** dispatcher is blocked on the threadpool, so the disk never waits
+ *** for the scanners and the scanners never wait for the disk.
+ ****************************************************************/
+
+class readahead_queue {
+    readahead_queue(const readahead_queue &);
+    readahead_queue &operator=(const readahead_queue &);
+    pthread_mutex_t M;
+    pthread_cond_t  NOT_FULL;
+    pthread_cond_t  NOT_EMPTY;
+    std::deque<sbuf_t *> q;
+    size_t          bytes;              // bytes currently queued
+    bool            closed;
+public:
+    const size_t    max_pages;
+    const size_t    max_bytes;
+    /* statistics */
+    uint64_t        pushes;
+    uint64_t        depth_total;        // sum of the queue depth seen by each push
+    size_t          depth_max;
+    size_t          bytes_max;
+    aftimer         reader_blocked;     // reader waiting for room
+    aftimer         dispatcher_starved; // dispatcher waiting for a page
+
+    readahead_queue(size_t max_pages_,size_t max_bytes_);
+    ~readahead_queue();
+    void    push(sbuf_t *sbuf);         // blocks while full
+    sbuf_t *pop();                      // blocks while empty; 0 when closed and drained
+    void    close();                    // no more pushes
+    void    dump_stats(dfxml_writer &xreport) const;
+};
+
+/****************************************************************
+ *** SAMPLING
+ *** block_sampler hands out the blocks of a -s or -i sample in
+ *** increasing order without keeping a list of them. The image is cut
+ *** into runs of run_blocks consecutive blocks, the runs into as many
+ *** equal strata as there are runs to sample, and one run is picked at
+ *** random from each stratum. A run of several blocks keeps the reads
+ *** large enough for a disk to do them at speed.
+ ****************************************************************/
+
+class block_sampler {
+    const uint64_t max_blocks;
+    const uint64_t run_blocks;
+    const uint64_t runs;                // runs in the image
+    const uint64_t samples;             // runs sampled, one per stratum
+    uint64_t stratum;
+    uint64_t first;                     // first block of this stratum's run
+    uint64_t offset;                    // block within the run
+    void pick();
+public:
+    block_sampler(uint64_t max_blocks_,double frac,uint32_t run_blocks_);
+    bool     done() const { return stratum>=samples; }
+    uint64_t block() const { return first+offset; }
+    bool     next();                    // true if that was the last block of its run
+    uint64_t total_runs() const { return runs; }
+};
+
+/**
+ * The mean of one value per sampled run, with its 95% confidence
+ * interval. Adjacent strata are paired to estimate the variance
+ * (the successive difference estimator), since a stratum with one
+ * sample has no variance of its own.
+ */
+class sample_estimate {
+    uint64_t n;
+    double   sum;
+    double   sqdiff;                    // sum of squared differences of neighbours
+    double   last;
+public:
+    sample_estimate():n(0),sum(0),sqdiff(0),last(0){}
+    void     add(double y){
+        if(n>0) sqdiff += (y-last)*(y-last);
+        last = y;
+        sum += y;
+        n++;
+    }
+    uint64_t count() const { return n; }
+    double   mean() const { return n ? sum/n : 0; }
+    double   half_width(double frac) const { // 0 if there is too little to go on
+        if(n<2) return 0;
+        return 1.96 * sqrt((1.0-frac) * sqdiff / (2.0*n*(n-1)));
+    }
+};
 
 /****************************************************************
  *** Phase 1 BUFFER PROCESSING
@@ -15,9 +108,6 @@
 
 class BulkExtractor_Phase1 {
 public:
-    typedef std::set<uint64_t> blocklist_t; // a list of blocks
-    static void make_sorted_random_blocklist(blocklist_t *blocklist,uint64_t max_blocks,float frac);
-
     /* configuration for phase1 */
     class Config {
     Config &operator=(const Config &);  // not implemented
@@ -39,7 +129,10 @@ public:
             num_threads(1),             // 
             sampling_fraction(1.0),
             sampling_passes(1),
-            opt_report_read_errors(true) {}
+            sampling_run_blocks(1),
+            opt_report_read_errors(true),
+            opt_readahead_pages(0),
+            opt_readahead_mb(256) {}
                  
         uint64_t debug;                 // debug 
         size_t   opt_pagesize;
@@ -56,7 +149,10 @@ public:
         u_int    num_threads;
         double   sampling_fraction;       // for random sampling
         u_int    sampling_passes;
+        uint32_t sampling_run_blocks;   // consecutive pages read for each sample
         bool     opt_report_read_errors;
+        uint32_t opt_readahead_pages;   // pages read ahead of the threadpool; 0 = no read-ahead
+        uint32_t opt_readahead_mb;      // memory cap for the read-ahead queue
 
         void validate(){
 #if 0
@@ -77,8 +173,30 @@ private:
     static std::string minsec(time_t tsec);                      // return "5 min 10 sec" string
 
     class threadpool *tp;
+    bool    shared_tp;                  // tp belongs to a batch, not to this image
+    class scan_job *job;                // this image's units in tp
+    double  producer_wait0;             // tp's waiting times when this image started
+    std::vector<double> worker_wait0;
     void print_tp_status();
 
+    /* What the sample found; see dump_sample_estimates() */
+    block_sampler   *sampler;
+    sample_estimate data_estimate;      // fraction of each sampled run that is not one byte value
+    uint64_t        run_pages;          // pages of the current run read so far
+    uint64_t        run_data_pages;
+    uint64_t        sampled_bytes;
+    void note_sampled_page(const sbuf_t &sbuf);
+    void end_sampled_run();
+
+    /* The dispatcher takes pages from the read-ahead queue, queues them for hashing and schedules them */
+    class readahead_queue *raq;
+    pthread_t dispatcher;
+    class image_hasher *hasher;         // 0 if the image is not being hashed
+    class page_checkpoint *checkpoint;  // pages done before and by this run; may be 0
+    uint64_t pages_skipped;             // done before, per the checkpoint
+    void dispatch(sbuf_t *sbuf);
+    static void *dispatcher_run(void *arg);
+
 
 public:
     typedef std::set<std::string> seen_page_ids_t;
@@ -90,8 +208,8 @@ public:
     aftimer &timer;
     Config &config;
     u_int   notify_ctr;    /* for random sampling */
-    uint64_t total_bytes;               // 
-    md5_generator *md5g;
+    uint64_t total_bytes;               // added by the dispatcher; read with get_total_bytes()
+    uint64_t get_total_bytes() { return __sync_fetch_and_add(&total_bytes,0); }
 
     /* Get the sbuf from current image iterator location, with retries */
     sbuf_t *get_sbuf(image_process::iterator &it);
@@ -104,8 +222,8 @@ public:
 	    localtime_r(&t,&tm);
 	    printf("%2d:%02d:%02d %s ",tm.tm_hour,tm.tm_min,tm.tm_sec,it.str().c_str());
 
-	    /* not sure how to do the rest if sampling */
-	    if(!sampling()){
+	    /* not sure how to do the rest if sampling, or of a stream */
+	    if(!sampling() && it.myimage.can_seek()){
 		printf("(%4.2f%%) Done in %s at %s",
 		       it.fraction_done()*100.0,
 		       timer.eta_text(it.fraction_done()).c_str(),
@@ -140,10 +258,15 @@ public:
 #endif
 
     BulkExtractor_Phase1(dfxml_writer &xreport_,aftimer &timer_,Config &config_):
-        tp(),xreport(xreport_),timer(timer_),config(config_),notify_ctr(0),total_bytes(0),md5g(){}
+        tp(),shared_tp(false),job(),producer_wait0(0),worker_wait0(),sampler(),data_estimate(),run_pages(0),run_data_pages(0),sampled_bytes(0),
+        raq(),dispatcher(),hasher(),checkpoint(),pages_skipped(0),
+        xreport(xreport_),timer(timer_),config(config_),notify_ctr(0),total_bytes(0){}
 
+    void set_threadpool(class threadpool *tp_){tp=tp_;shared_tp=true;} // scan with a batch's pool
+    void set_checkpoint(class page_checkpoint *cp){checkpoint=cp;}
     void run(image_process &p,feature_recorder_set &fs, seen_page_ids_t &seen_page_ids);
     void wait_for_workers(image_process &p,std::string *md5_string);
+    void dump_sample_estimates(image_process &p,feature_recorder_set &fs,const feature_file_names_t &names);
 };
 
 #endif
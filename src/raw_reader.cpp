@@ -0,0 +1,234 @@
+/*
+ * raw_reader.cpp:
+ * Keep many reads of an image in flight, with io_uring when we have it
+ * and with a few reader threads when we don't.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "image_process.h"
+#include "raw_reader.h"
+
+#include <sys/time.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/****************************************************************
+ *** THREADS
+ ****************************************************************/
+
+raw_reader_threads::raw_reader_threads(const image_process &img_,uint32_t nthreads):
+    img(img_),M(),WORK(),DONE(),queue(),threads(),stopping(false)
+{
+    if(pthread_mutex_init(&M,NULL))     errx(1,"pthread_mutex_init failed");
+    if(pthread_cond_init(&WORK,NULL))   errx(1,"pthread_cond_init failed");
+    if(pthread_cond_init(&DONE,NULL))   errx(1,"pthread_cond_init failed");
+    for(uint32_t i=0;i<nthreads;i++){
+        pthread_t t;
+        if(pthread_create(&t,NULL,run,(void *)this)) errx(1,"cannot create reader thread");
+        threads.push_back(t);
+    }
+}
+
+raw_reader_threads::~raw_reader_threads()
+{
+    pthread_mutex_lock(&M);
+    stopping = true;
+    pthread_cond_broadcast(&WORK);
+    pthread_mutex_unlock(&M);
+    for(std::vector<pthread_t>::const_iterator it=threads.begin();it!=threads.end();it++){
+        pthread_join(*it,NULL);
+    }
+    pthread_mutex_destroy(&M);
+    pthread_cond_destroy(&WORK);
+    pthread_cond_destroy(&DONE);
+}
+
+void *raw_reader_threads::run(void *arg)
+{
+    raw_reader_threads &self = *(raw_reader_threads *)arg;
+    pthread_mutex_lock(&self.M);
+    while(true){
+        while(self.queue.empty() && !self.stopping){
+            pthread_cond_wait(&self.WORK,&self.M);
+        }
+        if(self.queue.empty()) break;   // stopping
+        raw_request *r = self.queue.front();
+        self.queue.pop_front();
+        pthread_mutex_unlock(&self.M);
+
+        int count = self.img.pread(r->buf,r->want,r->offset); // accounts for itself
+
+        pthread_mutex_lock(&self.M);
+        if(count<0) r->error = true;
+        else r->got = count;
+        r->done = true;
+        pthread_cond_broadcast(&self.DONE);
+    }
+    pthread_mutex_unlock(&self.M);
+    return 0;
+}
+
+void raw_reader_threads::submit(raw_request *r)
+{
+    pthread_mutex_lock(&M);
+    queue.push_back(r);
+    pthread_cond_signal(&WORK);
+    pthread_mutex_unlock(&M);
+}
+
+void raw_reader_threads::wait(raw_request *r)
+{
+    pthread_mutex_lock(&M);
+    while(!r->done){
+        pthread_cond_wait(&DONE,&M);
+    }
+    pthread_mutex_unlock(&M);
+}
+
+/****************************************************************
+ *** IO_URING
+ ****************************************************************/
+
+#ifdef HAVE_LIBURING
+/*
+ * A request becomes one read per file that it touches. A short read is
+ * resubmitted for the rest, so a request is only short at end of file,
+ * and a read that was interrupted (-EINTR or -EAGAIN) is resubmitted whole.
+ * Completions are reaped in whatever order they arrive, whichever request
+ * is being waited for.
+ */
+class raw_reader_uring : public raw_reader {
+    /*** neither copying nor assignment is implemented ***/
+    raw_reader_uring(const raw_reader_uring &);
+    raw_reader_uring &operator=(const raw_reader_uring &);
+
+    class segment {
+    public:
+        segment(raw_request *r_,int fd_,int64_t file_offset_,size_t pos_,size_t len_):
+            r(r_),fd(fd_),file_offset(file_offset_),first(pos_),pos(pos_),len(len_),start(now()){}
+        raw_request *r;
+        int      fd;
+        int64_t  file_offset;
+        size_t   first;                 // where in r->buf the segment starts; its file is released by it
+        size_t   pos;                   // where in r->buf the rest starts
+        size_t   len;
+        double   start;
+    };
+    const process_raw &img;
+    struct io_uring ring;
+    void queue_read(segment *s);
+    void reap();                        // wait for one completion
+public:
+    bool ok;
+    raw_reader_uring(const process_raw &img_,uint32_t depth):img(img_),ring(),ok(false){
+        /* two files per request at most, unless the files are smaller than a page */
+        ok = io_uring_queue_init(depth*2,&ring,0)==0;
+    }
+    virtual ~raw_reader_uring(){
+        if(ok) io_uring_queue_exit(&ring);
+    }
+    virtual void submit(raw_request *r);
+    virtual void wait(raw_request *r);
+    virtual const char *name() const { return "io_uring"; }
+};
+
+void raw_reader_uring::queue_read(segment *s)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    while(sqe==0){                      // the submission queue is full
+        io_uring_submit(&ring);
+        reap();
+        sqe = io_uring_get_sqe(&ring);
+    }
+    io_uring_prep_read(sqe,s->fd,s->r->buf+s->pos,s->len,s->file_offset);
+    io_uring_sqe_set_data(sqe,s);
+    s->r->pending++;
+}
+
+void raw_reader_uring::submit(raw_request *r)
+{
+    size_t pos = 0;
+    while(pos < r->want){
+        int fd = -1;
+        int64_t file_offset = 0;
+        size_t avail = 0;
+        if(!img.segment(r->offset+pos,&fd,&file_offset,&avail)){
+            r->error = true;
+            break;
+        }
+        size_t len = r->want - pos;
+        if(len > avail) len = avail;
+        queue_read(new segment(r,fd,file_offset,pos,len));
+        pos += len;
+    }
+    if(r->pending==0) r->done = true;
+    io_uring_submit(&ring);
+}
+
+void raw_reader_uring::reap()
+{
+    struct io_uring_cqe *cqe = 0;
+    int ret = io_uring_wait_cqe(&ring,&cqe);
+    while(ret==-EINTR) ret = io_uring_wait_cqe(&ring,&cqe);
+    if(ret<0) errx(1,"io_uring_wait_cqe: %s",strerror(-ret));
+    segment *s = (segment *)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&ring,cqe);
+
+    raw_request *r = s->r;
+    r->pending--;
+    if(res==-EINTR || res==-EAGAIN){    // nothing was read; try again
+        queue_read(s);
+        io_uring_submit(&ring);
+        return;
+    }
+    if(res<=0){
+        r->error = true;                // failed, or the file is shorter than it was
+    } else {
+        img.account(r->offset+s->pos,res,s->start,now());
+        r->got += res;
+        if((size_t)res < s->len){       // short read; ask for the rest
+            s->file_offset += res;
+            s->pos += res;
+            s->len -= res;
+            s->start = now();
+            queue_read(s);
+            io_uring_submit(&ring);
+            return;
+        }
+    }
+    img.release_segment(r->offset+s->first); // the file may be closed now
+    delete s;
+    if(r->pending==0) r->done = true;
+}
+
+void raw_reader_uring::wait(raw_request *r)
+{
+    while(!r->done){
+        reap();
+    }
+}
+#endif
+
+raw_reader *raw_reader::create(const image_process &img,uint32_t depth)
+{
+#ifdef HAVE_LIBURING
+    const process_raw *raw = dynamic_cast<const process_raw *>(&img);
+    if(raw){
+        raw_reader_uring *ru = new raw_reader_uring(*raw,depth);
+        if(ru->ok) return ru;
+        delete ru;                      // no io_uring in this kernel
+    }
+#endif
+    return new raw_reader_threads(img,depth);
+}
@@ -0,0 +1,74 @@
+#ifndef _RAW_READER_H_
+#define _RAW_READER_H_
+
+/**
+ * \file
+ * raw_reader keeps many page reads in flight for process_raw, and many
+ * page decompressions in flight for process_ewf.
+ *
+ * The image asks for each page some time before it is needed. A read
+ * is a raw_request: a buffer, an image offset and a byte count, which
+ * may span several files of a split image. Two readers are provided:
+ *
+ * raw_reader_uring   - submits every read to an io_uring and reaps the
+ *                      completions when they are waited for. Raw images only.
+ * raw_reader_threads - a few threads that each make blocking
+ *                      image_process::pread() calls.
+ *
+ * raw_reader::create() returns the io_uring reader for a raw image if
+ * bulk_extractor was built with liburing and the kernel supports it, and
+ * the threads otherwise. submit() and wait() are only called with the
+ * image's reader lock held.
+ */
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+class raw_request {
+    /*** neither copying nor assignment is implemented ***/
+    raw_request(const raw_request &);
+    raw_request &operator=(const raw_request &);
+public:
+    raw_request(int64_t offset_,uint8_t *buf_,size_t size_,size_t want_):
+        offset(offset_),buf(buf_),size(size_),want(want_),got(0),pending(0),error(false),done(false){}
+    int64_t  offset;                    // where in the image
+    uint8_t  *buf;                      // from the buffer_pool; handed to the sbuf when the page is made
+    size_t   size;                      // bytes allocated for buf
+    size_t   want;                      // bytes to read
+    size_t   got;                       // bytes read
+    int      pending;                   // io_uring reads not yet completed
+    bool     error;                     // a read failed or came up short
+    bool     done;
+};
+
+class raw_reader {
+public:
+    virtual ~raw_reader(){}
+    virtual void submit(raw_request *r)=0; // start reading; never blocks for long
+    virtual void wait(raw_request *r)=0;   // return when r is done
+    virtual const char *name() const=0;
+    static raw_reader *create(const class image_process &img,uint32_t depth);
+};
+
+class raw_reader_threads : public raw_reader {
+    /*** neither copying nor assignment is implemented ***/
+    raw_reader_threads(const raw_reader_threads &);
+    raw_reader_threads &operator=(const raw_reader_threads &);
+    const class image_process &img;
+    pthread_mutex_t M;
+    pthread_cond_t  WORK;               // a request was queued
+    pthread_cond_t  DONE;               // a request finished
+    std::deque<raw_request *> queue;
+    std::vector<pthread_t> threads;
+    bool            stopping;
+    static void *run(void *arg);
+public:
+    raw_reader_threads(const class image_process &img_,uint32_t nthreads);
+    virtual ~raw_reader_threads();
+    virtual void submit(raw_request *r);
+    virtual void wait(raw_request *r);
+    virtual const char *name() const { return "threads"; }
+};
+
+#endif
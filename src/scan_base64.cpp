@@ -3,6 +3,7 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
 #include "base64_forensic.h"
+#include "page_classifier.h"
 
 static const uint32_t B64_LOWERCASE=1;
 static const uint32_t B64_UPPERCASE=2;
@@ -140,6 +141,7 @@ void scan_base64(const class scanner_params &sp,const recursion_control_block &r
     }
     if(sp.phase==scanner_params::PHASE_SHUTDOWN) return;
     if(sp.phase==scanner_params::PHASE_SCAN){
+        if(page_classifier::gate(sp,rcb,scan_base64,"base64",page_classifier::TEXT|page_classifier::BINARY)) return;
 	const sbuf_t &sbuf = sp.sbuf;
 
 
@@ -7,6 +7,7 @@
 
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "magic_prefilter.h"
 
 /* tunable constants */
 u_int sht_null_counter_max = 10;
@@ -807,7 +808,8 @@ void scan_elf (const class scanner_params          &sp,
 
 	feature_recorder *f = sp.fs.get_name("elf");
     
-	for (size_t pos = 0; pos < sp.sbuf.bufsize; pos++) {
+	size_t pos = 0;
+	for (magic_cursor c(sp.sbuf,magic_prefilter::ELF,sp.sbuf.bufsize); c.next(pos);) {
 	    // Look for the magic number
 	    // If we find it, make an sbuf and analyze...
 	    if ( (sp.sbuf[pos+0] == 0x7f)
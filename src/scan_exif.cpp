@@ -12,6 +12,7 @@
 #include "be13_api/utils.h"
 
 #include "dfxml/src/dfxml_writer.h"
+#include "magic_prefilter.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -608,7 +609,9 @@ public:
         size_t limit = (sbuf.pagesize > sbuf.bufsize + MIN_JPEG_SIZE) ?
                            sbuf.bufsize : sbuf.pagesize - MIN_JPEG_SIZE;
 
-	for (size_t start=0; start < limit; start++) {
+	size_t start = 0;
+	for (magic_cursor c(sbuf,magic_prefilter::JPEG|magic_prefilter::PSD|magic_prefilter::TIFF,limit);
+             c.next(start);) {
             // check for start of a JPEG
 	    if (sbuf[start + 0] == 0xff &&
                 sbuf[start + 1] == 0xd8 &&
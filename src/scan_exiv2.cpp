@@ -10,6 +10,7 @@
 #include "be13_api/utils.h"
 
 #include "dfxml/src/dfxml_writer.h"
+#include "magic_prefilter.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -132,8 +133,9 @@ void scan_exiv2(const class scanner_params &sp,const recursion_control_block &rc
 	    pos_max = sbuf.bufsize - min_exif_size; //  we can scan more!
 	}
     
-	/* Loop through all possible locations in the buffer */
-	for(size_t pos=0;pos<pos_max;pos++){
+	/* Loop through the 512-byte boundaries and the JPEGs in the buffer */
+	size_t pos = 0;
+	for(magic_cursor c(sbuf,magic_prefilter::JPEG,pos_max,512);c.next(pos);){
 	    size_t count = exif_gulp_size;
 	    count = min(count,sbuf.bufsize-pos);
 	    //size_t count = sbuf.bufsize-pos; // use all to end
@@ -8,6 +8,7 @@
 
 #include "bulk_extractor.h" // for regex_list type
 #include "findopts.h"
+#include "page_classifier.h"
 
 using namespace std;
 
@@ -57,7 +58,10 @@ void scan_find(const class scanner_params &sp,const recursion_control_block &rcb
     }
     if(sp.phase==scanner_params::PHASE_SHUTDOWN) return;
 
-    if (scanner_params::PHASE_INIT == sp.phase) {
+    /* the patterns are global, so they are only added for the first image of a batch */
+    static bool patterns_added = false;
+    if (scanner_params::PHASE_INIT == sp.phase && !patterns_added) {
+        patterns_added = true;
         for (vector<string>::const_iterator itr(FindOpts::get().Patterns.begin()); itr != FindOpts::get().Patterns.end(); ++itr) {
             add_find_pattern(*itr);
         }
@@ -67,6 +71,8 @@ void scan_find(const class scanner_params &sp,const recursion_control_block &rcb
     }
 
     if(sp.phase==scanner_params::PHASE_SCAN) {
+        if(page_classifier::gate(sp,rcb,scan_find,"find",page_classifier::TEXT|page_classifier::BINARY)) return;
+
         /* The current regex library treats \0 as the end of a string.
          * So we make a copy of the current buffer to search that's one bigger, and the copy has a \0 at the end.
          */
@@ -1,5 +1,9 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "magic_prefilter.h"
+#include "child_memo.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -45,9 +49,10 @@ void scan_gzip(const class scanner_params &sp,const recursion_control_block &rcb
 	const sbuf_t &sbuf = sp.sbuf;
 	const pos0_t &pos0 = sp.sbuf.pos0;
 
-	for(const unsigned char *cc=sbuf.buf ;
-	    cc < sbuf.buf+sbuf.pagesize && cc < sbuf.buf+sbuf.bufsize-4 ;
-	    cc++){
+	const size_t end = sbuf.bufsize>4 ? min(sbuf.pagesize,sbuf.bufsize-4) : 0;
+	size_t i = 0;
+	for(magic_cursor c(sbuf,magic_prefilter::GZIP,end);c.next(i);){
+	    const unsigned char *cc = sbuf.buf+i;
 	    /** Look for the signature for beginning of a GZIP file.
 	     * See zlib.h and RFC1952
 	     * http://www.15seconds.com/Issue/020314.htm
@@ -55,7 +60,11 @@ void scan_gzip(const class scanner_params &sp,const recursion_control_block &rcb
 	     */
 	    if(cc[0]==0x1f && cc[1]==0x8b && cc[2]==0x08){ // gzip HTTP flag
 		u_int compr_size = sbuf.bufsize - (cc-sbuf.buf); // up to the end of the buffer 
-                managed_malloc<u_char>decompress(gzip_max_uncompr_size);
+		const ssize_t pos = cc-sbuf.buf;
+		const pos0_t pos0_gzip = (pos0 + pos) + rcb.partName;
+		child_memo memo(sp,"gzip",cc,compr_size,gzip_max_uncompr_size);
+		if(memo.replay(pos0_gzip)) continue;
+                pooled_malloc<u_char>decompress(gzip_max_uncompr_size);
 		if(decompress.buf){
 		    z_stream zs;
 		    memset(&zs,0,sizeof(zs));
@@ -70,16 +79,17 @@ void scan_gzip(const class scanner_params &sp,const recursion_control_block &rcb
 
 		    int r = inflateInit2(&zs,16+MAX_WBITS);
 		    if(r==0){
+			child_memo::capture capture(memo,pos0_gzip);
 			r = inflate(&zs,Z_SYNC_FLUSH);
 			/* Ignore the error code; process data if we got any */
 			if(zs.total_out>0){	
 			    /* run decompress.buf through the recognizer.
 			     */
-			    const ssize_t pos = cc-sbuf.buf;
-			    const pos0_t pos0_gzip = (pos0 + pos) + rcb.partName;
 			    const sbuf_t sbuf_new(pos0_gzip,decompress.buf,zs.total_out,zs.total_out,false);
-			    (*rcb.callback)(scanner_params(sp,sbuf_new)); // recurse
+			    threadpool::recurse(sp,rcb,sbuf_new,&decompress); // recurse; the buffer is not used again
 			}
+			/* A stream that ran out of input might have gone on */
+			capture.commit(zs.total_in,r!=Z_STREAM_END && zs.avail_out>0 && zs.avail_in==0,zs.total_out);
 			r = inflateEnd(&zs);
 		    }
 		}
@@ -66,6 +66,10 @@ typedef md5_generator hash_generator;
 // hashdb manager
 static hashdb_t* hashdb;
 
+// images of a batch (-L) that have initialized but not shut down;
+// the hashdb is opened by the first and closed by the last
+static int hashdb_users = 0;
+
 static void do_import(const class scanner_params &sp,
                       const recursion_control_block &rcb);
 static void do_scan(const class scanner_params &sp,
@@ -338,6 +342,11 @@ void scan_hashdb(const class scanner_params &sp,
             // hashdb_import_max_duplicates
             // checks not performed
 
+            // already open for an earlier image of the batch
+            if (hashdb_users++ > 0) {
+                return;
+            }
+
             // indicate hashdb version
             std::cout << "hashdb: hashdb_version=" << hashdb_version() << "\n";
 
@@ -419,7 +428,10 @@ void scan_hashdb(const class scanner_params &sp,
 
         // shutdown
         case scanner_params::PHASE_SHUTDOWN: {
-            delete hashdb;
+            if (--hashdb_users == 0) {
+                delete hashdb;
+                hashdb = 0;
+            }
             return;
         }
 
@@ -1,6 +1,10 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
 #include "image_process.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "magic_prefilter.h"
+#include "child_memo.h"
 #include "pyxpress.h"
 
 
@@ -59,9 +63,10 @@ void scan_hiberfile(const class scanner_params &sp,const recursion_control_block
 	}
 
 
-	for(const unsigned char *cc=sbuf.buf ;
-	    cc < sbuf.buf + sbuf.pagesize && cc<sbuf.buf+sbuf.bufsize-38 ;
-	    cc++){
+	const size_t end = sbuf.bufsize>38 ? min(sbuf.pagesize,sbuf.bufsize-38) : 0;
+	size_t i = 0;
+	for(magic_cursor c(sbuf,magic_prefilter::HIBERFILE,end);c.next(i);){
+	    const unsigned char *cc = sbuf.buf+i;
 
 	    /**
 	     * http://www.pyflag.net/pyflag/src/lib/pyxpress.c
@@ -79,15 +84,19 @@ void scan_hiberfile(const class scanner_params &sp,const recursion_control_block
                     max_uncompr_size_=min_uncompr_size; // it should at least be this large!
                 }
 
-		managed_malloc<u_char>decomp(max_uncompr_size_);
+		const ssize_t pos = cc-sbuf.buf;
+		const pos0_t pos0_hiber = (pos0 + pos) + rcb.partName;
+		child_memo memo(sp,"hiberfile",compressed_buf,compr_size,0);
+		if(memo.replay(pos0_hiber)) continue;
+		child_memo::capture capture(memo,pos0_hiber);
+
+		pooled_malloc<u_char>decomp(max_uncompr_size_);
 
 
 		int decompress_size = Xpress_Decompress(compressed_buf,compr_size,
 							decomp.buf,max_uncompr_size_);
 
 		if(decompress_size>0){
-		    const ssize_t pos = cc-sbuf.buf;
-		    const pos0_t pos0_hiber = (pos0 + pos) + rcb.partName;
 		    const sbuf_t sbuf_new(pos0_hiber,decomp.buf,decompress_size,decompress_size,false);
 
                     /* sbuf_new is an sbuf that may extend over multiple pages.
@@ -98,9 +107,11 @@ void scan_hiberfile(const class scanner_params &sp,const recursion_control_block
                      */
                     for(size_t start = 0; start < sbuf_new.bufsize; start += windows_page_size){
                         const sbuf_t sbuf2(sbuf_new,start,windows_page_size);
-                        (*rcb.callback)(scanner_params(sp,sbuf2)); // recurse
+                        threadpool::recurse(sp,rcb,sbuf2); // recurse
                     }
 		}
+		/* The output buffer is sized from compr_size, so only the same length will do */
+		capture.commit(compr_size,true,decompress_size>0 ? decompress_size : 0);
 	    }
 	}
     }
@@ -30,6 +30,7 @@ SOFTWARE.
 
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "page_classifier.h"
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -459,6 +460,7 @@ void scan_json(const class scanner_params &sp,const recursion_control_block &rcb
 
     if(sp.phase==scanner_params::PHASE_SHUTDOWN) return;
     if(sp.phase==scanner_params::PHASE_SCAN){
+        if(page_classifier::gate(sp,rcb,scan_json,"json",page_classifier::TEXT|page_classifier::BINARY)) return;
 
 	for(size_t pos = 0;pos+1<sbuf.pagesize;pos++){
 	    /* Find the beginning of a json object. This will improve later... */
@@ -73,8 +73,11 @@ void scan_lightgrep(const class scanner_params &sp, const recursion_control_bloc
     break;
   case scanner_params::PHASE_INIT:
     {
-      Scanner.init(sp);
       LightgrepController& lg(LightgrepController::Get());
+      if (lg.compiled()) {
+        break;                  // an earlier image of a batch (-L) compiled the patterns
+      }
+      Scanner.init(sp);
       lg.addUserPatterns(Scanner, &ProcessHit, FindOpts::get());
       lg.regcomp();
       break;
@@ -83,8 +86,7 @@ void scan_lightgrep(const class scanner_params &sp, const recursion_control_bloc
     LightgrepController::Get().scan(sp, rcb);
     break;
   case scanner_params::PHASE_SHUTDOWN:
-    Scanner.shutdown(sp);
-    break;
+    break;                      // ~LightgrepController() releases the handlers
   default:
     break;
   }
@@ -26,6 +26,7 @@
 #include "be13_api/cppmutex.h"
 #include "be13_api/utils.h"
 
+#include <map>
 #include <set>
 //#include <tr1/unordered_set>
 
@@ -62,8 +63,9 @@ const uint32_t min_packet_size = 20;		// don't bother with ethernet packets smal
 /* mutex for writing packets.
  * This is not in the class because it will be accessed by multiple threads.
  */
-static cppmutex Mfcap;              // mutex for fcap
-static FILE *fcap = 0;		// capture file, protected by M
+static cppmutex Mfcap;              // mutex for fcaps
+typedef std::map<std::string,FILE *> fcap_map_t;
+static fcap_map_t fcaps;	// capture file for each output directory, protected by Mfcap
 static bool carve_net_memory = false;
 
 /****************************************************************/
@@ -599,7 +601,7 @@ static bool   likely_valid_pcap_header(const sbuf_t &sbuf,struct pcap_hdr &h)
  */
 class packet_carver {
 private:
-    packet_carver(const packet_carver &pc):fs(pc.fs),/*ps(pc.ps),*/ip_recorder(pc.ip_recorder),tcp_recorder(pc.tcp_recorder),ether_recorder(pc.ether_recorder){
+    packet_carver(const packet_carver &pc):fs(pc.fs),/*ps(pc.ps),*/ip_recorder(pc.ip_recorder),tcp_recorder(pc.tcp_recorder),ether_recorder(pc.ether_recorder),fcap(pc.fcap){
     }
     packet_carver &operator=(const packet_carver &that){
 	return *this;			// no-op
@@ -611,9 +613,10 @@ public:
     feature_recorder *ip_recorder;
     feature_recorder *tcp_recorder;
     feature_recorder *ether_recorder;
+    FILE *fcap;				// this output directory's capture file
 
     packet_carver(const class scanner_params &sp):
-	fs(sp.fs),/*ps(),*/ip_recorder(0),tcp_recorder(0),ether_recorder(0){
+	fs(sp.fs),/*ps(),*/ip_recorder(0),tcp_recorder(0),ether_recorder(0),fcap(0){
 	ip_recorder = fs.get_name("ip");
 	ether_recorder = fs.get_name("ether");
 	if(carve_net_memory){
@@ -657,9 +660,11 @@ public:
                        const uint16_t frame_type) {
 	// Make sure that neither this packet nor an encapsulated version of this packet has been written
 	cppmutex::lock lock(Mfcap);		// lock the mutex
+        if(fcap==0) fcap = fcaps[ip_recorder->get_outdir()];
         if(fcap==0){
             std::string ofn = ip_recorder->get_outdir() + "/" + default_filename;
             fcap = fopen(ofn.c_str(),"wb"); // write the output
+            fcaps[ip_recorder->get_outdir()] = fcap;
             pcap_write4(0xa1b2c3d4);
             pcap_write2(2);			// major version number
             pcap_write2(4);			// minor version number
@@ -1052,7 +1057,11 @@ void scan_net(const class scanner_params &sp,const recursion_control_block &rcb)
     }
     if(sp.phase==scanner_params::PHASE_SHUTDOWN){
 	cppmutex::lock lock(Mfcap);
-	if(fcap) fclose(fcap);
+	fcap_map_t::iterator it = fcaps.find(sp.fs.get_outdir());
+	if(it!=fcaps.end()){
+	    if(it->second) fclose(it->second);
+	    fcaps.erase(it);
+	}
 	return;
     }
 }
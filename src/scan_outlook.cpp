@@ -5,6 +5,7 @@
  */
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "buffer_pool.h"
 #include "utils.h"
 
 /*
@@ -74,8 +75,8 @@ void scan_outlook(const class scanner_params &sp,const recursion_control_block &
             return;
         }
 
-        // managed_malloc throws an exception if allocation fails.
-        managed_malloc<uint8_t>dbuf(sbuf.bufsize);
+        // pooled_malloc throws an exception if allocation fails.
+        pooled_malloc<uint8_t>dbuf(sbuf.bufsize);
         for(size_t ii = 0; ii < sbuf.bufsize; ii++) {
             uint8_t ch = sbuf.buf[ii];
             dbuf.buf[ii] = libpff_encryption_compressible[ ch ];
@@ -7,6 +7,9 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
 #include "image_process.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "child_memo.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -110,7 +113,10 @@ inline int analyze_stream(const class scanner_params &sp,const recursion_control
     const sbuf_t &sbuf = sp.sbuf;
     size_t compr_size = endstream-stream_start;
     size_t uncompr_size = compr_size * 8;       // good assumption for expansion
-    managed_malloc<Bytef>decomp(uncompr_size);
+    const pos0_t pos0_pdf = (sbuf.pos0 + stream_tag) + rcb.partName;
+    child_memo memo(sp,"pdf",sbuf.buf+stream_start,compr_size,0);
+    if(!pdf_dump && memo.replay(pos0_pdf)) return 0;
+    pooled_malloc<Bytef>decomp(uncompr_size);
     if(decomp.buf){
         z_stream zs;
         memset(&zs,0,sizeof(zs));
@@ -120,6 +126,7 @@ inline int analyze_stream(const class scanner_params &sp,const recursion_control
         zs.avail_out = uncompr_size;
         int r = inflateInit(&zs);
         if(r==Z_OK){
+            child_memo::capture capture(memo,pos0_pdf);
             r = inflate(&zs,Z_FINISH);
             if(zs.total_out>0){
                 sbuf_t dbuf(sbuf.pos0 + "-PDFDECOMP",
@@ -134,10 +141,9 @@ inline int analyze_stream(const class scanner_params &sp,const recursion_control
                     std::string text;
                     pdf_extract_text(text,decomp.buf,zs.total_out);
                     if(text.size()>0){
-                        pos0_t pos0_pdf    = (sbuf.pos0 + stream_tag) + rcb.partName;
                         const  sbuf_t sbuf_new(pos0_pdf, reinterpret_cast<const uint8_t *>(&text[0]),
                                                text.size(),text.size(),false);
-                        (*rcb.callback)(scanner_params(sp,sbuf_new));
+                        threadpool::recurse(sp,rcb,sbuf_new);
                     }
                     if(pdf_dump) std::cout << "Extracted Text:\n" << text << "\n";
                 }
@@ -145,6 +151,7 @@ inline int analyze_stream(const class scanner_params &sp,const recursion_control
                     std::cout << "================\n";
                 }
             }
+            capture.commit(compr_size,true,zs.total_out); // the output buffer depends on compr_size
             inflateEnd(&zs);            // prevent leak; still not exception safe.
         }
     }
@@ -2,6 +2,10 @@
 
 
 #include "be13_api/bulk_extractor_i.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "magic_prefilter.h"
+#include "child_memo.h"
 #include "utf8.h"
 #include "dfxml/src/dfxml_writer.h"
 
@@ -633,7 +637,9 @@ void scan_rar(const class scanner_params &sp,const recursion_control_block &rcb)
 
         RarComponentInfo component;
         RarVolumeInfo volume;
-	for(const unsigned char *cc=sbuf.buf; cc < sbuf.buf+sbuf.pagesize && cc < sbuf.buf + sbuf.bufsize; cc++) {
+        size_t at = 0;
+	for(magic_cursor c(sbuf,magic_prefilter::RAR,min(sbuf.pagesize,sbuf.bufsize)); c.next(at);) {
+            const unsigned char *cc = sbuf.buf + at;
             size_t cc_len = sbuf.buf + sbuf.bufsize - cc;
             // feature files have three columns: forensic path / offset,
             // feature name, and feature context.  scan_zip is mimicked by
@@ -663,17 +669,28 @@ void scan_rar(const class scanner_params &sp,const recursion_control_block &rcb)
                 // only decompress and recur if the component compression isn't
                 // no-op to avoid duplicate features
                 if(component.compression_method != METHOD_UNCOMPRESSED) {
-                    managed_malloc<uint8_t>dbuf(component.uncompressed_size);
+                    /* The component is its header and the packed data after it */
+                    const size_t component_len = min(cc_len,(size_t)(uint16_t)int2(cc + OFFSET_HEAD_SIZE) + (size_t)component.compressed_size);
+                    const pos0_t pos0_rar = (pos0 + pos) + rcb.partName;
+                    /* When carving encoded, carve() skips a component whose only encoding is this RAR */
+                    const bool carving = unrar_carve_mode==feature_recorder::CARVE_ALL
+                        || (unrar_carve_mode==feature_recorder::CARVE_ENCODED && pos0_rar.alphaPart()!="RAR");
+                    child_memo memo(sp, "rar", cc, cc_len, carving);
+                    if(!carving && memo.replay(pos0_rar)) continue; // a hit would not carve
+
+                    pooled_malloc<uint8_t>dbuf(component.uncompressed_size);
                     memset(dbuf.buf, 0x00, component.uncompressed_size);
 
                     unpack_buf(cc, cc_len, dbuf.buf, component.uncompressed_size);
 
                     /* Create a child sbuf with the updated pos0 for recursive processing */
-                    const pos0_t pos0_rar = (pos0 + pos) + rcb.partName;
                     {
                         const sbuf_t child_sbuf(pos0_rar, dbuf.buf, component.uncompressed_size, component.uncompressed_size, false);
-                        scanner_params child_params(sp, child_sbuf);
-                        (*rcb.callback)(child_params);
+                        {
+                            child_memo::capture capture(memo, pos0_rar);
+                            threadpool::recurse(sp, rcb, child_sbuf);
+                            capture.commit(component_len, false, component.uncompressed_size);
+                        }
 
                         std::string carve_name("_");
                         carve_name += component.name;
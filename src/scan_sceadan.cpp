@@ -74,12 +74,14 @@ void scan_sceadan(const class scanner_params &sp, const recursion_control_block
 
     if(sp.phase==scanner_params::PHASE_INIT){
 #ifdef USE_SCEADAN
-        s = sceadan_open(sceadan_model_file.c_str(),sceadan_class_file.c_str(),sceadan_mask_file.c_str());
-        if(!s){
-            std::cerr << "Cannot open sceadan classifier\n";
-            exit(1);
+        if(!s){                         // opened once for all the images of a batch
+            s = sceadan_open(sceadan_model_file.c_str(),sceadan_class_file.c_str(),sceadan_mask_file.c_str());
+            if(!s){
+                std::cerr << "Cannot open sceadan classifier\n";
+                exit(1);
+            }
+            sceadan_set_ngram_mode(s,sceadan_ngram_mode);
         }
-        sceadan_set_ngram_mode(s,sceadan_ngram_mode);
         feature_recorder *sceadanfs = sp.fs.get_name("sceadan");
         sceadanfs->set_flag(feature_recorder::FLAG_NO_FEATURES);
         sceadanfs->enable_memory_histograms(); // is this really how they are enabled?
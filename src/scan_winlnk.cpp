@@ -20,6 +20,7 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
 #include "be13_api/unicode_escape.h"
+#include "magic_prefilter.h"
 
 #if defined(HAVE_LIBLNK_H) && defined(HAVE_LIBBFIO_H) && defined(HAVE_LIBLNK) && defined(HAVE_LIBBFIO)
 #include "liblnk.h"
@@ -39,6 +40,7 @@
 #include <errno.h>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 
 #include "utf8.h"
 #include "dfxml/src/dfxml_writer.h"
@@ -320,7 +322,10 @@ void scan_winlnk(const class scanner_params &sp,const recursion_control_block &r
             return;
         }
 
-        for (size_t p=0;(p < sbuf.pagesize) &&  (p + SMALLEST_LNK_FILE < sbuf.bufsize ); p++){
+        const size_t end = sbuf.bufsize > SMALLEST_LNK_FILE ?
+            std::min(sbuf.pagesize,sbuf.bufsize - SMALLEST_LNK_FILE) : 0;
+        size_t p = 0;
+        for (magic_cursor c(sbuf,magic_prefilter::LNK,end); c.next(p);){
 
             // look for Shell Link (.LNK) binary file format magic number
             if ( sbuf.get32u(p+0x00) == 0x0000004c &&      // header size
@@ -22,6 +22,7 @@
 
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "magic_prefilter.h"
 
 #include <iostream>
 #include <fstream>
@@ -272,7 +273,8 @@ void scan_winprefetch(const class scanner_params &sp,const recursion_control_blo
                          sbuf.bufsize : sbuf.pagesize - 8;
 
 	// iterate through sbuf searching for winprefetch features
-	for (size_t start=0; start < stop; start++) {
+	size_t start = 0;
+	for (magic_cursor c(sbuf,magic_prefilter::PREFETCH,stop); c.next(start);) {
 
 	    // check for probable WindowsXP or Windows7 header
 	    if ((sbuf[start + 0] == 0x11 || sbuf[start + 0] == 0x17)
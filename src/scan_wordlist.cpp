@@ -1,10 +1,12 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
 #include "utils.h"
+#include "page_classifier.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <map>
 
 static uint32_t word_min = 6;
 static uint32_t word_max = 14;
@@ -37,7 +39,10 @@ static const char *schema_wordlist[] = {
     "CREATE UNIQUE INDEX wordlist_i on wordlist(word)",
     0};
 static const char *insert_statement = "INSERT OR IGNORE INTO wordlist VALUES (?);";
-static feature_recorder::besql_stmt *wordlist_stmt=0;
+/* one insert statement for each database, as a batch (-L) has one for each image */
+typedef std::map<const void *,feature_recorder::besql_stmt *> wordlist_stmt_map_t;
+static wordlist_stmt_map_t wordlist_stmts;
+static cppmutex Mwordlist_stmts;
 static const char *select_statement = "SELECT DISTINCT word FROM wordlist ORDER BY length(word),word";
 #endif
 
@@ -175,7 +180,8 @@ void scan_wordlist(const class scanner_params &sp,const recursion_control_block
 #ifdef USE_SQLITE3
         if (fs.db3) {
             fs.db_send_sql(fs.db3,schema_wordlist);
-            wordlist_stmt = new feature_recorder::besql_stmt(fs.db3,insert_statement);
+            cppmutex::lock lock(Mwordlist_stmts);
+            wordlist_stmts[fs.db3] = new feature_recorder::besql_stmt(fs.db3,insert_statement);
             return;
         }
 #endif
@@ -202,7 +208,15 @@ void scan_wordlist(const class scanner_params &sp,const recursion_control_block
 
     /* multi-threaded! */
     if(sp.phase==scanner_params::PHASE_SCAN){
+        if(page_classifier::gate(sp,rcb,scan_wordlist,WORDLIST,page_classifier::TEXT|page_classifier::BINARY)) return;
 	const sbuf_t &sbuf = sp.sbuf;
+#ifdef USE_SQLITE3
+        feature_recorder::besql_stmt *wordlist_stmt = 0;
+        if (wordlist_recorder==0 && fs.db3) {
+            cppmutex::lock lock(Mwordlist_stmts);
+            wordlist_stmt = wordlist_stmts[fs.db3];
+        }
+#endif
 
 	/* Look for words in the buffer. Runs a finite state machine.
 	 * for each character in the buffer. There are only two
@@ -5,6 +5,9 @@
  */
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "child_memo.h"
 #include "utils.h"
 
 static uint8_t xor_mask = 255;
@@ -45,18 +48,23 @@ void scan_xor(const class scanner_params &sp,const recursion_control_block &rcb)
             }
         }
 
-        // managed_malloc throws an exception if allocation fails.
-        managed_malloc<uint8_t>dbuf(sbuf.bufsize);
+        std::stringstream ss;
+        ss << "XOR(" << uint32_t(xor_mask) << ")";
+        const pos0_t pos0_xor = pos0 + ss.str();
+
+        // the child keeps the page size, so the same page size is part of the match
+        child_memo memo(sp, "xor", sbuf.buf, sbuf.bufsize, ((uint64_t)sbuf.pagesize << 8) | xor_mask);
+        if(memo.replay(pos0_xor)) return;
+
+        // pooled_malloc throws an exception if allocation fails.
+        pooled_malloc<uint8_t>dbuf(sbuf.bufsize);
         for(size_t ii = 0; ii < sbuf.bufsize; ii++) {
             dbuf.buf[ii] = sbuf.buf[ii] ^ xor_mask;
         }
         
-        std::stringstream ss;
-        ss << "XOR(" << uint32_t(xor_mask) << ")";
-        
-        const pos0_t pos0_xor = pos0 + ss.str();
         const sbuf_t child_sbuf(pos0_xor, dbuf.buf, sbuf.bufsize, sbuf.pagesize, false);
-        scanner_params child_params(sp, child_sbuf);
-        (*rcb.callback)(child_params);    // recurse on deobfuscated buffer
+        child_memo::capture capture(memo, pos0_xor);
+        threadpool::recurse(sp, rcb, child_sbuf, &dbuf); // recurse on deobfuscated buffer, which is not used again
+        capture.commit(sbuf.bufsize, true, sbuf.bufsize);
     }
 }
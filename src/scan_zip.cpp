@@ -1,5 +1,9 @@
 #include "config.h"
 #include "be13_api/bulk_extractor_i.h"
+#include "threadpool.h"
+#include "buffer_pool.h"
+#include "magic_prefilter.h"
+#include "child_memo.h"
 #include "dfxml/src/dfxml_writer.h"
 #include "utf8.h"
 
@@ -9,6 +13,7 @@
 #include <iostream>
 #include <iomanip>
 #include <cassert>
+#include <algorithm>
 
 #define ZIP_RECORDER_NAME "zip"
 #define UNZIP_RECORDER_NAME "unzip_carved"
@@ -176,7 +181,18 @@ inline void scan_zip_component(const class scanner_params &sp,const recursion_co
             }
         }
 
-        managed_malloc<Bytef>dbuf(uncompr_size);
+        const pos0_t pos0_zip = (pos0 + pos) + rcb.partName;
+        /* When carving encoded, carve() skips a member whose only encoding is this ZIP */
+        const bool carving = unzip_carve_mode==feature_recorder::CARVE_ALL
+            || (unzip_carve_mode==feature_recorder::CARVE_ENCODED && pos0_zip.alphaPart()!="ZIP");
+        child_memo memo(sp,"zip",data_buf,compr_size,(uint64_t)uncompr_size*2 + carving);
+        if(!carving && memo.replay(pos0_zip)){ // a hit would not carve
+            xmlstream << "<disposition bytes='" << memo.child_bytes << "'>decompressed</disposition></zipinfo>";
+            zip_recorder->write(pos0+pos,name,xmlstream.str());
+            return;
+        }
+
+        pooled_malloc<Bytef>dbuf(uncompr_size);
 
         if(!dbuf.buf){
             xmlstream << "<disposition>calloc-failed</disposition></zipinfo>";
@@ -199,11 +215,13 @@ inline void scan_zip_component(const class scanner_params &sp,const recursion_co
 
             /* Ignore the error return; process data if we got anything */
             if(zs.total_out>0){
-                const pos0_t pos0_zip = (pos0 + pos) + rcb.partName;
                 const sbuf_t sbuf_new(pos0_zip, dbuf.buf,zs.total_out,zs.total_out,false); // sbuf w/ decompressed data
 
-                scanner_params spnew(sp,sbuf_new); // scanner_params that points to the sbuf
-                (*rcb.callback)(spnew);            // process the sbuf
+                {
+                    child_memo::capture capture(memo,pos0_zip);
+                    threadpool::recurse(sp,rcb,sbuf_new,unzip_recorder ? 0 : &dbuf); // the carver reads it after
+                    capture.commit(zs.total_in,r!=Z_STREAM_END && zs.avail_out>0 && zs.avail_in==0,zs.total_out);
+                }
 
                 /* If we are carving, then carve;
                  * Change any problematic characters to underbars in filename.
@@ -256,7 +274,9 @@ void scan_zip(const class scanner_params &sp,const recursion_control_block &rcb)
 
         if(sbuf.bufsize < MIN_ZIP_SIZE) return;
 
-	for(size_t i=0 ; i < sbuf.pagesize && i < sbuf.bufsize-MIN_ZIP_SIZE; i++){
+	const size_t end = std::min(sbuf.pagesize,sbuf.bufsize-MIN_ZIP_SIZE);
+	size_t i = 0;
+	for(magic_cursor c(sbuf,magic_prefilter::ZIP,end);c.next(i);){
 	    /** Look for signature for beginning of a ZIP component. */
 	    if(sbuf[i]==0x50 && sbuf[i+1]==0x4B && sbuf[i+2]==0x03 && sbuf[i+3]==0x04){
                 scan_zip_component(sp,rcb,zip_recorder,unzip_recorder,i);
@@ -0,0 +1,196 @@
+/*
+ * scanner_profile.cpp:
+ * Count what each scanner costs at each depth; see scanner_profile.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "scanner_profile.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#include <time.h>
+#include <iomanip>
+
+bool scanner_profile::opt_enabled = false;
+
+class profile_counters {
+public:
+    profile_counters():calls(0),bytes(0),features(0),cpu_ns(0),wall_ns(0){}
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t features;
+    uint64_t cpu_ns;                // exclusive of the scanners of children
+    uint64_t wall_ns;
+};
+
+class profile_frame;
+
+/* One per thread; only that thread writes it */
+class profile_table {
+public:
+    profile_table():next(0),top(0){}
+    profile_table *next;
+    profile_frame *top;
+    profile_counters c[scanner_profile::max_scanners][scanner_profile::max_depth+1];
+};
+
+static scanner_t   *originals[scanner_profile::max_scanners];
+static std::string  names[scanner_profile::max_scanners];
+static size_t       installed = 0;
+static profile_table *tables = 0;     // pushed with compare-and-swap, never removed
+
+static pthread_key_t  table_key;
+static pthread_once_t table_key_once = PTHREAD_ONCE_INIT;
+static void make_table_key()
+{
+    if(pthread_key_create(&table_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+static profile_table *get_table()
+{
+    pthread_once(&table_key_once,make_table_key);
+    profile_table *t = (profile_table *)pthread_getspecific(table_key);
+    if(t==0){
+        t = new profile_table();
+        do {
+            t->next = tables;
+        } while(!__sync_bool_compare_and_swap(&tables,t->next,t));
+        pthread_setspecific(table_key,t);
+    }
+    return t;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    if(clock_gettime(clock,&ts)) return 0;
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+static const clockid_t cpu_clock = CLOCK_THREAD_CPUTIME_ID;
+#else
+static const clockid_t cpu_clock = CLOCK_PROCESS_CPUTIME_ID;
+#endif
+
+/* A scanner call in progress on this thread */
+class profile_frame {
+    /*** neither copying nor assignment is implemented ***/
+    profile_frame(const profile_frame &);
+    profile_frame &operator=(const profile_frame &);
+public:
+    profile_frame(size_t slot_,const sbuf_t &sbuf,uint32_t depth):
+        t(get_table()),saved(t->top),slot(slot_),depth(depth<scanner_profile::max_depth ? depth : scanner_profile::max_depth),
+        bytes(sbuf.bufsize),features(0),child_cpu(0),child_wall(0),
+        cpu0(now_ns(cpu_clock)),wall0(now_ns(CLOCK_MONOTONIC)){
+        t->top = this;
+    }
+    ~profile_frame(){
+        const uint64_t cpu  = now_ns(cpu_clock) - cpu0;
+        const uint64_t wall = now_ns(CLOCK_MONOTONIC) - wall0;
+        profile_counters &c = t->c[slot][depth];
+        c.calls++;
+        c.bytes    += bytes;
+        c.features += features;
+        c.cpu_ns   += cpu>child_cpu ? cpu-child_cpu : 0;
+        c.wall_ns  += wall>child_wall ? wall-child_wall : 0;
+        t->top = saved;
+        if(saved){
+            saved->child_cpu  += cpu;
+            saved->child_wall += wall;
+        }
+    }
+    profile_table *t;
+    profile_frame *saved;
+    const size_t slot;
+    const uint32_t depth;
+    const uint64_t bytes;
+    uint64_t features;
+    uint64_t child_cpu,child_wall;
+    const uint64_t cpu0,wall0;
+};
+
+static void run(size_t slot,const scanner_params &sp,const recursion_control_block &rcb)
+{
+    if(sp.phase!=scanner_params::PHASE_SCAN){
+        (*originals[slot])(sp,rcb);
+        return;
+    }
+    profile_frame f(slot,sp.sbuf,sp.depth);
+    (*originals[slot])(sp,rcb);
+}
+
+/* A scanner_t for each slot */
+template<size_t N> static void profiled(const scanner_params &sp,const recursion_control_block &rcb)
+{
+    run(N,sp,rcb);
+}
+template<size_t N> struct trampolines {
+    static void fill(scanner_t **t){
+        t[N-1] = &profiled<N-1>;
+        trampolines<N-1>::fill(t);
+    }
+};
+template<> struct trampolines<0> {
+    static void fill(scanner_t **){}
+};
+
+void scanner_profile::install()
+{
+    if(!opt_enabled || installed>0) return;
+    scanner_t *t[max_scanners];
+    trampolines<max_scanners>::fill(t);
+    for(be13::plugin::scanner_vector::const_iterator it = be13::plugin::current_scanners.begin();
+        it!=be13::plugin::current_scanners.end() && installed<max_scanners;it++){
+        originals[installed] = (*it)->scanner;
+        names[installed] = (*it)->info.name;
+        (*it)->scanner = t[installed];
+        installed++;
+    }
+}
+
+void scanner_profile::feature()
+{
+    if(installed==0) return;
+    pthread_once(&table_key_once,make_table_key);
+    profile_table *t = (profile_table *)pthread_getspecific(table_key);
+    if(t && t->top) t->top->features++;
+}
+
+void scanner_profile::dump_stats(dfxml_writer &xreport)
+{
+    if(installed==0) return;
+    std::stringstream ss;
+    ss << "max_depth='" << max_depth << "'";
+    xreport.push("scanner_profile",ss.str());
+    for(size_t slot=0;slot<installed;slot++){
+        for(uint32_t depth=0;depth<=max_depth;depth++){
+            profile_counters sum;
+            for(const profile_table *t=tables;t;t=t->next){
+                const profile_counters &c = t->c[slot][depth];
+                sum.calls    += c.calls;
+                sum.bytes    += c.bytes;
+                sum.features += c.features;
+                sum.cpu_ns   += c.cpu_ns;
+                sum.wall_ns  += c.wall_ns;
+            }
+            if(sum.calls==0) continue;
+            std::stringstream cs;
+            cs << "name='" << names[slot] << "' depth='" << depth << "'"
+               << " calls='" << sum.calls << "' bytes='" << sum.bytes << "' features='" << sum.features << "'"
+               << std::fixed << std::setprecision(6)
+               << " cpu_seconds='" << sum.cpu_ns/1e9 << "' wall_seconds='" << sum.wall_ns/1e9 << "'";
+            xreport.xmlout("scanner","",cs.str(),false);
+        }
+    }
+    xreport.pop();
+}
+
+void scanner_profile::reset_stats()
+{
+    for(profile_table *t=tables;t;t=t->next){
+        for(size_t slot=0;slot<max_scanners;slot++){
+            for(uint32_t depth=0;depth<=max_depth;depth++) t->c[slot][depth] = profile_counters();
+        }
+    }
+}
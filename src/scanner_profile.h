@@ -0,0 +1,44 @@
+#ifndef _SCANNER_PROFILE_H_
+#define _SCANNER_PROFILE_H_
+
+/**
+ * \file
+ * scanner_profile counts, for each scanner and recursion depth, the calls,
+ * the bytes scanned, the features written and the CPU and wall time spent,
+ * so that report.xml shows which scanners an image keeps busy and what
+ * the decompressed children cost. The work_end records only time whole
+ * pages.
+ *
+ * The scanners are called through the function pointers in
+ * be13::plugin::current_scanners, so install() puts a trampoline in front
+ * of each one; process_sbuf() and the tail split both go through it. The
+ * times are exclusive: what a scanner spends in the scanners of the
+ * children it recurses into is charged to them, at their depth.
+ *
+ * Each thread counts into its own table, which it adds to a list with a
+ * compare-and-swap the first time; nothing is locked while scanning.
+ * dump_stats() adds the tables up for each report and reset_stats()
+ * clears them after it. In a batch the workers may already be scanning
+ * the next image, so a call that ends meanwhile can be counted in either
+ * report; the counters are only read and cleared, never locked.
+ *
+ * Each scanner call reads the thread's CPU clock twice, which is a
+ * system call on most platforms, so the profile is off unless
+ * scanner_profile is set.
+ */
+
+#include <stdint.h>
+
+class scanner_profile {
+public:
+    static bool opt_enabled;
+    static const size_t   max_scanners = 128; // scanners beyond this are not profiled
+    static const uint32_t max_depth = 7;      // deeper calls are counted at max_depth
+
+    static void install();              // once, after the scanners are loaded
+    static void feature();              // a feature was written on this thread
+    static void dump_stats(class dfxml_writer &xreport);
+    static void reset_stats();          // after a report
+};
+
+#endif
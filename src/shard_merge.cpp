@@ -0,0 +1,223 @@
+/*
+ * shard_merge.cpp:
+ * Merge the output directories of a sharded run; see shard_merge.h.
+ */
+
+#include "config.h"
+#include "bulk_extractor.h"
+#include "shard_merge.h"
+#include "checkpoint.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#include <dirent.h>
+#include <set>
+
+shard_merger::shard_merger(const std::string &outdir_,const std::vector<shard> &shards_,
+                           const std::set<std::string> &feature_file_names_):
+    feature_files(0),feature_lines(0),boundary_duplicates(0),
+    files_moved(0),files_duplicate(0),files_renamed(0),
+    outdir(outdir_),shards(shards_),feature_file_names(feature_file_names_)
+{
+}
+
+/* The image offset a feature line was found at, or -1 for none.
+ * Features found in decoded data ("1234-GZIP-56") have the offset of their page.
+ */
+static int64_t line_offset(const std::string &line)
+{
+    if(line.size()==0 || !isdigit(line[0])) return -1;
+    return strtoll(line.c_str(),0,10);
+}
+
+static bool same_contents(const std::string &a,const std::string &b)
+{
+    struct stat sa,sb;
+    if(stat(a.c_str(),&sa) || stat(b.c_str(),&sb) || sa.st_size!=sb.st_size) return false;
+    std::ifstream ia(a.c_str(),std::ios::binary);
+    std::ifstream ib(b.c_str(),std::ios::binary);
+    char ba[65536],bb[65536];
+    while(ia && ib){
+        ia.read(ba,sizeof(ba));
+        ib.read(bb,sizeof(bb));
+        if(ia.gcount()!=ib.gcount() || memcmp(ba,bb,ia.gcount())!=0) return false;
+    }
+    return !ia.bad() && !ib.bad();
+}
+
+static bool make_dir(const std::string &dir)
+{
+#ifdef WIN32
+    return mkdir(dir.c_str())==0;
+#else
+    return mkdir(dir.c_str(),0777)==0;
+#endif
+}
+
+/* name.ext -> name.shardNNN.ext */
+static std::string shard_name(const std::string &path,size_t n)
+{
+    char buf[32];
+    snprintf(buf,sizeof(buf),".shard%03u",(unsigned)n);
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    if(dot==std::string::npos || (slash!=std::string::npos && dot<slash) || dot==slash+1) return path + buf;
+    return path.substr(0,dot) + buf + path.substr(dot);
+}
+
+shard_merger::kind shard_merger::classify(const std::string &name) const
+{
+    if(name=="report.xml" || name.compare(0,11,"report.xml.")==0) return SKIP;
+    if(name==page_checkpoint::file_name) return SKIP;
+    if(!ends_with(name,".txt")) return OTHER;
+    std::string base = name.substr(0,name.size()-4);
+    if(base=="alerts" || feature_file_names.count(base)) return FEATURES;
+    if(ends_with(base,"_stopped") && feature_file_names.count(base.substr(0,base.size()-8))) return FEATURES;
+    for(std::set<std::string>::const_iterator it=feature_file_names.begin();it!=feature_file_names.end();it++){
+        if(base.compare(0,it->size()+1,*it+"_")==0) return SKIP; // a histogram; made again after the merge
+    }
+    return OTHER;
+}
+
+void shard_merger::merge_features(const std::string &name)
+{
+    std::string ofname = outdir + "/" + name;
+    std::ofstream out(ofname.c_str(),std::ios::binary);
+    if(!out.is_open()) err(1,"Cannot create %s",ofname.c_str());
+    feature_files++;
+
+    bool need_header = true;
+    std::vector<std::string> held;      // lines at or past the end of the shard before, in order
+    std::multiset<std::string> held_set; // those not yet seen again
+    for(size_t i=0;i<shards.size();i++){
+        std::vector<std::string> next_held;
+        std::multiset<std::string> next_held_set;
+        std::string fname = shards[i].dir + "/" + name;
+        std::ifstream in(fname.c_str(),std::ios::binary);
+        if(in.is_open()){
+            bool in_header = true;
+            std::string line;
+            while(getline(in,line)){
+                if(line.size()>0 && line[0]=='#'){
+                    if(need_header && in_header) out << line << "\n";
+                    continue;
+                }
+                in_header = false;
+                std::multiset<std::string>::iterator it = held_set.find(line);
+                if(it!=held_set.end()){     // written once, below
+                    held_set.erase(it);
+                    boundary_duplicates++;
+                } else if(shards[i].end!=0 && line_offset(line)>=shards[i].end){
+                    next_held.push_back(line);
+                    next_held_set.insert(line);
+                    continue;
+                }
+                out << line << "\n";
+                feature_lines++;
+            }
+            need_header = false;
+        }
+        /* Lines of the shard before that this one did not report */
+        for(std::vector<std::string>::const_iterator it=held.begin();it!=held.end();it++){
+            std::multiset<std::string>::iterator f = held_set.find(*it);
+            if(f==held_set.end()) continue;
+            held_set.erase(f);
+            out << *it << "\n";
+            feature_lines++;
+        }
+        held.swap(next_held);
+        held_set.swap(next_held_set);
+    }
+    for(std::vector<std::string>::const_iterator it=held.begin();it!=held.end();it++){
+        out << *it << "\n";
+        feature_lines++;
+    }
+    out.close();
+    if(out.fail()) err(1,"Cannot write %s",ofname.c_str());
+}
+
+void shard_merger::move_tree(const std::string &from,const std::string &to,size_t n,bool top)
+{
+    DIR *dirp = opendir(from.c_str());
+    if(!dirp) return;
+    std::vector<std::string> names;
+    struct dirent *dp;
+    while((dp = readdir(dirp)) != NULL){
+        std::string name = dp->d_name;
+        if(name=="." || name=="..") continue;
+        if(top && classify(name)!=OTHER) continue;
+        names.push_back(name);
+    }
+    closedir(dirp);
+
+    for(std::vector<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+        std::string src = from + "/" + *it;
+        std::string dst = to + "/" + *it;
+        struct stat st;
+        if(lstat(src.c_str(),&st)) continue;
+        if(S_ISDIR(st.st_mode)){
+            if(access(dst.c_str(),F_OK)!=0 && !make_dir(dst)){
+                std::cerr << "Could not make directory " << dst << ": " << strerror(errno) << "\n";
+                continue;
+            }
+            move_tree(src,dst,n,false);
+            rmdir(src.c_str());         // fails, harmlessly, if anything was left
+            continue;
+        }
+        if(access(dst.c_str(),F_OK)==0){
+            if(same_contents(src,dst)){
+                unlink(src.c_str());
+                files_duplicate++;
+                continue;
+            }
+            dst = shard_name(dst,n);
+            files_renamed++;
+            std::cerr << "Merge: " << src << " is moved to " << dst << "\n";
+        }
+        if(rename(src.c_str(),dst.c_str())){
+            std::cerr << "Cannot move " << src << " to " << dst << ": " << strerror(errno) << "\n";
+            continue;
+        }
+        files_moved++;
+    }
+}
+
+void shard_merger::merge()
+{
+    /* Every feature file that any shard wrote */
+    std::set<std::string> names;
+    for(size_t i=0;i<shards.size();i++){
+        DIR *dirp = opendir(shards[i].dir.c_str());
+        if(!dirp) continue;
+        struct dirent *dp;
+        while((dp = readdir(dirp)) != NULL){
+            std::string name = dp->d_name;
+            if(classify(name)==FEATURES) names.insert(name);
+        }
+        closedir(dirp);
+    }
+    for(std::set<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+        merge_features(*it);
+    }
+    for(size_t i=0;i<shards.size();i++){
+        move_tree(shards[i].dir,outdir,i,true);
+    }
+
+    /* Only now that all of them are merged, so that a merge that was cut off can be run again */
+    for(size_t i=0;i<shards.size();i++){
+        for(std::set<std::string>::const_iterator it=names.begin();it!=names.end();it++){
+            unlink((shards[i].dir + "/" + *it).c_str());
+        }
+    }
+}
+
+void shard_merger::dump_stats(dfxml_writer &xreport) const
+{
+    xreport.push("shard_merge");
+    xreport.xmlout("feature_files",feature_files);
+    xreport.xmlout("feature_lines",feature_lines);
+    xreport.xmlout("boundary_duplicates",boundary_duplicates);
+    xreport.xmlout("files_moved",files_moved);
+    xreport.xmlout("files_duplicate",files_duplicate);
+    xreport.xmlout("files_renamed",files_renamed);
+    xreport.pop();
+}
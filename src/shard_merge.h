@@ -0,0 +1,62 @@
+#ifndef _SHARD_MERGE_H_
+#define _SHARD_MERGE_H_
+
+/**
+ * \file
+ * shard_merger puts the output directories of a sharded run (-J) back
+ * together into one output directory.
+ *
+ * Each shard scanned the pages [start,end) of the image, each page with
+ * its margin, so a feature that starts in the margin past a shard's end
+ * is found both by that shard and by the next one. Feature files are
+ * concatenated in shard order; the lines a shard reported at or past its
+ * end are held back and dropped if the next shard reported the same line.
+ * Everything else (carved files, packets, and so on) is moved to the same
+ * place in the merged directory; a name that is already taken gets the
+ * shard number added, unless the two files are the same, in which case
+ * the second one is dropped.
+ *
+ * Histograms are not merged here: the shards do not make them, and they
+ * are made once from the merged feature files, so that the features seen
+ * by two shards are counted once.
+ */
+
+#include <set>
+#include <string>
+#include <vector>
+
+class shard_merger {
+    /*** neither copying nor assignment is implemented ***/
+    shard_merger(const shard_merger &);
+    shard_merger &operator=(const shard_merger &);
+public:
+    class shard {
+    public:
+        shard(const std::string &dir_,int64_t start_,int64_t end_):dir(dir_),start(start_),end(end_){}
+        std::string dir;
+        int64_t     start;              // as reported in the feature files
+        int64_t     end;                // 0 for the end of the image
+    };
+    shard_merger(const std::string &outdir_,const std::vector<shard> &shards_,
+                 const std::set<std::string> &feature_file_names_);
+    void merge();
+    void dump_stats(class dfxml_writer &xreport) const;
+
+    /* statistics */
+    uint64_t feature_files;
+    uint64_t feature_lines;
+    uint64_t boundary_duplicates;       // feature lines reported by two shards
+    uint64_t files_moved;
+    uint64_t files_duplicate;           // identical files from two shards
+    uint64_t files_renamed;
+private:
+    const std::string outdir;
+    const std::vector<shard> shards;
+    const std::set<std::string> feature_file_names;
+    enum kind {FEATURES,OTHER,SKIP};
+    kind classify(const std::string &name) const;
+    void merge_features(const std::string &name);
+    void move_tree(const std::string &from,const std::string &to,size_t n,bool top);
+};
+
+#endif
@@ -2,7 +2,14 @@
 #include "bulk_extractor.h"
 #include "image_process.h"
 #include "threadpool.h"
+#include "buffer_pool.h"
+#include "checkpoint.h"
+#include "magic_prefilter.h"
+#include "page_classifier.h"
+#include "page_dedup.h"
+#include "child_memo.h"
 #include "be13_api/aftimer.h"
+#include "dfxml/src/hash_t.h"
 
 #include <dirent.h>
 #include <ctype.h>
@@ -10,8 +17,17 @@
 #include <set>
 #include <setjmp.h>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <unistd.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
 
 
 /* Return the number of CPUs we have on various architectures.
@@ -54,6 +70,53 @@ u_int threadpool::numCPU()
     return numCPU;
 }
 
+/* Parse a Linux cpulist such as "0-3,8-11" */
+static void parse_cpulist(const std::string &list,std::vector<int> &cpus)
+{
+    std::vector<std::string> ranges = split(list,',');
+    for(std::vector<std::string>::const_iterator it=ranges.begin();it!=ranges.end();it++){
+        if(it->size()==0) continue;
+        int lo = atoi(it->c_str());
+        size_t dash = it->find('-');
+        int hi = dash==std::string::npos ? lo : atoi(it->c_str()+dash+1);
+        for(int c=lo;c<=hi;c++) cpus.push_back(c);
+    }
+}
+
+std::vector<std::vector<int> > threadpool::numa_nodes()
+{
+    std::vector<std::vector<int> > nodes;
+    for(int n=0;;n++){
+        std::ifstream in(("/sys/devices/system/node/node" + itos(n) + "/cpulist").c_str());
+        if(!in.is_open()) break;
+        std::string line;
+        getline(in,line);
+        std::vector<int> cpus;
+        parse_cpulist(line,cpus);
+        if(cpus.size()>0) nodes.push_back(cpus); // memory-only nodes have no CPUs
+    }
+    if(nodes.size()==0){
+        std::vector<int> cpus;
+        for(u_int c=0;c<numCPU();c++) cpus.push_back(c);
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+bool threadpool::bind_cpus(const std::vector<int> &cpus)
+{
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(std::vector<int>::const_iterator it=cpus.begin();it!=cpus.end();it++){
+        if(*it>=0 && *it<CPU_SETSIZE) CPU_SET(*it,&set);
+    }
+    return sched_setaffinity(0,sizeof(set),&set)==0;
+#else
+    return false;
+#endif
+}
+
 #ifdef WIN32
 /**
  * From the pthreads readme for mingw:
@@ -81,28 +144,62 @@ void threadpool::win32_init()
 }
 #endif
 
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Each worker thread records itself here so that scanners running on it
+ * can hand sub-tasks to its deque.
+ */
+static pthread_key_t  worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+static void make_worker_key()
+{
+    if(pthread_key_create(&worker_key,NULL)) errx(1,"pthread_key_create failed");
+}
+
+worker *worker::current()
+{
+    pthread_once(&worker_key_once,make_worker_key);
+    return (worker *)pthread_getspecific(worker_key);
+}
+
 /**
  * Create the thread pool.
- * Each thread has its own feature_recorder_set.
+ * Each thread has its own deque of work.
  *
  */
-threadpool::threadpool(int numthreads,feature_recorder_set &fs_,dfxml_writer &xreport_):
-    workers(),M(),TOMAIN(),TOWORKER(),freethreads(numthreads),work_queue(),
-    fs(fs_),xreport(xreport_),thread_status(),waiting(),mode()
+threadpool::threadpool(int numthreads_,feature_recorder_set &fs):
+    next_worker(0),workers(),M(),TOMAIN(),TOWORKER(),numthreads(numthreads_),freethreads(numthreads_),
+    queued(0),outstanding(0),pages_in_flight(0),sleeping(0),producer_blocked(0),steals(0),
+    async_children(0),tail(0),file_parts(0),async_bytes(0),
+    started(0),default_job(0),thread_status(),waiting(),mode(),
+    constant_units(0),constant_bytes(0)
 {
     if(pthread_mutex_init(&M,NULL))       errx(1,"pthread_mutex_init failed");
     if(pthread_cond_init(&TOMAIN,NULL))   errx(1,"pthread_cond_init #1 failed");
     if(pthread_cond_init(&TOWORKER,NULL)) errx(1,"pthread_cond_init #2 failed");
+    pthread_once(&worker_key_once,make_worker_key);
 
-    // lock while I create the threads
-    if(pthread_mutex_lock(&M)) errx(1,"pthread_mutex_lock failed");
+    /* Create all of the workers before starting any of them, since they steal from each other */
     for(int i=0;i<numthreads;i++){
-	class worker *w = new worker(*this,i);
-	workers.push_back(w);
+	workers.push_back(new worker(*this,i));
 	thread_status.push_back(std::string());
-	pthread_create(&w->thread,NULL,worker::start_worker,(void *)w);
     }
-    pthread_mutex_unlock(&M);		// lock while I create the threads
+    for(int i=0;i<numthreads;i++){
+        workers[i]->fs = &fs;
+	pthread_create(&workers[i]->thread,NULL,worker::start_worker,(void *)workers[i]);
+    }
+
+    /* fs belongs to the first image of a batch; do not return until every worker is done with it */
+    pthread_mutex_lock(&M);
+    while(__sync_fetch_and_add(&started,0)<numthreads){
+        if(pthread_cond_wait(&TOMAIN,&M)) err(1,"threadpool::threadpool pthread_cond_wait failed");
+    }
+    pthread_mutex_unlock(&M);
 }
 
 threadpool::~threadpool()
@@ -112,14 +209,9 @@ threadpool::~threadpool()
      * So we just leave them floating around now. Doesn't matter much, because
      * the main process will die soon enough.
      */
-#if 0
-    for(int i=0;i<num_threads;i++){
-	this->schedule_work(0);
-    }
-#endif
 
     /* Release our resources */
-    fs.close_all();
+    if(default_job) default_job->fs.close_all();
     pthread_mutex_destroy(&M);
     pthread_cond_destroy(&TOMAIN);
     pthread_cond_destroy(&TOWORKER);
@@ -134,57 +226,531 @@ threadpool::~threadpool()
 #endif
 }
 
+/**
+ * Put a unit on the back of a worker's deque and wake a sleeping worker.
+ * The counters are raised before the unit becomes visible so that
+ * all_free() can never see the pool as idle while the unit is in transit.
+ */
+void threadpool::enqueue(uint32_t id,const work_unit &wu)
+{
+    __sync_fetch_and_add(&wu.job->outstanding,1);
+    __sync_fetch_and_add(&outstanding,1);
+    __sync_fetch_and_add(&queued,1);
+    if(wu.job->checkpoint) wu.job->checkpoint->unit_queued(wu.page);
+    worker *w = workers.at(id);
+    pthread_mutex_lock(&w->M);
+    w->deque.push_back(wu);
+    pthread_mutex_unlock(&w->M);
+    if(__sync_fetch_and_add(&sleeping,0)>0){
+        pthread_mutex_lock(&M);
+        pthread_cond_signal(&TOWORKER);
+        pthread_mutex_unlock(&M);
+    }
+}
+
 /** 
  * work is delivered in sbufs.
- * This blocks the caller if there are no free workers.
+ * This blocks the caller if every worker already has a page in flight.
  * Called from the threadpool master thread
  */
-void threadpool::schedule_work(sbuf_t *sbuf)
+void threadpool::schedule_work(sbuf_t *sbuf,scan_job *job)
+{
+    if(__sync_fetch_and_add(&pages_in_flight,0)>=numthreads){
+        pthread_mutex_lock(&M);
+        __sync_fetch_and_add(&producer_blocked,1);
+        waiting.start();
+        while(__sync_fetch_and_add(&pages_in_flight,0)>=numthreads){
+            // wait until a page is finished (doesn't matter which)
+            if(pthread_cond_wait(&TOMAIN,&M)){
+                err(1,"threadpool::schedule_work pthread_cond_wait failed");
+            }
+        }
+        waiting.stop();
+        __sync_fetch_and_sub(&producer_blocked,1);
+        pthread_mutex_unlock(&M);
+    }
+    __sync_fetch_and_add(&pages_in_flight,1);
+    if(job==0) job = default_job;
+    if(job==0) errx(1,"threadpool::schedule_work: no image to schedule work for");
+    enqueue(next_worker,work_unit(sbuf,0,job));
+    next_worker = (next_worker+1) % numthreads;
+}
+
+/**
+ * Schedule a recursive sub-task on the calling worker's own deque.
+ * Idle workers will steal it. Returns false (and does not take the sbuf)
+ * if the caller is not a worker of this pool, in which case the caller
+ * should process the sbuf itself.
+ */
+bool threadpool::schedule_subtask(sbuf_t *sbuf,uint32_t depth)
+{
+    worker *w = worker::current();
+    if(w==0 || &w->master!=this) return false;
+    work_unit wu(sbuf,depth,w->job);
+    wu.page = w->page;
+    enqueue(w->id,wu);
+    return true;
+}
+
+/**
+ * Recurse into a child buffer that a scanner created (a decompressed zip
+ * member, gzip stream, PDF text, hibernation page, and so on).
+ *
+ * Normally the child is processed right away on the scanner's thread.
+ * With async recursion enabled, a large child is instead put in an sbuf
+ * that the pool owns and pushed on this worker's deque at depth+1, so
+ * that idle workers can steal it while the scanner keeps going. A scanner
+ * that does not look at the child again passes the pooled_malloc that
+ * holds it as owner, and the task takes that buffer; otherwise the child
+ * is copied, since the scanner frees or reuses its buffer on return.
+ * The forensic path and the max_depth checks in process_sbuf are the
+ * same either way. Only children bound for process_sbuf are offloaded;
+ * other callbacks (such as the path printer) always run in place, as
+ * do the children of a buffer whose features are being captured. Since
+ * page_dedup captures every page, main() turns it off when
+ * async_recursion is on. child_memo is told of each child first.
+ */
+bool     threadpool::opt_async_recursion = false;
+uint32_t threadpool::opt_async_recursion_min_bytes = 65536;
+uint32_t threadpool::opt_async_recursion_max_mb = 1024;
+void threadpool::recurse(const scanner_params &sp,const recursion_control_block &rcb,const sbuf_t &child,
+                         pooled_malloc<uint8_t> *owner)
+{
+    child_memo::recursed(sp,rcb,child);
+    worker *w = opt_async_recursion ? worker::current() : 0;
+    if(w && rcb.callback==be13::plugin::process_sbuf && child.bufsize>=opt_async_recursion_min_bytes
+       && !feature_capture::active()){
+        threadpool &tp = w->master;
+        const uint64_t limit = (uint64_t)opt_async_recursion_max_mb * 1024 * 1024;
+        sbuf_t *sbuf = 0;
+        if(__sync_add_and_fetch(&tp.async_bytes,(uint64_t)child.bufsize) <= limit){
+            try {
+                if(owner && owner->buf==child.buf){
+                    sbuf = new pooled_sbuf(child.pos0,owner->buf,child.bufsize,child.pagesize,owner->size());
+                    owner->release();
+                } else {
+                    uint8_t *buf = (uint8_t *)buffer_pool::get().alloc(child.bufsize);
+                    memcpy(buf,child.buf,child.bufsize);
+                    sbuf = new pooled_sbuf(child.pos0,buf,child.bufsize,child.pagesize,child.bufsize);
+                }
+                if(tp.schedule_subtask(sbuf,sp.depth+1)){
+                    __sync_fetch_and_add(&tp.async_children,1);
+                    return;
+                }
+            }
+            catch (const std::bad_alloc &) {
+            }
+        }
+        /* Over the limit or out of memory; give back the reservation and recurse in place */
+        __sync_fetch_and_sub(&tp.async_bytes,(uint64_t)child.bufsize);
+        if(sbuf){                       // it may hold the scanner's buffer now
+            {
+                magic_prefilter::scope magic(*sbuf);
+                page_classifier::scope classes(*sbuf);
+                (*rcb.callback)(scanner_params(sp,*sbuf));
+            }
+            delete sbuf;
+            return;
+        }
+    }
+    magic_prefilter::scope magic(child);
+    page_classifier::scope classes(child);
+    (*rcb.callback)(scanner_params(sp,child));
+}
+
+/**
+ * Straggler mitigation.
+ *
+ * Near the end of the image there are fewer pages than workers, and a
+ * page can take much longer than its neighbours. Once the producer calls
+ * set_tail(), a worker that takes a page splits it into one unit per
+ * scanner instead of running process_sbuf() on it, so that the scanners
+ * for the last pages run in parallel. Pages that are already running
+ * cannot be split, so the producer calls set_tail() while there are
+ * still about numthreads pages to read.
+ */
+bool threadpool::opt_tail_split = false;
+void threadpool::set_tail()
+{
+    if(!opt_tail_split || __sync_fetch_and_add(&tail,0)) return;
+    if(default_job) default_job->tail_start = now();
+    __sync_fetch_and_add(&tail,1);
+}
+
+void threadpool::clear_tail()
+{
+    if(__sync_fetch_and_add(&tail,0)) __sync_fetch_and_sub(&tail,1);
+}
+
+/****************************************************************
+ * process_sbuf(), one scanner at a time.
+ * be13 has no entry point that runs a single scanner, so split pages go
+ * through these two, which keep what process_sbuf() does around the
+ * scanners: the heartbeat, the depth limit and the ngram and duplicate
+ * checks once per page, then for each scanner the stats bucket, the
+ * recursion control block and the exception alert. Split pages are at
+ * depth 0, so they never raise be13's max_depth_seen.
+ *
+ * They must follow be13's process_sbuf() until be13_api has such an
+ * entry point; that is why tail_split is off by default.
+ */
+
+/* Returns the scanners that process_sbuf() would run on sp */
+static std::vector<scanner_def *> process_sbuf_scanners(const scanner_params &sp)
+{
+    std::vector<scanner_def *> scanners;
+    feature_recorder_set &fs = sp.fs;
+    const sbuf_t &sbuf = sp.sbuf;
+    fs.heartbeat();
+    if(sp.depth >= scanner_def::max_depth){
+        feature_recorder *alert_recorder = fs.get_alert_recorder();
+        if(alert_recorder) alert_recorder->write(sbuf.pos0,"process_extract: MAX DEPTH REACHED","");
+        return scanners;
+    }
+    bool seen_before = fs.check_previously_processed(sbuf.buf,sbuf.bufsize);
+    if(seen_before){
+        feature_recorder *alert_recorder = fs.get_alert_recorder();
+        if(alert_recorder && be13::plugin::dup_data_alerts){
+            md5_t md5 = md5_generator::hash_buf(sbuf.buf,sbuf.bufsize);
+            std::stringstream ss;
+            ss << "<buflen>" << sbuf.bufsize << "</buflen>";
+            alert_recorder->write(sbuf.pos0,"DUP SBUF "+md5.hexdigest(),ss.str());
+        }
+        __sync_fetch_and_add(&be13::plugin::dup_data_encountered,sbuf.bufsize);
+    }
+    size_t ngram_size = sbuf.find_ngram_size(scanner_def::max_ngram);
+    for(be13::plugin::scanner_vector::const_iterator it = be13::plugin::current_scanners.begin();
+        it!=be13::plugin::current_scanners.end();it++){
+        if((*it)->enabled==false) continue;
+        if(((*it)->info.flags & scanner_info::SCANNER_DEPTH_0) && sp.depth>0) continue;
+        if(((*it)->info.flags & scanner_info::SCANNER_WANTS_NGRAMS)==0){
+            if(ngram_size>0 || seen_before) continue;
+        }
+        scanners.push_back(*it);
+    }
+    return scanners;
+}
+
+/* Call one scanner as process_sbuf() calls each of them */
+static void process_sbuf_call(const scanner_def &sd,const scanner_params &sp)
+{
+    const sbuf_t &sbuf = sp.sbuf;
+    feature_recorder_set &fs = sp.fs;
+    std::string name;
+    for(std::string::const_iterator cc=sd.info.name.begin();cc!=sd.info.name.end();cc++){
+        name.push_back(toupper(*cc));
+    }
+
+    /* The effective path for stats: the upper-case parts of pos0, then the scanner */
+    bool inname=false;
+    std::string epath;
+    for(std::string::const_iterator cc=sbuf.pos0.path.begin();cc!=sbuf.pos0.path.end();cc++){
+        if(isupper(*cc)) inname=true;
+        if(inname) epath.push_back(toupper(*cc));
+        if(*cc=='-') inname=false;
+    }
+    if(epath.size()>0) epath.push_back('-');
+    epath += name;
+
+    try {
+        recursion_control_block rcb(be13::plugin::process_sbuf,name);
+        aftimer t;
+        t.start();
+        (*sd.scanner)(sp,rcb);
+        t.stop();
+        if(fs.flag_notset(feature_recorder_set::SET_DISABLED)) fs.add_stats(epath,t.elapsed_seconds());
+    }
+    catch (const std::exception &e ) {
+        std::stringstream ss;
+        ss << "std::exception Scanner: " << sd.info.name
+           << " Exception: " << e.what()
+           << " sbuf.pos0: " << sbuf.pos0 << " bufsize=" << sbuf.bufsize << "\n";
+        std::cerr << ss.str();
+        feature_recorder *alert_recorder = fs.get_alert_recorder();
+        if(alert_recorder) alert_recorder->write(sbuf.pos0,"scanner="+sd.info.name,
+                                                 std::string("<exception>")+e.what()+"</exception>");
+    }
+    catch (...) {
+        std::stringstream ss;
+        ss << "Scanner: " << sd.info.name
+           << " Unknown Exception "
+           << " sbuf.pos0: " << sbuf.pos0 << " bufsize=" << sbuf.bufsize << "\n";
+        std::cerr << ss.str();
+        feature_recorder *alert_recorder = fs.get_alert_recorder();
+        if(alert_recorder) alert_recorder->write(sbuf.pos0,"scanner="+sd.info.name,"<unknown_exception/>");
+    }
+}
+
+/**
+ * Split a page into per-scanner units on worker id's deque.
+ * Only the scanners that process_sbuf() would run get a unit.
+ * A part of a large -R file is always split, so that its pages go only
+ * to the scanners that are not whole-file scanners and the whole file
+ * only to those that are.
+ * Returns false if the page should be run whole.
+ */
+bool threadpool::split(uint32_t id,const work_unit &wu)
+{
+    if(wu.depth>0 || wu.scanner) return false;
+    if(dynamic_cast<const file_batch_sbuf *>(wu.sbuf)) return false; // many small files, not a page
+    const file_part_sbuf *part = dynamic_cast<const file_part_sbuf *>(wu.sbuf);
+    if(part==0 && __sync_fetch_and_add(&tail,0)==0) return false;
+    if(wu.sbuf->bufsize==0) return false;
+
+    scanner_params params(scanner_params::PHASE_SCAN,*wu.sbuf,wu.job->fs);
+    std::vector<scanner_def *> scanners;
+    std::vector<scanner_def *> all = process_sbuf_scanners(params);
+    for(std::vector<scanner_def *>::const_iterator it = all.begin();it!=all.end();it++){
+        if(part && process_dir::whole_file_scanner((*it)->info.name)!=part->whole_file) continue;
+        scanners.push_back(*it);
+    }
+    if(part) __sync_fetch_and_add(&file_parts,1);
+    if(scanners.size()==0){
+        delete wu.sbuf;                 // nothing would have run
+        unit_finished(wu.job,wu.page,true);
+        return true;
+    }
+    split_page *sp = new split_page(wu.sbuf,scanners.size(),now(),part==0,wu.job,wu.page);
+    if(part==0){
+        __sync_fetch_and_add(&wu.job->split_pages,1);
+        __sync_fetch_and_add(&wu.job->split_tasks,(uint64_t)scanners.size());
+    }
+    for(std::vector<scanner_def *>::const_iterator it = scanners.begin();it!=scanners.end();it++){
+        work_unit su(wu.sbuf,0,wu.job);
+        su.scanner = *it;
+        su.split   = sp;
+        su.page    = wu.page;
+        enqueue(id,su);
+    }
+    return true;
+}
+
+/**
+ * One scanner of a split page has finished. The last one frees the page,
+ * finishes it, and records how long the page took, in scanner time and
+ * in wall time. The unit that calls this still holds its job open.
+ */
+void threadpool::split_done(const work_unit &wu,double seconds)
 {
+    split_page *sp = wu.split;
+    __sync_fetch_and_add(&sp->scanner_usec,(uint64_t)(seconds*1000000));
+    if(__sync_sub_and_fetch(&sp->refs,1)>0) return;
+    unit_finished(sp->job,sp->page,true);
+    if(!sp->tail){
+        delete sp->sbuf;
+        delete sp;
+        return;
+    }
+
+    double end = now();
+    double serial = sp->scanner_usec / 1000000.0;
     pthread_mutex_lock(&M);
-    while(freethreads==0){
-	// wait until a thread is free (doesn't matter which)
-	waiting.start();
-	if(pthread_cond_wait(&TOMAIN,&M)){
-	    err(1,"threadpool::schedule_work pthread_cond_wait failed");
-	}
-	waiting.stop();
+    scan_job &job = *sp->job;
+    if(end > job.tail_end) job.tail_end = end;
+    if(serial > job.longest_page_serial){
+        job.longest_page_serial = serial;
+        job.longest_page_wall   = end - sp->start;
     }
-    work_queue.push(sbuf); 
-    freethreads--;
-    pthread_cond_signal(&TOWORKER);
     pthread_mutex_unlock(&M);
+    delete sp->sbuf;
+    delete sp;
+}
+
+/**
+ * Report the split pages. Had the slowest page been run whole, the tail
+ * would have lasted at least its scanner time; the difference from its
+ * wall time is a lower bound on what splitting saved.
+ */
+void threadpool::dump_tail_stats(const scan_job &job,dfxml_writer &xreport)
+{
+    if(job.split_pages==0) return;
+    std::stringstream ss;
+    ss << "pages='" << job.split_pages << "' tasks='" << job.split_tasks << "'";
+    xreport.push("tail_split",ss.str());
+    xreport.xmlout("tail_seconds",job.tail_end - job.tail_start);
+    xreport.xmlout("longest_page_seconds",job.longest_page_serial);
+    xreport.xmlout("longest_page_wall_seconds",job.longest_page_wall);
+    double saved = job.longest_page_serial - job.longest_page_wall;
+    xreport.xmlout("estimated_seconds_saved",saved>0 ? saved : 0.0);
+    xreport.pop();
+}
+
+/**
+ * The pool's own counters start again once they are in a report.
+ * In a batch the next image may already be running, so each report has
+ * what was counted since the one before it. The tail is the job's.
+ */
+void threadpool::reset_stats()
+{
+    steals = async_children = 0;
+    file_parts = 0;
+    constant_units = constant_bytes = 0;
+}
+
+/**
+ * Return how many bytes at the start of buf are equal to buf[0].
+ * This looks at every byte of wiped pages, so it compares 16 bytes
+ * at a time where it can.
+ */
+static size_t constant_run(const uint8_t *buf,size_t len)
+{
+    if(len==0) return 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i fill = _mm_set1_epi8((char)buf[0]);
+    for(;i+16<=len;i+=16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf+i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v,fill));
+        if(mask!=0xffff) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while(i<len && buf[i]==buf[0]) i++;
+    return i;
+}
+
+/**
+ * Constant data, in pages read from the image.
+ * A page that is one byte value from end to end is not scanned at all;
+ * process_sbuf() would only have found it to be an ngram and skipped it.
+ * A page that starts with a long constant run (a partly wiped page) is
+ * scanned from near the end of the run, keeping a few KiB of it in case
+ * a feature begins there. The rest of the page, and the margin, are
+ * always scanned, since a file that starts before a run may continue
+ * into it. If any scanner wants ngrams, nothing is skipped.
+ * Recursion children are always scanned whole: process_sbuf() checks
+ * each of them against the ones seen before, and that must see all of it.
+ */
+bool     threadpool::opt_skip_constant = true;
+uint32_t threadpool::opt_skip_constant_min_bytes = 65536;
+size_t threadpool::constant_skip(const work_unit &wu)
+{
+    static const size_t keep = 4096;    // bytes of the run still scanned
+    if(!opt_skip_constant || wu.scanner || wu.depth>0) return 0;
+    const sbuf_t &sbuf = *wu.sbuf;
+    if(sbuf.bufsize < opt_skip_constant_min_bytes) return 0;
+    for(be13::plugin::scanner_vector::const_iterator it = be13::plugin::current_scanners.begin();
+        it!=be13::plugin::current_scanners.end();it++){
+        if((*it)->enabled && ((*it)->info.flags & scanner_info::SCANNER_WANTS_NGRAMS)) return 0;
+    }
+    size_t run = constant_run(sbuf.buf,sbuf.bufsize);
+    if(run==sbuf.bufsize){
+        __sync_fetch_and_add(&constant_units,1);
+        __sync_fetch_and_add(&constant_bytes,(uint64_t)run);
+        return run;
+    }
+    if(run < opt_skip_constant_min_bytes) return 0;
+    if(dynamic_cast<const file_part_sbuf *>(&sbuf)) return 0; // must be split by scanner, not cut
+    if(dynamic_cast<const file_batch_sbuf *>(&sbuf)) return 0; // its files are scanned one by one
+    if(run < keep+keep) return 0;       // too short to skip a whole keep-sized block
+    size_t skip = (run - keep) & ~(keep-1);
+    if(skip > sbuf.pagesize) skip = sbuf.pagesize & ~(keep-1); // the margin belongs to the next page
+    if(skip==0) return 0;
+    __sync_fetch_and_add(&constant_bytes,(uint64_t)skip);
+    return skip;
+}
+
+void threadpool::dump_constant_stats(dfxml_writer &xreport)
+{
+    if(!opt_skip_constant) return;
+    std::stringstream ss;
+    ss << "units='" << constant_units << "' bytes='" << constant_bytes << "'";
+    xreport.xmlout("constant_data_skipped","",ss.str(),false);
+}
+
+/**
+ * Find work for worker id: newest unit on its own deque first,
+ * then the oldest unit on any other deque.
+ */
+bool threadpool::take_work(uint32_t id,work_unit *wu)
+{
+    if(__sync_fetch_and_add(&queued,0)==0) return false;
+    for(int i=0;i<numthreads;i++){
+        worker *w = workers[(id+i) % numthreads];
+        bool found = false;
+        pthread_mutex_lock(&w->M);
+        if(!w->deque.empty()){
+            if(i==0){
+                *wu = w->deque.back();
+                w->deque.pop_back();
+            } else {
+                *wu = w->deque.front();
+                w->deque.pop_front();
+            }
+            found = true;
+        }
+        pthread_mutex_unlock(&w->M);
+        if(found){
+            __sync_fetch_and_sub(&freethreads,1);
+            __sync_fetch_and_sub(&queued,1);
+            if(i>0) __sync_fetch_and_add(&steals,1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * A unit is finished. Sub-tasks it created have already been enqueued,
+ * so outstanding cannot reach 0 while there is more work to do.
+ */
+void threadpool::work_done(const work_unit &wu)
+{
+    __sync_fetch_and_add(&freethreads,1);
+    unit_finished(wu.job,wu.page,wu.depth==0 && wu.scanner==0);
+}
+
+/**
+ * The work of a unit is over. A whole page no longer counts against
+ * the pages in flight, and the unit no longer holds its job open.
+ */
+void threadpool::unit_finished(scan_job *job,uint64_t page,bool whole_page)
+{
+    if(whole_page){
+        __sync_fetch_and_sub(&pages_in_flight,1);
+        if(__sync_fetch_and_add(&producer_blocked,0)>0){
+            pthread_mutex_lock(&M);
+            pthread_cond_signal(&TOMAIN); // tell the master that we are free!
+            pthread_mutex_unlock(&M);
+        }
+    }
+    if(job->checkpoint) job->checkpoint->unit_done(page); // before the job can be seen to be done
+    __sync_fetch_and_sub(&job->outstanding,1);
+    __sync_fetch_and_sub(&outstanding,1);
+}
+
+bool threadpool::all_free()
+{
+    return __sync_fetch_and_add(&outstanding,0)==0;
+}
+
+bool threadpool::job_done(scan_job &job)
+{
+    return __sync_fetch_and_add(&job.outstanding,0)==0;
 }
 
 int threadpool::get_free_count()
 {
-    pthread_mutex_lock(&M);
-    int ret = freethreads;
-    pthread_mutex_unlock(&M);
-    return ret;
+    return __sync_fetch_and_add(&freethreads,0);
 }
 
 void threadpool::set_thread_status(uint32_t id,const std::string &status)
 {
-    if(pthread_mutex_lock(&M)){
+    if(id >= workers.size()) return;
+    if(pthread_mutex_lock(&workers[id]->M)){
 	errx(1,"threadpool::set_thread_status pthread_mutex_lock failed");
     }
-    if(id < thread_status.size()){
-	thread_status.at(id) = status;
-    }
-    pthread_mutex_unlock(&M);
+    thread_status.at(id) = status;
+    pthread_mutex_unlock(&workers[id]->M);
 }
 
 std::string threadpool::get_thread_status(uint32_t id)
 {
-    if(pthread_mutex_lock(&M)){
-	errx(1,"threadpool::set_thread_status pthread_mutex_lock failed");
-    }
-    std::string status;
-    if(id < thread_status.size()){
-	status = thread_status.at(id);
+    if(id >= workers.size()) return std::string();
+    if(pthread_mutex_lock(&workers[id]->M)){
+	errx(1,"threadpool::get_thread_status pthread_mutex_lock failed");
     }
-    pthread_mutex_unlock(&M);
+    std::string status = thread_status.at(id);
+    pthread_mutex_unlock(&workers[id]->M);
     return status;
 }
 
@@ -193,40 +759,88 @@ std::string threadpool::get_thread_status(uint32_t id)
  * Called in the worker threads
  */
 bool worker::opt_work_start_work_end=true;
-void worker::do_work(sbuf_t *sbuf)
+void worker::do_work(const work_unit &wu,size_t skip)
 {
+    const sbuf_t *sbuf = wu.sbuf;
+    const std::string pos0 = opt_work_start_work_end ? sbuf->pos0.str() : std::string();
+
     /* If logging starting and ending, save the start */
     if(opt_work_start_work_end){
 	std::stringstream ss;
 	ss << "threadid='"  << id << "'"
-	   << " pos0='"     << dfxml_writer::xmlescape(sbuf->pos0.str()) << "'"
+	   << " pos0='"     << dfxml_writer::xmlescape(pos0) << "'"
 	   << " pagesize='" << sbuf->pagesize << "'"
 	   << " bufsize='"  << sbuf->bufsize << "'";
-	master.xreport.xmlout("debug:work_start","",ss.str(),true);
+        if(wu.depth>0) ss << " depth='" << wu.depth << "'";
+        if(wu.scanner) ss << " scanner='" << wu.scanner->info.name << "'";
+        if(skip) ss << " constant='" << skip << "'";
+	wu.job->xreport.xmlout("debug:work_start","",ss.str(),true);
     }
 	
     /**
      * HERE IT IS!!!
      * Construct a scanner_params() object from the sbuf that was pulled
      * off the work queue and call process_extract().
+     * Sub-tasks resume at the depth of the scanner that created them.
      */
 
     aftimer t;
     t.start();
-    be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,master.fs)); 
+    const file_batch_sbuf *batch = dynamic_cast<const file_batch_sbuf *>(sbuf);
+    if(wu.scanner){
+        run_scanner(wu);
+    } else if(batch && skip==0) {
+        /* Each small file is its own sbuf with its own name, as if it had been read alone */
+        for(std::vector<file_batch_sbuf::member>::const_iterator it=batch->members.begin();
+            it!=batch->members.end();it++){
+            sbuf_t file(pos0_t(it->name,0),batch->buf+it->offset,it->len,it->len,false);
+            magic_prefilter::scope magic(file);
+            page_classifier::scope classes(file);
+            scanner_params sp(scanner_params::PHASE_SCAN,file,wu.job->fs);
+            sp.depth = wu.depth;
+            be13::plugin::process_sbuf(sp);
+        }
+    } else if(skip) {
+        sbuf_t rest(*sbuf,skip);        // the same forensic offsets, and the margin stays the margin
+        magic_prefilter::scope magic(rest);
+        page_classifier::scope classes(rest);
+        scanner_params sp(scanner_params::PHASE_SCAN,rest,wu.job->fs);
+        sp.depth = wu.depth;
+        be13::plugin::process_sbuf(sp); 
+    } else {
+        magic_prefilter::scope magic(*sbuf);
+        page_classifier::scope classes(*sbuf);
+        scanner_params sp(scanner_params::PHASE_SCAN,*sbuf,wu.job->fs);
+        sp.depth = wu.depth;
+        be13::plugin::process_sbuf(sp); 
+    }
     t.stop();
+    if(wu.split) master.split_done(wu,t.elapsed_seconds()); // may delete sbuf
 
     /* If we are logging starting and ending, save the end */
     if(opt_work_start_work_end){
 	std::stringstream ss;
 	ss << "threadid='" << id << "'"
-	   << " pos0='" << dfxml_writer::xmlescape(sbuf->pos0.str()) << "'"
+	   << " pos0='" << dfxml_writer::xmlescape(pos0) << "'"
 	   << " time='" << t.elapsed_seconds() << "'";
-	master.xreport.xmlout("debug:work_end","",ss.str(),true);
+	wu.job->xreport.xmlout("debug:work_end","",ss.str(),true);
     }
-    master.fs.flush_all();
+    wu.job->fs.flush_all();
 }
 
+/**
+ * Run a single scanner on a split page, as process_sbuf() would,
+ * charging its time to the same stats bucket.
+ */
+void worker::run_scanner(const work_unit &wu)
+{
+    const sbuf_t &sbuf = *wu.sbuf;
+    magic_prefilter::scope magic(sbuf);
+    page_classifier::scope classes(sbuf);
+    scanner_params sp(scanner_params::PHASE_SCAN,sbuf,wu.job->fs);
+    sp.depth = wu.depth;
+    process_sbuf_call(*wu.scanner,sp);
+}
 
 /* Run the worker.
  * Note that we used to throw internal errors, but this caused problems with some versions of GCC.
@@ -234,45 +848,79 @@ void worker::do_work(sbuf_t *sbuf)
  */
 void *worker::run() 
 {
+    pthread_setspecific(worker_key,this);
+
     /* Initialize any per-thread variables in the scanners */
-    be13::plugin::message_enabled_scanners(scanner_params::PHASE_THREAD_BEFORE_SCAN,master.fs);
+    be13::plugin::message_enabled_scanners(scanner_params::PHASE_THREAD_BEFORE_SCAN,*fs);
+    fs = 0;
+    pthread_mutex_lock(&master.M);
+    __sync_fetch_and_add(&master.started,1);
+    pthread_cond_broadcast(&master.TOMAIN);
+    pthread_mutex_unlock(&master.M);
 
     while(true){
-	/* Get the lock, then wait for the queue to be empty.
-	 * If it is not empty, wait for the lock again.
-	 */
 	if(master.mode==0) waiting.start(); // only if we are not waiting for workers to finish
-	if(pthread_mutex_lock(&master.M)){
-            std::cerr << "worker::run: pthread_mutex_lock failed";
-            return 0;
-	}
-	/* At this point the worker has the lock */
-	while(master.work_queue.empty()){
-	    /* I didn't get any work; go back to sleep */
-	    if(pthread_cond_wait(&master.TOWORKER,&master.M)){
-                std::cerr << "pthread_cond_wait error=%d" << errno << "\n";
+
+        /* Look for work without any global lock; sleep only if there is none anywhere */
+        work_unit wu(0,0,0);
+        while(!master.take_work(id,&wu)){
+            if(pthread_mutex_lock(&master.M)){
+                std::cerr << "worker::run: pthread_mutex_lock failed";
                 return 0;
-	    }
-	}
+            }
+            __sync_fetch_and_add(&master.sleeping,1);
+            while(__sync_fetch_and_add(&master.queued,0)==0){
+                /* I didn't get any work; go back to sleep */
+                if(pthread_cond_wait(&master.TOWORKER,&master.M)){
+                    std::cerr << "pthread_cond_wait error=%d" << errno << "\n";
+                    return 0;
+                }
+            }
+            __sync_fetch_and_sub(&master.sleeping,1);
+            pthread_mutex_unlock(&master.M);
+        }
 	waiting.stop();
-	/* Worker still has the lock */
-	sbuf_t *sbuf = master.work_queue.front(); // get the sbuf
-	master.work_queue.pop();		   // pop from the list
-	master.thread_status.at(id) = std::string("Processing ") + sbuf->pos0.str(); // I have the M lock
-
-	/* release the lock */
-	pthread_mutex_unlock(&master.M);	   // unlock
-	if(sbuf==0) {
+	if(wu.sbuf==0) {
 	  break;
 	}
-	do_work(sbuf);
-	delete sbuf;
-	pthread_mutex_lock(&master.M);
-	master.freethreads++;
-	master.thread_status.at(id) = std::string("Free");
-	pthread_cond_signal(&master.TOMAIN); // tell the master that we are free!
-	pthread_mutex_unlock(&master.M);     // should wake up the master
+        size_t skip = master.constant_skip(wu);
+        if(skip>0 && skip==wu.sbuf->bufsize){
+            delete wu.sbuf;             // nothing in it to find
+            master.work_done(wu);
+            continue;
+        }
+
+        /* A page seen before gets the features of its first copy; a new one is captured */
+        page_dedup::key dedup_key;
+        const bool dedup = wu.depth==0 && wu.scanner==0 && page_dedup::eligible(*wu.sbuf)
+            && dynamic_cast<const file_batch_sbuf *>(wu.sbuf)==0 && dynamic_cast<const file_part_sbuf *>(wu.sbuf)==0;
+        if(dedup){
+            dedup_key = page_dedup::make_key(*wu.sbuf,wu.job->fs);
+            if(page_dedup::replay(dedup_key,*wu.sbuf,wu.job->fs)){
+                delete wu.sbuf;
+                master.work_done(wu);
+                continue;
+            }
+        }
+        if(skip==0 && master.split(id,wu)){
+            __sync_fetch_and_add(&master.freethreads,1); // the last of its units finishes the page
+            continue;
+        }
+        master.set_thread_status(id,std::string("Processing ") + wu.sbuf->pos0.str());
+        if(wu.depth>0) __sync_fetch_and_sub(&master.async_bytes,(uint64_t)wu.sbuf->bufsize); // from recurse()
+        job = wu.job;
+        page = wu.page;
+        if(dedup){
+            page_dedup::capture capture(dedup_key,*wu.sbuf);
+            do_work(wu,skip);
+            capture.commit();
+        } else {
+            do_work(wu,skip);
+        }
+        job = 0;
+	if(wu.split==0) delete wu.sbuf;
+        master.set_thread_status(id,std::string("Free"));
+        master.work_done(wu);
     }
     return 0;
 }
-
@@ -13,51 +13,109 @@
 
 /**
  * \file
- * http://stackoverflow.com/questions/4264460/wait-for-one-of-several-threads-to-finish
- * Here is the algorithm to run the thread pool with a work queue:
+ * The threadpool is a work-stealing scheduler. Each worker owns a
+ * double-ended queue of work units. A work unit is an sbuf to be run
+ * through the scanners, at a given recursion depth.
  *
  * \verbatim
- * main:
- *     set freethreads to numthreads
- *     init mutex M, condvars TOMAIN and TOWORKER
- *     start N worker threads
- *     while true:
- *         wait for work item
- *         claim M
- *         while freethreads == 0:
- *             cond-wait TOMAIN, M
- *         put work item in queue
- *         decrement freethreads
- *         cond-signal TOWORKER
- *         release M
- * 
+ * main (producer):
+ *     start N worker threads, each with an empty deque
+ *     while there is another page:
+ *         while N pages are in flight:
+ *             claim M; cond-wait TOMAIN, M; release M
+ *         push the page onto the back of the next worker's deque (round-robin)
+ *         wake a sleeping worker, if there is one
+ *
  * worker:
- *     init
  *     while true:
- *         claim M
- *         while no work in queue:
- *             cond-wait TOWORKER, M
- *         get work to local storage
- *         release M
- *         do work
- *         claim M
- *         increment freethreads
- *         cond-signal TOMAIN
- *         release M
+ *         pop a unit from the back of my own deque, or
+ *         steal a unit from the front of another worker's deque, or
+ *         sleep on TOWORKER until something is queued
+ *         do work; recursive sub-tasks are pushed on the back of my deque
+ *         if the unit was a page, tell the producer that a page is done
  * \endverbatim
+ *
+ * Each deque has its own lock, so taking work never touches a global lock.
+ * M is only used to put idle workers and a blocked producer to sleep.
+ *
+ * Every unit belongs to a scan_job, the image whose feature recorders it
+ * writes to. Sub-tasks belong to the job of the unit that made them.
  */
 
-#include <queue>
+#include <deque>
 #include <pthread.h>
 #include "be13_api/aftimer.h"
 #include "dfxml/src/dfxml_writer.h"
 
+template < class TYPE > class pooled_malloc;
+
+/* A page that was split into one unit per scanner, at the end of the
+ * image or because only some scanners may see it (a file_part_sbuf).
+ * The units share the sbuf; the last one to finish deletes it and only
+ * then is the page itself done.
+ */
+class split_page {
+public:
+    split_page(sbuf_t *sbuf_,int refs_,double start_,bool tail_,class scan_job *job_,uint64_t page_):
+        sbuf(sbuf_),refs(refs_),start(start_),tail(tail_),scanner_usec(0),job(job_),page(page_){}
+    sbuf_t   *sbuf;
+    volatile int refs;                  // units not yet finished (atomic)
+    double   start;                     // when the page was split
+    bool     tail;                      // split because it was at the end of the image
+    volatile uint64_t scanner_usec;     // total time of its scanners (atomic)
+    class scan_job *job;                // of the page
+    uint64_t page;                      // image offset of the page
+};
+
+/* The image that units belong to: where their features and their
+ * work_start/work_end records go, and its tail. A batch run keeps one
+ * pool for all of its images; the next image may start while the units
+ * of the last one are still running.
+ */
+class scan_job {
+    /*** neither copying nor assignment is implemented ***/
+    scan_job(const scan_job &);
+    scan_job &operator=(const scan_job &);
+public:
+    scan_job(feature_recorder_set &fs_,dfxml_writer &xreport_):fs(fs_),xreport(xreport_),outstanding(0),checkpoint(0),
+        tail_start(0),tail_end(0),longest_page_serial(0),longest_page_wall(0),split_pages(0),split_tasks(0){}
+    feature_recorder_set &fs;
+    dfxml_writer &xreport;
+    volatile int outstanding;           // units of this image not finished (atomic)
+    class page_checkpoint *checkpoint;  // told when each page is complete; may be 0
+    double   tail_start;                // when set_tail() was called
+    double   tail_end;                  // when the last split page finished
+    double   longest_page_serial;       // scanner time of the slowest split page
+    double   longest_page_wall;         // wall time of the slowest split page
+    uint64_t split_pages;               // pages split by scanner
+    uint64_t split_tasks;               // per-scanner units made from them
+};
+
+/* A unit of work: an sbuf to be processed at a recursion depth.
+ * The unit owns the sbuf; it is deleted when the work is done.
+ * A unit with a scanner runs just that scanner, on a split page.
+ */
+class work_unit {
+public:
+    work_unit(sbuf_t *sbuf_,uint32_t depth_,scan_job *job_):sbuf(sbuf_),depth(depth_),scanner(0),split(0),job(job_),
+                                                            page(sbuf_ ? sbuf_->pos0.offset : 0){}
+    sbuf_t   *sbuf;
+    uint32_t depth;                     // 0 for pages read from the image
+    scanner_def *scanner;               // 0 to run all of the scanners
+    split_page  *split;                 // owner of sbuf if scanner is set
+    scan_job *job;                      // image the sbuf came from
+    uint64_t page;                      // image offset of the page it came from
+};
+
 // There is a single threadpool object
 class threadpool {
  private:
     /*** neither copying nor assignment is implemented ***/
     threadpool(const threadpool &);
     threadpool &operator=(const threadpool &);
+    void        enqueue(uint32_t id,const work_unit &wu); // push on the back of worker id's deque
+    void        unit_finished(scan_job *job,uint64_t page,bool whole_page); // after the unit's own work
+    u_int       next_worker;            // round-robin target for the producer
     
  public:
 #ifdef WIN32
@@ -65,23 +123,67 @@ class threadpool {
 #endif
     typedef std::vector<class worker *> worker_vector;
     worker_vector	workers;
-    pthread_mutex_t	M;		// protects the following variables
+    pthread_mutex_t	M;		// only for sleeping; protects no work
     pthread_cond_t	TOMAIN;
     pthread_cond_t	TOWORKER;
-    int			freethreads;
-    std::queue<sbuf_t *> work_queue;	// work to be done
-    feature_recorder_set &fs;		// one for all the threads; fs and fr are threadsafe
-    dfxml_writer	&xreport;	// where the xml gets written; threadsafe
-    std::vector<std::string> thread_status;	// for each thread, its status
+    const int		numthreads;
+    volatile int	freethreads;	// workers not running a unit (atomic)
+    volatile int	queued;		// units sitting in deques (atomic)
+    volatile int	outstanding;	// units scheduled and not finished (atomic)
+    volatile int	pages_in_flight; // top-level pages scheduled and not finished (atomic)
+    volatile int	sleeping;	// workers waiting on TOWORKER (atomic)
+    volatile int	producer_blocked; // producer waiting on TOMAIN (atomic)
+    uint64_t		steals;		// units taken from another worker's deque
+    uint64_t		async_children;	// child buffers handed to the pool by recurse()
+    volatile int	tail;		// producer is near the end; split pages by scanner
+    uint64_t		file_parts;	// pages and whole files of large -R files
+    volatile uint64_t	async_bytes;	// bytes held by queued child buffers (atomic)
+    volatile int	started;	// workers that have initialized their scanners (atomic)
+    scan_job		*default_job;	// the image being scanned, for pages scheduled without a job
+    std::vector<std::string> thread_status;	// for each thread, its status; guarded by that worker's lock
     aftimer		waiting;	// time spend waiting
     int			mode;		// 0=running; 1 = waiting for workers to finish
 
     static u_int	numCPU();
+    /* The CPUs of each NUMA node (one node holding every CPU where there are none),
+     * and binding the calling process to a set of them. */
+    static std::vector<std::vector<int> > numa_nodes();
+    static bool		bind_cpus(const std::vector<int> &cpus);
+
+    /* Recursion: decompressed child buffers may be run as their own tasks */
+    static bool		opt_async_recursion;
+    static uint32_t	opt_async_recursion_min_bytes;	// smaller children are processed in place
+    static uint32_t	opt_async_recursion_max_mb;	// cap on bytes held by queued children
+    static void		recurse(const scanner_params &sp,const recursion_control_block &rcb,
+                                const sbuf_t &child,pooled_malloc<uint8_t> *owner=0);
+
+    /* Constant data: wiped and sparse regions are not run through the scanners */
+    static bool		opt_skip_constant;
+    static uint32_t	opt_skip_constant_min_bytes;	// shortest leading run worth cutting off
+    uint64_t		constant_units;	// units that were entirely one byte value
+    uint64_t		constant_bytes;	// bytes not scanned because they were constant
+    size_t		constant_skip(const work_unit &wu); // bytes at the start of wu not to scan
+    void		dump_constant_stats(dfxml_writer &xreport);
 
-    threadpool(int numthreads,feature_recorder_set &fs_,dfxml_writer &xreport);
+    /* Straggler mitigation: at the end of the image, pages become per-scanner units */
+    static bool		opt_tail_split;
+    void		set_tail();		// called by the producer, for the default job
+    void		clear_tail();		// a new image is starting
+    bool		split(uint32_t id,const work_unit &wu); // true if wu was split (or needed no scanners)
+    void		split_done(const work_unit &wu,double seconds);
+    void		dump_tail_stats(const scan_job &job,dfxml_writer &xreport);
+    void		reset_stats();		// after a report; the next image may be running
+
+    /* fs is used only to initialize each worker's scanners, before the constructor returns */
+    threadpool(int numthreads,feature_recorder_set &fs);
     virtual ~threadpool();
-    void		schedule_work(sbuf_t *sbuf);
+    void		set_default_job(scan_job *job){default_job=job;} // once per image, by its producer
+    void		schedule_work(sbuf_t *sbuf,scan_job *job=0); // called by the producer; may block
+    bool		schedule_subtask(sbuf_t *sbuf,uint32_t depth); // called by a worker; never blocks
+    bool		take_work(uint32_t id,work_unit *wu); // pop own deque or steal; false if nothing
+    void		work_done(const work_unit &wu);
     bool		all_free();
+    bool		job_done(scan_job &job); // no units of job are left
     int			get_free_count();
     std::string		get_thread_status(uint32_t id);
     void		set_thread_status(uint32_t id, const std::string &status );
@@ -90,7 +192,11 @@ class threadpool {
 // there is a worker object for each thread
 class worker {
 private:
-    void do_work(sbuf_t *sbuf);		// do the work; does not delete sbuf
+    /*** neither copying nor assignment is implemented ***/
+    worker(const worker &);
+    worker &operator=(const worker &);
+    void do_work(const work_unit &wu,size_t skip); // do the work, but not on the first skip bytes; does not delete sbuf
+    void run_scanner(const work_unit &wu);	// run one scanner on a split page
     class internal_error: public std::exception {
         virtual const char *what() const throw() {
             return "internal error.";
@@ -99,10 +205,19 @@ private:
 public:
     static bool opt_work_start_work_end; // report when work starts and when work ends
     static void * start_worker(void *arg){return ((worker *)arg)->run();};
+    static worker *current();           // the worker running on this thread, or 0
     class threadpool &master;		// my master
     pthread_t thread;			// my thread; set when I am created
     uint32_t id;				// my number
-    worker(class threadpool &master_,uint32_t id_): master(master_),thread(),id(id_),waiting(){}
+    pthread_mutex_t M;			// protects deque and my entry in master.thread_status
+    std::deque<work_unit> deque;	// my work; owner uses the back, thieves the front
+    scan_job *job;			// job of the unit being run; sub-tasks inherit it
+    uint64_t page;                      // and the page it came from
+    feature_recorder_set *fs;		// to initialize the scanners; 0 once they are
+    worker(class threadpool &master_,uint32_t id_): master(master_),thread(),id(id_),M(),deque(),job(0),page(0),fs(0),waiting(){
+        pthread_mutex_init(&M,NULL);
+    }
+    ~worker(){ pthread_mutex_destroy(&M); }
     void *run();
     aftimer		waiting;	// time spend waiting
 };
@@ -529,6 +529,7 @@ def diff(dname1,dname2):
         print("Files only in {}:\n   {}".format(dname2," ".join(files2.difference(files1))))
 
     # Look at the common files. For each report the files only in one or the other
+    differ = len(files1.symmetric_difference(files2))
     common = files1.intersection(files2)
     for fn in sorted(common):
         fn1 = os.path.join(dname1,fn)
@@ -562,11 +563,13 @@ def diff(dname1,dname2):
         lines1 = lines_to_set(fn1)
         lines2 = lines_to_set(fn2)
         if lines1!=lines2:
+            differ += 1
             print("regressdiff {}:".format(fn))
             count1 = print_diff(dname1,"<",lines1.difference(lines2))
             count2 = print_diff(dname2,">",lines2.difference(lines1))
             if count1 or count2:
                 print("\n-------------\n")
+    return differ
 
 
 def run_and_analyze():
@@ -582,6 +585,128 @@ def run_and_analyze():
     print("Regression finished at {}. Elapsed time: {} ({} sec)\nOutput in {}".format(
         time.asctime(),ptime(t),t,outdir))
 
+def carved_files(outdir):
+    """The files in the subdirectories of outdir (the carved files), with their sizes"""
+    files = set()
+    for (dirpath,dirnames,filenames) in os.walk(outdir):
+        if dirpath==outdir:
+            dirnames[:] = [d for d in dirnames if not d.startswith("shard-")] # what -J left after the merge
+            continue
+        for fn in filenames:
+            path = os.path.join(dirpath,fn)
+            files.add((os.path.relpath(path,outdir),os.path.getsize(path)))
+    return files
+
+def feature_lines(outdir):
+    """The lines of each feature file in outdir, without the comments and the histograms"""
+    ret = {}
+    for fn in glob.glob(outdir + "/*.txt"):
+        if "histogram" in fn: continue
+        ret[os.path.basename(fn)] = set(filter(lambda line:line[0:1]!='#',open(fn).read().split("\n")))
+    return ret
+
+def lines_lost(outdir1,outdir2):
+    """Print and count the feature lines and carved files in outdir1 that are not in outdir2"""
+    lines2 = feature_lines(outdir2)
+    lost = 0
+    for (fn,lines) in sorted(feature_lines(outdir1).items()):
+        missing = lines.difference(lines2.get(fn,set()))
+        for line in sorted(missing)[0:int(args.max)]:
+            print("{} only in {}: {}".format(fn,outdir1,line[0:args.diffwidth]))
+        lost += len(missing)
+    for (fn,size) in sorted(carved_files(outdir1).difference(carved_files(outdir2))):
+        print("carved only in {}: {} ({} bytes)".format(outdir1,fn,size))
+        lost += 1
+    return lost
+
+def compare_runs(what,settings,relation="same"):
+    """Scan the image once with each of settings (extra arguments, the baseline first) and compare the output.
+    relation is "same", "adds" (a run may write lines the baseline does not)
+    or "drops" (a run may leave out lines the baseline writes)."""
+    outdir_base = args.outdir
+    extra = args.extra
+    outdirs = []
+    for (name,setting) in settings:
+        args.outdir = outdir_base + "-" + name
+        args.extra  = " ".join(filter(None,[extra,setting]))
+        outdir = run_outdir()
+        sort_outdir(outdir)
+        outdirs.append(outdir)
+    args.outdir = outdir_base
+    args.extra = extra
+    differ = 0
+    for outdir in outdirs[1:]:
+        if relation=="adds":
+            changed = lines_lost(outdirs[0],outdir)
+        elif relation=="drops":
+            changed = lines_lost(outdir,outdirs[0])
+        else:
+            changed = diff(outdirs[0],outdir)
+            carved = carved_files(outdirs[0]).symmetric_difference(carved_files(outdir))
+            for (fn,size) in sorted(carved):
+                print("carved in only one of {} and {}: {} ({} bytes)".format(outdirs[0],outdir,fn,size))
+            changed += len(carved)
+        if changed:
+            print("{} changed the output in {}".format(what,outdir))
+            differ += 1
+    return differ
+
+def memocheck():
+    """Scan the image with child_memo off and on; a hit must write what a cold scan does"""
+    args.jobs = 1                       # the same copy of each child is the first in both runs
+    if args.extra and "carve_mode" in args.extra:
+        raise RuntimeError("--memocheck runs with the default carve modes, which decide when zip and rar replay")
+    if compare_runs("child_memo",[("cold","-S child_memo_entries=0"),("memo","")]):
+        exit(1)
+    print("child_memo output matches the cold scan")
+    exit(0)
+
+def constcheck():
+    """Scan pages that start with zeros, and one that is all zeros, with skip_constant off and on"""
+    pagesize = args.pagesize if args.pagesize else 16*MiB
+    image = args.outdir + "-zeroprefix.raw"
+    with open(args.image,"rb") as src:
+        with open(image,"wb") as dst:
+            for prefix in [pagesize,128*1024,pagesize//2+1000,pagesize-4096]:
+                dst.write(b"\0" * prefix)
+                dst.write(src.read(pagesize-prefix))
+            dst.write(src.read(pagesize))
+    args.image = image
+    if compare_runs("skip_constant",[("whole","-S skip_constant=NO"),("skip","-S skip_constant=YES")]):
+        exit(1)
+    print("skip_constant output matches the scan of the whole pages")
+    exit(0)
+
+def featurecheck():
+    """Scan the image with the optimizations off, then with each of them on by itself.
+    Each must write what the plain scan does, except that page_dedup also writes the
+    features of each repeated page and page_classes leaves out text found in random data."""
+    args.jobs = 1
+    plain = " ".join(["-S tail_split=NO","-S skip_constant=NO","-S readahead_pages=0",
+                      "-S read_error_sector_bytes=0","-S magic_prefilter=NO",
+                      "-S page_dedup=NO","-S page_classes=NO"])
+    differ = compare_runs("the optimizations",
+                          [("plain",plain),
+                           ("stealing",plain+" -j4"),
+                           ("tail_split",plain+" -j4 -S tail_split=YES"),
+                           ("skip_constant",plain+" -S skip_constant=YES"),
+                           ("readahead",plain+" -S readahead_pages=8"),
+                           ("salvage",plain+" -S read_error_sector_bytes=512"),
+                           ("shards",plain+" -j4 -J 4"),
+                           ("magic_prefilter",plain+" -S magic_prefilter=YES")])
+    # main() turns page_dedup off with the scanners whose output it cannot replay
+    replayable = plain + " " + " ".join(["-S jpeg_carve_mode=0","-S unzip_carve_mode=0","-S unrar_carve_mode=0",
+                                         "-S sqlite_carve_mode=0","-S winpe_carve_mode=0",
+                                         "-x kml","-x vcard","-x net"])
+    differ += compare_runs("page_dedup",[("plain-nocarve",replayable),
+                                         ("page_dedup",replayable+" -S page_dedup=YES")],relation="adds")
+    differ += compare_runs("page_classes",[("plain-classes",plain),
+                                           ("page_classes",plain+" -S page_classes=YES")],relation="drops")
+    if differ:
+        exit(1)
+    print("each optimization writes what the plain scan does")
+    exit(0)
+
 def datadircomp(dir1,dir2):
     print("Validating reports in {} and {}".format(dir1,dir2))
     for d in [dir1,dir2]:
@@ -695,6 +820,9 @@ if __name__=="__main__":
     parser.add_argument("--dry-run",help="Don't actually run the program",action='store_true')
     parser.add_argument("--datadircomp",help="Compare two data dirs")
     parser.add_argument("--datacheck",help="Runs BE on the files in Data/ directory and makes sure that all of the features in data_check.txt are found",action='store_true')
+    parser.add_argument("--memocheck",help="Scan the image with child_memo off and on and compare the feature files",action='store_true')
+    parser.add_argument("--constcheck",help="Make pages that start with zeros from the image, scan them with skip_constant off and on and compare the feature files",action='store_true')
+    parser.add_argument("--featurecheck",help="Scan the image with the optimizations off, then with each of them on by itself, and compare the output",action='store_true')
     parser.add_argument("--datacheckreport",help="Checks the files in in Data/ directory and makes sure that all of the features in data_check.txt are found")
 
     args = parser.parse_args()
@@ -790,6 +918,10 @@ if __name__=="__main__":
     if not os.path.exists(args.image):
         args.image = find_file(drives+args.image)
 
+    if args.memocheck: memocheck()
+    if args.constcheck: constcheck()
+    if args.featurecheck: featurecheck()
+
     if args.memdebug:
         fn = "/usr/lib/libgmalloc.dylib"
         if os.path.exist(fn):